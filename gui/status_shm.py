@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+
+"""
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+    
+    status_shm.py reads the status page that pi_fm_rds publishes in shared
+    memory when started with -shm. It can be imported, or run to print the
+    status once.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+
+import mmap, os, struct, sys
+
+# Must match struct pifmrds_status in src/status_shm.h
+FORMAT = "<IIIIQQIIfIIIIIQIIffHBBBBH28s16s68s64sII"
+FIELDS = ("magic", "version", "size", "seq", "samples", "timestamp_us",
+          "sample_rate", "freq", "ppm", "lead", "lead_min", "lead_max",
+          "underruns", "mpx_max_us", "audio_frames", "audio_rate",
+          "audio_channels", "peak_left", "peak_right", "pi", "pty", "ta",
+          "rt_plus", "af_count", "reserved", "af", "ps", "rt", "source",
+          "audio_state", "audio_dropouts")
+MAGIC = 0x524D4650
+SEQ_OFFSET = 12
+
+class StatusPage:
+    def __init__(self, name="pifmrds"):
+        fd = os.open("/dev/shm/" + name.lstrip("/"), os.O_RDONLY)
+        self.map = mmap.mmap(fd, struct.calcsize(FORMAT), mmap.MAP_SHARED, mmap.PROT_READ)
+        os.close(fd)
+
+    def read(self):
+        while True:
+            seq1 = struct.unpack_from("<I", self.map, SEQ_OFFSET)[0]
+            if seq1 & 1:
+                continue
+            raw = self.map[:struct.calcsize(FORMAT)]
+            seq2 = struct.unpack_from("<I", self.map, SEQ_OFFSET)[0]
+            if seq1 == seq2:
+                break
+
+        status = dict(zip(FIELDS, struct.unpack(FORMAT, raw)))
+        if status["magic"] != MAGIC:
+            raise ValueError("not a PiFmRds status page")
+        status["af"] = list(status["af"][:status["af_count"]])
+        for key in ("ps", "rt", "source"):
+            status[key] = status[key].split(b"\0")[0].decode("latin-1")
+        return status
+
+if __name__ == "__main__":
+    page = StatusPage(sys.argv[1] if len(sys.argv) > 1 else "pifmrds")
+    for key, value in page.read().items():
+        print("%-15s %s" % (key, value))
@@ -0,0 +1,135 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Single producer, single consumer ring of audio samples.
+
+   The producer only moves 'tail' and the consumer only moves 'head', so
+   neither needs a lock: the release store of one side, paired with the
+   acquire load of the other, makes the samples visible before the index
+   that covers them. Counts are always whole frames.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_ring.h"
+
+
+/*
+ * Allocates a ring of at least 'samples' samples. Returns -1 on error.
+ */
+int audio_ring_init(struct audio_ring *ring, size_t samples, int channels) {
+    uint32_t size = 1024;
+    while(size < samples) size <<= 1;
+
+    // Frames must not straddle the end of the buffer
+    if(channels < 1 || size % channels != 0) return -1;
+
+    ring->data = calloc(size, sizeof(float));
+    if(ring->data == NULL) return -1;
+
+    ring->size = size;
+    ring->head = ring->tail = 0;
+    ring->channels = channels;
+    ring->overruns = 0;
+    return 0;
+}
+
+void audio_ring_free(struct audio_ring *ring) {
+    free(ring->data);
+    ring->data = NULL;
+}
+
+static size_t whole_frames(struct audio_ring *ring, size_t count) {
+    return count - count % ring->channels;
+}
+
+/*
+ * Returns the number of contiguous samples that can be written at
+ * '*samples', to be followed by audio_ring_commit(). Producer side.
+ */
+size_t audio_ring_write_space(struct audio_ring *ring, float **samples) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    uint32_t offset = tail & (ring->size - 1);
+
+    size_t space = ring->size - (tail - head);
+    if(space > ring->size - offset) space = ring->size - offset;
+
+    *samples = ring->data + offset;
+    return whole_frames(ring, space);
+}
+
+void audio_ring_commit(struct audio_ring *ring, size_t count) {
+    __atomic_store_n(&ring->tail, ring->tail + (uint32_t)count, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies samples into the ring. What does not fit is dropped and counted as
+ * an overrun. Returns the number of samples written. Producer side.
+ */
+size_t audio_ring_write(struct audio_ring *ring, const float *samples, size_t count) {
+    size_t written = 0;
+    count = whole_frames(ring, count);
+
+    // At most two contiguous parts, before and after the end of the buffer
+    for(int part=0; part<2 && written < count; part++) {
+        float *dest;
+        size_t space = audio_ring_write_space(ring, &dest);
+        if(space == 0) break;
+        if(space > count - written) space = count - written;
+
+        memcpy(dest, samples + written, space * sizeof(float));
+        audio_ring_commit(ring, space);
+        written += space;
+    }
+
+    if(written < count) __atomic_fetch_add(&ring->overruns, 1, __ATOMIC_RELAXED);
+    return written;
+}
+
+/*
+ * Copies up to 'count' samples out of the ring. Returns the number of
+ * samples read. Consumer side.
+ */
+size_t audio_ring_read(struct audio_ring *ring, float *samples, size_t count) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = ring->head;
+
+    size_t available = tail - head;
+    if(count > available) count = available;
+    count = whole_frames(ring, count);
+
+    uint32_t offset = head & (ring->size - 1);
+    size_t first = ring->size - offset;
+    if(first > count) first = count;
+    memcpy(samples, ring->data + offset, first * sizeof(float));
+    memcpy(samples + first, ring->data, (count - first) * sizeof(float));
+
+    __atomic_store_n(&ring->head, head + (uint32_t)count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/*
+ * Number of samples waiting in the ring, from either side.
+ */
+size_t audio_ring_fill(struct audio_ring *ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
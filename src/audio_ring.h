@@ -0,0 +1,48 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AUDIO_RING_H
+#define AUDIO_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Ring of interleaved float samples between one producer thread (an audio
+   reader) and one consumer, the multiplex generator.
+ */
+struct audio_ring
+{
+    float *data;
+    uint32_t size;      // in samples, a power of two
+    uint32_t head;      // next sample to read, moved by the consumer only
+    uint32_t tail;      // next sample to write, moved by the producer only
+    int channels;
+    uint32_t overruns;  // writes that did not fit
+};
+
+extern int audio_ring_init(struct audio_ring *ring, size_t samples, int channels);
+extern void audio_ring_free(struct audio_ring *ring);
+extern size_t audio_ring_write(struct audio_ring *ring, const float *samples, size_t count);
+extern size_t audio_ring_write_space(struct audio_ring *ring, float **samples);
+extern void audio_ring_commit(struct audio_ring *ring, size_t count);
+extern size_t audio_ring_read(struct audio_ring *ring, float *samples, size_t count);
+extern size_t audio_ring_fill(struct audio_ring *ring);
+
+#endif /* AUDIO_RING_H */
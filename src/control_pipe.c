@@ -21,8 +21,9 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
     
-    control_pipe.c: handles command written to a non-blocking control pipe,
-    in order to change RDS PS and RT at runtime.
+    control_pipe.c: handles command written to a control pipe, in order to
+    change RDS PS and RT at runtime. The pipe is read by a dedicated thread,
+    which hands the commands over to the RDS encoder.
 */
 
 
@@ -31,62 +32,116 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <stdlib.h>
 
 #include "rds.h"
 #include "control_pipe.h"
+#include "telemetry.h"
 
 #define CTL_BUFFER_SIZE 100
+#define CTL_READ_SIZE 4096
+#define CTL_MAX_EVENTS 16
+#define CTL_MAX_WATCHES 64
+#define CTL_MAX_BATCH 64
 
-FILE *f_ctl;
+struct control_watch
+{
+    int fd;
+    control_handler handler;
+    void *ctx;
+};
 
-/*
- * Opens a file (pipe) to be used to control the RDS coder, in non-blocking mode.
- */
-int open_control_pipe(char *filename) {
-	int fd = open(filename, O_RDWR);
+static struct control_watch watches[CTL_MAX_WATCHES];
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static int ctl_fd = -1;
+static pthread_t control_thread_id;
+static volatile int control_running = 0;
+// Set by close_control_pipe(), also seen while waiting on a full queue
+static int control_stopping = 0;
+static int rt_from_dbus = 0;
+static uint32_t control_events = 0;
+uint32_t requested_freq = 0;
 
-    // If the pipe doesnt exist - we create it
-    if(fd == -1) {
-        mode_t oldmask = umask(0000);
-        mkfifo(filename, 0666);
-        umask(oldmask);
-        fd = open(filename, O_RDWR);
-    }
+// Partial line read from the pipe, completed by the next read
+static char line_buf[CTL_BUFFER_SIZE];
+static int line_len = 0;
+static int line_too_long = 0;
+
+// Time (CLOCK_REALTIME, in ns) at which output sample 0 was on the air
+static int64_t timeline_epoch = 0;
+// Samples handed to the DMA engine at the last wakeup of the transmitter loop
+static uint64_t written_position = 0;
 
-	int flags;
-	flags = fcntl(fd, F_GETFL, 0);
-	flags |= O_NONBLOCK;
-	if( fcntl(fd, F_SETFL, flags) == -1 ) return -1;
+// Called on the control thread for every event, see set_control_event_hook()
+static void (*event_hook)(int code) = NULL;
 
-	f_ctl = fdopen(fd, "r");
-	if(f_ctl == NULL) return -1;
+// Commands between BEGIN and COMMIT
+static struct rds_transaction transaction;
+static int in_transaction = 0;
 
-	return 0;
+
+/*
+ * Reports an event (CONTROL_PIPE_* code) to the transmitter loop.
+ */
+void raise_control_event(int code) {
+    __atomic_fetch_or(&control_events, CONTROL_EVENT(code), __ATOMIC_RELEASE);
+    void (*hook)(int code) = __atomic_load_n(&event_hook, __ATOMIC_ACQUIRE);
+    if(hook) hook(code);
 }
 
+/*
+ * Sets a function called on the control thread whenever an event is raised,
+ * for the modules which have to react before the next command is read.
+ * The control thread may already be running: what the hook uses must be
+ * set up before the call.
+ */
+void set_control_event_hook(void (*hook)(int code)) {
+    __atomic_store_n(&event_hook, hook, __ATOMIC_RELEASE);
+}
 
 /*
- * Polls the control file (pipe), non-blockingly, and if a command is received,
- * processes it and updates the RDS data.
+ * Parses one command line. Commands for the RDS encoder are stored in 'cmd'
+ * (cmd->type is 0 otherwise), transmitter commands are carried out or
+ * reported to the transmitter loop. Returns the CONTROL_PIPE_* code of the
+ * command, -1 if the line was not understood.
  */
-int poll_control_pipe(int dbus_mediainfo) {
-	static char buf[CTL_BUFFER_SIZE];
+int parse_control_line(char *res, struct rds_command *cmd) {
+    memset(cmd, 0, sizeof(struct rds_command));
 
-    char *res = fgets(buf, CTL_BUFFER_SIZE, f_ctl);
-    if(res == NULL) return -1;
+    if(strncmp(res, "STATS", 5) == 0) {
+        telemetry_print(stdout);
+        return CONTROL_PIPE_STATS;
+    }
+    if(strncmp(res, "FREQ ", 5) == 0) {
+        uint32_t freq = 1e6 * atof(res+5);
+        if (freq < 76e6 || freq > 108e6)
+        {
+            fprintf(stderr, "Error: Frequency must be in megahertz, between 76 and 108.\n");
+            return -1;
+        }
+        __atomic_store_n(&requested_freq, freq, __ATOMIC_RELAXED);
+        printf("Retuning to %3.1f MHz\n", freq/1e6);
+        return CONTROL_PIPE_FREQ_SET;
+    }
     if(strlen(res) > 3 && (res[2] == ' ' || res[3] == ' ')) {
         char *arg = res+3;
         if(arg[strlen(arg)-1] == '\n') arg[strlen(arg)-1] = 0;
         if(res[0] == 'P' && res[1] == 'S') {
             arg[8] = 0;
-            set_rds_ps(arg);
+            cmd->type = RDS_CMD_PS;
+            strcpy(cmd->text, arg);
             printf("PS set to: \"%s\"\n", arg);
             return CONTROL_PIPE_PS_SET;
         }
         else if(res[0] == 'R' && res[1] == 'T' && res[2] == '+') {
-            if (dbus_mediainfo)
+            if (rt_from_dbus)
             {
                 printf("RT+ was not toggled. Pulling from metadata.\n");
             }
@@ -94,33 +149,37 @@ int poll_control_pipe(int dbus_mediainfo) {
             {
                 if (strcmp(arg+1, "ON") == 0)
                 {
-                    set_rds_rt_tags();
+                    cmd->type = RDS_CMD_RT_PLUS;
+                    cmd->value = 1;
                     printf("RT+ toggled. Song metadata from RT will be layed out.\nNote: Make sure your format is: 'Artist - SongName'\n");
                 }
                 else if (strcmp(arg+1, "OFF") == 0) 
                 {
-                    clear_rds_rt_tags();
+                    cmd->type = RDS_CMD_RT_PLUS;
+                    cmd->value = 0;
                     printf("Not broadcasting RT+ anymore.\n");
                 }
             }
             return CONTROL_PIPE_RT_PLUS_SET;
         }
         else if(res[0] == 'R' && res[1] == 'T') {
-            if (dbus_mediainfo)
+            if (rt_from_dbus)
             {
                 printf("RT was not set. Pulling from metadata.\n");
             }
             else
             {
                 arg[64] = 0;
-                set_rds_rt(arg);
+                cmd->type = RDS_CMD_RT;
+                strcpy(cmd->text, arg);
                 printf("RT set to: \"%s\"\n", arg);
             }
             return CONTROL_PIPE_RT_SET;
         }
         else if(res[0] == 'T' && res[1] == 'A') {
             int ta = ( strcmp(arg, "ON") == 0 );
-            set_rds_ta(ta);
+            cmd->type = RDS_CMD_TA;
+            cmd->value = ta;
             printf("Set TA to ");
             if(ta) printf("ON\n"); else printf("OFF\n");
             return CONTROL_PIPE_TA_SET;
@@ -128,25 +187,26 @@ int poll_control_pipe(int dbus_mediainfo) {
         else if(res[0] == 'P' && res[1] == 'T' && res[2] == 'Y') {
             uint8_t pty = (uint8_t) (atoi(arg+1));
             if (pty > 31) pty = 31;
-            set_rds_pty(pty);
+            cmd->type = RDS_CMD_PTY;
+            cmd->value = pty;
             printf("Set PTS to: %d\n", pty);
             return CONTROL_PIPE_AF_ADDED;
         }
         else if(res[0] == 'A' && res[1] == 'F') {
             if (strcmp(arg, "CLEAR") == 0)
             {
-                clear_rds_af();
+                cmd->type = RDS_CMD_AF_CLEAR;
                 printf("Cleared all AFs\n");
                 return CONTROL_PIPE_AF_CLEARED;
             }
-            uint8_t af = mhz_to_binary((int)(1e6 * atof(arg)));
-            add_rds_af(af);
+            cmd->type = RDS_CMD_AF_ADD;
+            cmd->value = mhz_to_binary((int)(1e6 * atof(arg)));
             printf("Added AF: \"%s\"\n", arg);
             return CONTROL_PIPE_AF_ADDED;
         }
         else if(res[0] == 'P' && res[1] == 'I') {
-            uint16_t pi = (uint16_t) strtol(arg, NULL, 16);
-            set_rds_pi(pi);
+            cmd->type = RDS_CMD_PI;
+            cmd->value = (uint16_t) strtol(arg, NULL, 16);
             printf("Set PI to: %s\n", arg);
             return CONTROL_PIPE_PI_CHANGED;
         }
@@ -156,11 +216,299 @@ int poll_control_pipe(int dbus_mediainfo) {
 }
 
 /*
- * Closes the control pipe.
+ * Called by the transmitter loop with the position on the output timeline
+ * of the sample being played, to map wall clock times to samples, and the
+ * number of samples written so far.
+ */
+void set_output_position(uint64_t sample, uint64_t written) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    int64_t epoch = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - (int64_t)(sample * (1e9 / get_rds_sample_rate()));
+    __atomic_store_n(&timeline_epoch, epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&written_position, written, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the number of samples written at the last wakeup of the
+ * transmitter loop, 0 if it has not started yet.
+ */
+uint64_t get_written_position() {
+    return __atomic_load_n(&written_position, __ATOMIC_RELAXED);
+}
+
+/*
+ * Converts a Unix time to a position on the output timeline. Returns 0
+ * if the transmitter has not started yet.
+ */
+uint64_t wall_clock_to_sample(double t) {
+    int64_t epoch = __atomic_load_n(&timeline_epoch, __ATOMIC_RELAXED);
+    if(epoch == 0) return 0;
+
+    int64_t sample = (int64_t)((t * 1e9 - epoch) * (get_rds_sample_rate() / 1e9));
+    return sample > 0 ? sample : 1;
+}
+
+/*
+ * Parses the time of a scheduled command: "#<sample>" for a position on the
+ * output timeline, or a Unix time in seconds. Returns the output sample,
+ * 0 if the time cannot be understood.
+ */
+uint64_t parse_control_time(char *when) {
+    if(when[0] == '#') return strtoull(when+1, NULL, 10);
+    return wall_clock_to_sample(atof(when));
+}
+
+/*
+ * Hands a batch of commands to the RDS encoder. They are all applied at the
+ * same group boundary. If the queue is full, waits for the encoder to catch
+ * up: the control thread stops reading, and the writers block on the pipe.
+ */
+void submit_rds_commands(struct rds_command *cmds, int count) {
+    while(count > 0 && control_running) {
+        // The encoder may never drain the queue again once the transmitter
+        // is shutting down
+        if(__atomic_load_n(&control_stopping, __ATOMIC_ACQUIRE)) {
+            fprintf(stderr, "Warning: shutting down, %d RDS change(s) dropped.\n", count);
+            return;
+        }
+        int n = count > CTL_MAX_BATCH ? CTL_MAX_BATCH : count;
+        if(queue_rds_commands(cmds, n) == 0) {
+            cmds += n;
+            count -= n;
+        } else {
+            usleep(1000);
+        }
+    }
+}
+
+/* Whether 'line' is 'word' alone, up to the end of the line */
+static int is_keyword(const char *line, const char *word) {
+    size_t n = strlen(word);
+    return strncmp(line, word, n) == 0 && (line[n] == 0 || line[n] == '\n');
+}
+
+/*
+ * Reads everything available on the pipe and processes the complete lines.
+ * A line cut by the end of a read is kept until the rest arrives. All the
+ * commands of one read form a single batch.
+ */
+static void read_control_pipe(int fd, uint32_t events, void *ctx) {
+    char buf[CTL_READ_SIZE];
+    struct rds_command batch[CTL_MAX_BATCH];
+    int batch_len = 0;
+    ssize_t len;
+
+    while((len = read(fd, buf, sizeof(buf))) > 0) {
+        for(int i=0; i<len; i++) {
+            if(line_len < CTL_BUFFER_SIZE - 1) {
+                line_buf[line_len++] = buf[i];
+            } else {
+                line_too_long = 1;
+            }
+            if(buf[i] != '\n') continue;
+
+            line_buf[line_len] = 0;
+            if(line_too_long) {
+                fprintf(stderr, "Error: Control command too long, ignored.\n");
+            } else if(is_keyword(line_buf, "BEGIN")) {
+                if(in_transaction) {
+                    fprintf(stderr, "Error: Transaction already open (%d changes), BEGIN ignored.\n", transaction.count);
+                } else {
+                    rds_begin(&transaction);
+                    in_transaction = 1;
+                }
+            } else if(in_transaction && (is_keyword(line_buf, "COMMIT") || strncmp(line_buf, "COMMIT AT ", 10) == 0)) {
+                // "COMMIT AT <time>" schedules the transaction
+                uint64_t at = 0;
+                if(line_buf[6] == ' ' && (at = parse_control_time(line_buf+10)) == 0)
+                    fprintf(stderr, "Error: Invalid time, committing now.\n");
+                for(int j=0; j<transaction.count; j++) transaction.cmds[j].at = at;
+
+                // Whatever came before in this read goes first
+                submit_rds_commands(batch, batch_len);
+                batch_len = 0;
+                submit_rds_commands(transaction.cmds, transaction.count);
+                printf("Committed %d changes\n", transaction.count);
+                in_transaction = 0;
+            } else if(in_transaction && is_keyword(line_buf, "ABORT")) {
+                printf("Discarded %d changes\n", transaction.count);
+                in_transaction = 0;
+            } else if(strncmp(line_buf, "AT ", 3) == 0) {
+                // "AT <time> <command>": a transaction of its own
+                struct rds_command cmd;
+                char *command = strchr(line_buf+3, ' ');
+                uint64_t at = command ? parse_control_time(line_buf+3) : 0;
+                if(at == 0 || in_transaction) {
+                    fprintf(stderr, "Error: Invalid scheduled command, ignored.\n");
+                } else if(parse_control_line(command+1, &cmd) >= 0 && cmd.type != 0) {
+                    cmd.at = at;
+                    submit_rds_commands(batch, batch_len);
+                    batch_len = 0;
+                    submit_rds_commands(&cmd, 1);
+                }
+            } else if(in_transaction) {
+                struct rds_command cmd;
+                int code = parse_control_line(line_buf, &cmd);
+                if(code >= 0) raise_control_event(code);
+                if(cmd.type != 0 && rds_set(&transaction, cmd.type, cmd.value, cmd.text) < 0)
+                    fprintf(stderr, "Error: Too many changes in one transaction, ignored.\n");
+            } else {
+                int code = parse_control_line(line_buf, &batch[batch_len]);
+                if(code >= 0) raise_control_event(code);
+                if(batch[batch_len].type != 0) batch_len++;
+                if(batch_len == CTL_MAX_BATCH) {
+                    submit_rds_commands(batch, batch_len);
+                    batch_len = 0;
+                }
+            }
+            line_len = 0;
+            line_too_long = 0;
+        }
+    }
+    submit_rds_commands(batch, batch_len);
+}
+
+static void stop_control_thread(int fd, uint32_t events, void *ctx) {
+    uint64_t val;
+    read(fd, &val, sizeof(val));
+    control_running = 0;
+}
+
+static void *control_main(void *arg) {
+    // Termination signals are handled by the transmitter thread
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct epoll_event events[CTL_MAX_EVENTS];
+
+    while(control_running) {
+        int n = epoll_wait(epoll_fd, events, CTL_MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Error: epoll_wait failed on the control thread.\n");
+            break;
+        }
+        for(int i=0; i<n; i++) {
+            struct control_watch *w = events[i].data.ptr;
+            if(w->fd >= 0) w->handler(w->fd, events[i].events, w->ctx);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the control thread, if it is not running yet.
+ */
+int start_control_thread() {
+    if(control_running) return 0;
+
+    for(int i=0; i<CTL_MAX_WATCHES; i++) watches[i].fd = -1;
+
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(epoll_fd < 0 || wake_fd < 0) return -1;
+
+    control_running = 1;
+    __atomic_store_n(&control_stopping, 0, __ATOMIC_RELEASE);
+    control_watch_fd(wake_fd, stop_control_thread, NULL);
+
+    if(pthread_create(&control_thread_id, NULL, control_main, NULL) != 0) {
+        control_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Makes the control thread call 'handler' whenever 'fd' is readable.
+ */
+int control_watch_fd(int fd, control_handler handler, void *ctx) {
+    for(int i=0; i<CTL_MAX_WATCHES; i++) {
+        if(watches[i].fd >= 0) continue;
+
+        watches[i].fd = fd;
+        watches[i].handler = handler;
+        watches[i].ctx = ctx;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &watches[i];
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            watches[i].fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+void control_unwatch_fd(int fd) {
+    for(int i=0; i<CTL_MAX_WATCHES; i++) {
+        if(watches[i].fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            watches[i].fd = -1;
+        }
+    }
+}
+
+/*
+ * Opens a file (pipe) to be used to control the RDS coder. It is read by the
+ * control thread, which blocks until commands arrive.
+ */
+int open_control_pipe(char *filename, int dbus_mediainfo) {
+    int fd = open(filename, O_RDWR);
+
+    // If the pipe doesnt exist - we create it
+    if(fd == -1) {
+        mode_t oldmask = umask(0000);
+        mkfifo(filename, 0666);
+        umask(oldmask);
+        fd = open(filename, O_RDWR);
+    }
+    if(fd == -1) return -1;
+
+    int flags;
+    flags = fcntl(fd, F_GETFL, 0);
+    flags |= O_NONBLOCK;
+    if( fcntl(fd, F_SETFL, flags) == -1 ) return -1;
+
+    rt_from_dbus = dbus_mediainfo;
+
+    if(start_control_thread() < 0) return -1;
+    if(control_watch_fd(fd, read_control_pipe, NULL) < 0) return -1;
+    ctl_fd = fd;
+
+    return 0;
+}
+
+
+/*
+ * Returns the events (CONTROL_EVENT bits) reported by the control thread
+ * since the previous call. Never blocks.
+ */
+int poll_control_pipe() {
+    return __atomic_exchange_n(&control_events, 0, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stops the control thread and closes the control pipe.
  */
 int close_control_pipe() {
-    if(f_ctl) return fclose(f_ctl);
-    else return 0;
+    if(control_running) {
+        uint64_t one = 1;
+        __atomic_store_n(&control_stopping, 1, __ATOMIC_RELEASE);
+        write(wake_fd, &one, sizeof(one));
+        pthread_join(control_thread_id, NULL);
+    }
+    if(ctl_fd >= 0) close(ctl_fd);
+    if(wake_fd >= 0) close(wake_fd);
+    if(epoll_fd >= 0) close(epoll_fd);
+    ctl_fd = wake_fd = epoll_fd = -1;
+
+    return 0;
 }
 
 // void create_rds_history(char *filename, struct rds_data_s *rds_data)
@@ -24,6 +24,8 @@
 #ifndef CTL_H
 #define CTL_H
 
+#include <stdint.h>
+
 #define CONTROL_PIPE_PS_SET         1
 #define CONTROL_PIPE_RT_SET         2
 #define CONTROL_PIPE_TA_SET         3
@@ -31,6 +33,8 @@
 #define CONTROL_PIPE_AF_CLEARED     5
 #define CONTROL_PIPE_PI_CHANGED     6
 #define CONTROL_PIPE_RT_PLUS_SET    7
+#define CONTROL_PIPE_FREQ_SET       8
+#define CONTROL_PIPE_STATS          9
 
 struct rds_data_s
 {
@@ -54,9 +58,29 @@ struct rds_data_s
     int dbus_mediainfo;
 };
 
-extern int open_control_pipe(char *filename);
+// Carrier frequency (Hz) requested by the last FREQ command
+extern uint32_t requested_freq;
+
+// Bit reported by poll_control_pipe() for a CONTROL_PIPE_* code
+#define CONTROL_EVENT(code) (1 << (code))
+
+struct rds_command;
+typedef void (*control_handler)(int fd, uint32_t events, void *ctx);
+
+extern int open_control_pipe(char *filename, int dbus_mediainfo);
 extern int close_control_pipe();
-extern int poll_control_pipe(int dbus_mediainfo);
+extern int poll_control_pipe();
+extern int start_control_thread();
+extern int control_watch_fd(int fd, control_handler handler, void *ctx);
+extern void control_unwatch_fd(int fd);
+extern int parse_control_line(char *res, struct rds_command *cmd);
+extern void submit_rds_commands(struct rds_command *cmds, int count);
+extern void raise_control_event(int code);
+extern uint64_t parse_control_time(char *when);
+extern void set_output_position(uint64_t sample, uint64_t written);
+extern uint64_t get_written_position();
+extern void set_control_event_hook(void (*hook)(int code));
+extern uint64_t wall_clock_to_sample(double t);
 
 // void create_rds_history(char *filename, struct rds_data_s *rds_data);
 // void write_rds_history(char *res);
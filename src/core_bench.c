@@ -0,0 +1,312 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    core_bench.c: microbenchmarks of the DSP core (libpifmrds_core.a).
+*/
+
+/* Run with 'make bench'. Each benchmark repeats a fixed amount of work and
+   keeps the fastest run. The cost is given per unit of work (a block, a
+   group or a sample of the multiplex), spread over the samples of the
+   multiplex it serves, and as the speed relative to real time at the
+   multiplex rate. CPU cycles are counted too where the kernel gives access
+   to the performance counters. The results are written as JSON on the
+   standard output, and as a table on the standard error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sndfile.h>
+#include <sys/utsname.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "rds.h"
+#include "fm_mpx.h"
+#include "subcarrier.h"
+#include "noise_shaper.h"
+
+
+#define RUNS 5
+#define BLOCK 5000          // DATA_SIZE in pi_fm_rds.c
+#define MPX_BLOCKS 46       // about one second of multiplex per run
+#define RING_SAMPLES 50000  // NUM_SAMPLES in pi_fm_rds.c
+#define BIT_RATE 1187.5
+
+struct result {
+    char name[32];
+    char unit[16];
+    double ns_per_unit;
+    double ns_per_sample;
+    double realtime;
+    double cycles_per_unit; // negative if not available
+};
+
+static struct result results[32];
+static int result_count = 0;
+static int mpx_rate;
+static int cycles_fd = -1;
+
+// Keeps the compiler from optimizing the benchmarked work away
+static volatile uint32_t sink;
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Opens the CPU cycle counter of this thread, if the kernel allows it */
+static void open_cycle_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_cycles() {
+    uint64_t cycles = 0;
+    if(cycles_fd < 0 || read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) return 0;
+    return cycles;
+}
+
+/* Runs 'work' RUNS times (after a warm-up run) and records the fastest.
+   One run processes 'units' units, of which real time takes 'per_second'.
+ */
+static void bench(char *name, char *unit, double units, double per_second, void (*work)()) {
+    uint64_t best = UINT64_MAX;
+    uint64_t best_cycles = 0;
+
+    work();
+    for(int r=0; r<RUNS; r++) {
+        uint64_t c0 = read_cycles();
+        uint64_t t0 = now_ns();
+        work();
+        uint64_t t1 = now_ns();
+        uint64_t c1 = read_cycles();
+        if(t1 - t0 < best) {
+            best = t1 - t0;
+            best_cycles = c1 - c0;
+        }
+    }
+
+    struct result *res = &results[result_count++];
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    snprintf(res->unit, sizeof(res->unit), "%s", unit);
+    res->ns_per_unit = best / units;
+    res->ns_per_sample = res->ns_per_unit * per_second / mpx_rate;
+    res->realtime = 1e9 / (res->ns_per_unit * per_second);
+    res->cycles_per_unit = cycles_fd >= 0 ? best_cycles / units : -1;
+
+    fprintf(stderr, "%-24s %12.1f ns/%-7s %9.2f ns/sample %10.1f x real time",
+        res->name, res->ns_per_unit, res->unit, res->ns_per_sample, res->realtime);
+    if(res->cycles_per_unit >= 0) fprintf(stderr, " %12.0f cycles/%s", res->cycles_per_unit, res->unit);
+    fprintf(stderr, "\n");
+}
+
+
+#define CRC_BLOCKS 1000000
+
+static void work_crc() {
+    uint32_t x = 0;
+    for(int i=0; i<CRC_BLOCKS; i++) x += crc(i * 40503);
+    sink = x;
+}
+
+#define GROUPS 20000
+
+static void work_group() {
+    int bits[104];
+    uint32_t x = 0;
+    for(int i=0; i<GROUPS; i++) {
+        get_rds_group(bits);
+        x += bits[103];
+    }
+    sink = x;
+}
+
+static float mpx[BLOCK];
+static float carrier[BLOCK];
+
+static void work_rds_samples() {
+    for(int i=0; i<MPX_BLOCKS; i++) get_rds_samples(mpx, carrier, BLOCK);
+    sink = mpx[0];
+}
+
+static void work_mpx() {
+    for(int i=0; i<MPX_BLOCKS; i++) {
+        if(fm_mpx_get_samples(mpx) < 0) {
+            fprintf(stderr, "Error: the generator failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sink = mpx[0];
+}
+
+/* The loop of tx() that turns the multiplex into frequency words for the
+   DMA engine: noise shaped words, then copied one per sample into the
+   ring of sample words read by the control blocks. */
+static uint32_t sample_words[RING_SAMPLES];
+static int ring_pos = 0;
+
+static void work_dma_words() {
+    uint32_t words[BLOCK];
+    uint32_t freq_ctl = 20000;
+    for(int b=0; b<MPX_BLOCKS; b++) {
+        noise_shape_words(mpx, words, 0x5A << 24 | freq_ctl, 25.0 / 10., BLOCK);
+        for(int i=0; i<BLOCK; i++) {
+            sample_words[ring_pos] = words[i];
+            if(++ring_pos == RING_SAMPLES) ring_pos = 0;
+        }
+    }
+}
+
+/* Writes a few seconds of noise at about -12 dBFS to a temporary WAV file,
+   so that the generator never takes its idle path */
+static int make_input(char *path, int rate, int channels) {
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    sfinfo.samplerate = rate;
+    sfinfo.channels = channels;
+    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+
+    SNDFILE *f = sf_open(path, SFM_WRITE, &sfinfo);
+    if(f == NULL) return -1;
+    int count = 3 * rate * channels;
+    float *buffer = malloc(count * sizeof(float));
+    uint32_t seed = 1;
+    for(int i=0; i<count; i++) {
+        seed = seed * 1664525 + 1013904223;
+        buffer[i] = ((int32_t)seed >> 8) / (float)(1 << 23) * .25;
+    }
+    sf_write_float(f, buffer, count);
+    sf_close(f);
+    free(buffer);
+    return 0;
+}
+
+/* A missing benchmark would go unnoticed in the JSON: failures are fatal */
+static void bench_mpx(char *name, int rate, int channels) {
+    char path[] = "/tmp/core_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        fprintf(stderr, "Error: could not create %s.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if(channels && make_input(path, rate, channels) < 0) {
+        fprintf(stderr, "Error: could not write the input of %s.\n", name);
+        unlink(path);
+        exit(EXIT_FAILURE);
+    }
+    if(fm_mpx_open(channels ? path : NULL, 0, BLOCK) < 0) {
+        fprintf(stderr, "Error: could not open the generator for %s.\n", name);
+        unlink(path);
+        exit(EXIT_FAILURE);
+    }
+    bench(name, "sample", (double)MPX_BLOCKS * BLOCK, mpx_rate, work_mpx);
+    fm_mpx_close();
+    unlink(path);
+}
+
+static void print_json() {
+    struct utsname u;
+    uname(&u);
+
+    char model[64] = "";
+    FILE *f = fopen("/proc/device-tree/model", "r");
+    if(f) {
+        size_t n = fread(model, 1, sizeof(model) - 1, f);
+        model[n] = 0;
+        fclose(f);
+    }
+
+    printf("{\n");
+    printf("  \"machine\": \"%s\",\n", u.machine);
+    printf("  \"model\": \"%s\",\n", model);
+    printf("  \"compiler\": \"%s\",\n", __VERSION__);
+    printf("  \"time\": %ld,\n", (long)time(NULL));
+    printf("  \"mpx_rate\": %d,\n", mpx_rate);
+    printf("  \"runs\": %d,\n", RUNS);
+    printf("  \"benchmarks\": [\n");
+    for(int i=0; i<result_count; i++) {
+        struct result *r = &results[i];
+        printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"ns_per_unit\": %.3f, "
+               "\"ns_per_sample\": %.4f, \"realtime\": %.2f, \"cycles_per_unit\": ",
+            r->name, r->unit, r->ns_per_unit, r->ns_per_sample, r->realtime);
+        if(r->cycles_per_unit >= 0) printf("%.1f}", r->cycles_per_unit);
+        else printf("null}");
+        printf("%s\n", i < result_count - 1 ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+int main(int argc, char **argv) {
+    set_history_write(1);
+    mpx_rate = get_rds_sample_rate();
+    open_cycle_counter();
+    if(cycles_fd < 0) fprintf(stderr, "No access to the CPU cycle counter, cycles are not measured.\n");
+
+    // Units of real time: blocks of 26 bits, groups of 104 bits
+    bench("crc", "block", CRC_BLOCKS, BIT_RATE / 26, work_crc);
+    bench("get_rds_group", "group", GROUPS, BIT_RATE / 104, work_group);
+
+    subcarrier_init(mpx_rate);
+    get_subcarriers(NULL, NULL, carrier, BLOCK);
+    bench("get_rds_samples", "sample", (double)MPX_BLOCKS * BLOCK, mpx_rate, work_rds_samples);
+    subcarrier_close();
+
+    // The messages of the generator would get mixed with the JSON
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    bench_mpx("mpx_rds_only", 0, 0);
+    int rates[3] = {32000, 44100, 48000};
+    for(int i=0; i<3; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "mpx_mono_%d", rates[i]);
+        bench_mpx(name, rates[i], 1);
+        snprintf(name, sizeof(name), "mpx_stereo_%d", rates[i]);
+        bench_mpx(name, rates[i], 2);
+    }
+
+    bench("dma_words", "sample", (double)MPX_BLOCKS * BLOCK, mpx_rate, work_dma_words);
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    print_json();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,312 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    core_test.c: unit tests of the DSP core (libpifmrds_core.a).
+*/
+
+/* Run with 'make test'. Each test prints what it checks when it fails, and
+   the program returns the number of failures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rds.h"
+#include "fm_mpx.h"
+#include "raw_input.h"
+#include "lowpass.h"
+#include "ppm_cal.h"
+
+
+#define PI 3.141592654
+#define BLOCK 5000
+#define GROUP_BITS 104
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+        if(!(cond)) { \
+            printf("FAIL %s:%d: ", __func__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            failures++; \
+        } \
+    } while(0)
+
+
+/* Checkword by long division by the RDS generator polynomial
+   x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1, independently from rds.c */
+static uint16_t reference_crc(uint16_t block) {
+    uint32_t r = (uint32_t)block << 10;
+    for(int bit=25; bit>=10; bit--) {
+        if(r & (1 << bit)) r ^= 0x5B9 << (bit - 10);
+    }
+    return r & 0x3FF;
+}
+
+static void test_crc() {
+    for(uint32_t block=0; block<0x10000; block++) {
+        if(crc(block) != reference_crc(block)) {
+            CHECK(0, "crc(%04X) = %03X, expected %03X", block, crc(block), reference_crc(block));
+            return;
+        }
+    }
+}
+
+static const uint16_t offset_words[] = {0x0FC, 0x198, 0x168, 0x1B4};
+
+/* Splits a group into its blocks, checking every checkword */
+static void decode_group(int *bits, uint16_t *blocks) {
+    for(int i=0; i<4; i++) {
+        uint16_t block = 0, check = 0;
+        for(int j=0; j<16; j++) block = block << 1 | bits[i*26 + j];
+        for(int j=16; j<26; j++) check = check << 1 | bits[i*26 + j];
+        CHECK(check == (reference_crc(block) ^ offset_words[i]),
+            "block %d (%04X): checkword %03X", i, block, check);
+        blocks[i] = block;
+    }
+}
+
+/* 0A groups with PS and AF, 2A with RT, PI, PTY and TP in the default
+   sequence. Runs first: the encoder starts at the first AF. */
+static void test_groups() {
+    int bits[GROUP_BITS];
+    uint16_t blocks[4];
+    char ps[9] = "????????";
+    int af[3];
+    int af_groups = 0;
+
+    set_rds_ct(0);
+    set_rds_pi(0xC0DE);
+    set_rds_pty(10);
+    set_rds_ps("UNIT TST");
+    set_rds_rt("Testing the group encoder");
+    clear_rds_af();
+    add_rds_af(mhz_to_binary(87600000));
+    add_rds_af(mhz_to_binary(107900000));
+
+    // 0A 0A 0A 0A 2A 3A 11A
+    int types[7] = {0, 0, 0, 0, 2, 3, 11};
+    for(int g=0; g<7; g++) {
+        for(int i=0; i<GROUP_BITS; i++) bits[i] = -1;
+        get_rds_group(bits);
+        for(int i=0; i<GROUP_BITS; i++) CHECK(bits[i] == 0 || bits[i] == 1, "bit %d of group %d", i, g);
+        decode_group(bits, blocks);
+
+        CHECK(blocks[0] == 0xC0DE, "PI %04X", blocks[0]);
+        CHECK(blocks[1] >> 12 == types[g] && !(blocks[1] & 0x800),
+            "group %d: type %d%c", g, blocks[1] >> 12, blocks[1] & 0x800 ? 'B' : 'A');
+        CHECK((blocks[1] >> 5 & 0x1F) == 10, "PTY %d", blocks[1] >> 5 & 0x1F);
+        CHECK(blocks[1] & 0x400, "TP not set");
+
+        if(types[g] == 0) {
+            int segment = blocks[1] & 3;
+            ps[segment*2] = blocks[3] >> 8;
+            ps[segment*2+1] = blocks[3] & 0xFF;
+            if(af_groups < 3) af[af_groups++] = blocks[2];
+        } else if(types[g] == 2) {
+            CHECK((blocks[1] & 0xF) == 0, "RT segment %d", blocks[1] & 0xF);
+            CHECK(blocks[2] == ('T' << 8 | 'e') && blocks[3] == ('s' << 8 | 't'),
+                "RT %04X %04X", blocks[2], blocks[3]);
+        }
+    }
+    CHECK(strcmp(ps, "UNIT TST") == 0, "PS \"%s\"", ps);
+
+    // Method A: count and first AF, then the others in pairs
+    CHECK(af[0] == (0xE000 | 2 << 8 | 1), "AF block %04X", af[0]);
+    CHECK(af[1] == (204 << 8 | 0xCD), "AF block %04X", af[1]);
+    CHECK(af[2] == af[0], "AF block %04X", af[2]);
+}
+
+static void test_af_codes() {
+    CHECK(mhz_to_binary(87600000) == 1, "87.6 MHz: %d", mhz_to_binary(87600000));
+    CHECK(mhz_to_binary(100000000) == 125, "100.0 MHz: %d", mhz_to_binary(100000000));
+    CHECK(mhz_to_binary(107900000) == 204, "107.9 MHz: %d", mhz_to_binary(107900000));
+    CHECK(mhz_to_binary(87500000) == 0, "87.5 MHz: %d", mhz_to_binary(87500000));
+    CHECK(mhz_to_binary(108000000) == 0, "108.0 MHz: %d", mhz_to_binary(108000000));
+}
+
+static void test_ct() {
+    uint16_t blocks[4] = {0, 0, 0, 0};
+    time_t before = time(NULL);
+    int generated = get_rds_ct_group(blocks);
+    time_t after = time(NULL);
+
+    CHECK(generated, "no CT group at the first call");
+    CHECK((blocks[1] & 0xF800) == 0x4000, "group type %04X", blocks[1]);
+
+    int mjd = (blocks[1] & 3) << 15 | blocks[2] >> 1;
+    int hour = (blocks[2] & 1) << 4 | blocks[3] >> 12;
+    int minute = blocks[3] >> 6 & 0x3F;
+    int offset = blocks[3] & 0x1F;
+    if(blocks[3] & 0x20) offset = -offset;
+
+    // Either time may have been read, if the minute changed in between
+    int match = 0;
+    time_t times[2] = {before, after};
+    for(int i=0; i<2; i++) {
+        struct tm *utc = gmtime(&times[i]);
+        if(mjd == 40587 + times[i] / 86400 && hour == utc->tm_hour && minute == utc->tm_min) match = 1;
+    }
+    CHECK(match, "MJD %d %02d:%02d", mjd, hour, minute);
+
+    struct tm *local = localtime(&before);
+    CHECK(offset == local->tm_gmtoff / 1800, "local offset %d half hours", offset);
+
+    if(time(NULL) / 60 == after / 60) {
+        CHECK(!get_rds_ct_group(blocks), "second CT group within the minute");
+    }
+}
+
+/* Gain of the whole (symmetric) filter at 'freq' */
+static double fir_gain(float *fir, double freq, int rate) {
+    double gain = 0;
+    for(int i=0; i<FIR_HALF_SIZE; i++) {
+        gain += 2 * fir[i] * cos(2 * PI * freq * (FIR_HALF_SIZE - 1 - i) / rate);
+    }
+    return fabs(gain);
+}
+
+static void test_fir() {
+    float fir[FIR_HALF_SIZE];
+
+    float cutoff = lowpass_init(fir, 44100, 228000);
+    CHECK(cutoff == 12000, "cutoff %.1f Hz", cutoff);
+    CHECK(fabs(fir_gain(fir, 0, 228000) - 1) < .02, "gain at 0 Hz: %.4f", fir_gain(fir, 0, 228000));
+    CHECK(fabs(fir_gain(fir, 1000, 228000) - 1) < .02, "gain at 1 kHz: %.4f", fir_gain(fir, 1000, 228000));
+    CHECK(fir_gain(fir, 23000, 228000) < .05, "gain at 23 kHz: %.4f", fir_gain(fir, 23000, 228000));
+    for(int f=30000; f<114000; f+=1000) {
+        if(fir_gain(fir, f, 228000) > .01) {
+            CHECK(0, "gain at %d Hz: %.4f", f, fir_gain(fir, f, 228000));
+            break;
+        }
+    }
+
+    // Below 30 kHz, the cutoff follows the Nyquist frequency of the input
+    cutoff = lowpass_init(fir, 22050, 228000);
+    CHECK(fabs(cutoff - 8820) < 1, "cutoff %.1f Hz", cutoff);
+    CHECK(fir_gain(fir, 19000, 228000) < .05, "gain at 19 kHz: %.4f", fir_gain(fir, 19000, 228000));
+}
+
+/* Amplitude of the component of 'x' at 'freq', over whole cycles */
+static double amplitude(float *x, int count, double freq, int rate) {
+    double s = 0, c = 0;
+    for(int i=0; i<count; i++) {
+        s += x[i] * sin(2 * PI * freq * i / rate);
+        c += x[i] * cos(2 * PI * freq * i / rate);
+    }
+    return 2 * sqrt(s*s + c*c) / count;
+}
+
+/* A 1 kHz tone on the left channel, then on both, through raw input. The
+   sum goes to baseband, the difference on 38 kHz, under the 19 kHz pilot. */
+static void test_stereo() {
+    const int rate = 44100;
+    const float level = .2;
+    char path[] = "/tmp/core_test_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0, "could not create %s", path);
+    if(fd < 0) return;
+
+    float frame[2];
+    for(int i=0; i<2*rate; i++) {
+        float v = level * sin(2 * PI * 1000 * i / rate);
+        frame[0] = v;
+        frame[1] = i < rate ? 0 : v;
+        if(write(fd, frame, sizeof(frame)) != sizeof(frame)) break;
+    }
+    close(fd);
+
+    raw_input_config(RAW_F32LE, rate, 2);
+    CHECK(fm_mpx_open(path, 0, BLOCK) == 0, "fm_mpx_open");
+    int mpx_rate = get_rds_sample_rate();
+    int length = 2 * mpx_rate;
+    float *mpx = malloc(length * sizeof(float));
+    usleep(200000); // let the reader fill its ring
+
+    for(int i=0; i+BLOCK<=length; i+=BLOCK) {
+        CHECK(fm_mpx_get_samples(mpx + i) == 0, "fm_mpx_get_samples");
+        usleep(1000); // stay behind the reader
+    }
+    fm_mpx_close();
+    unlink(path);
+
+    // Windows of whole cycles of 1, 19 and 39 kHz, clear of the fade-in,
+    // the filter and the switch between the two halves
+    int window = mpx_rate / 10 * 6;
+    float *left = mpx + mpx_rate / 5;
+    float *both = mpx + mpx_rate + mpx_rate / 5;
+
+    double a;
+    a = amplitude(left, window, 1000, mpx_rate);
+    CHECK(fabs(a - 4.05 * level) < .02 * 4.05 * level, "left only, sum: %.4f", a);
+    a = amplitude(left, window, 39000, mpx_rate);
+    CHECK(fabs(a - 4.05 * level / 2) < .02 * 4.05 * level, "left only, difference: %.4f", a);
+    a = amplitude(left, window, 19000, mpx_rate);
+    CHECK(fabs(a - .9) < .01, "pilot: %.4f", a);
+
+    a = amplitude(both, window, 1000, mpx_rate);
+    CHECK(fabs(a - 2 * 4.05 * level) < .02 * 4.05 * level, "both, sum: %.4f", a);
+    a = amplitude(both, window, 39000, mpx_rate);
+    CHECK(a < .01, "both, difference: %.4f", a);
+    a = amplitude(both, window, 19000, mpx_rate);
+    CHECK(fabs(a - .9) < .01, "pilot: %.4f", a);
+
+    free(mpx);
+}
+
+/* An oscillator 80 ppm slow, measured window after window through the
+   divider computed from the estimate: the estimate must converge to it. */
+static void test_ppm_cal() {
+    const double nominal = 228000;
+    const double crystal = 80;
+    ppm_cal_start(NULL, 0, nominal);
+
+    for(int w=0; w<40; w++) {
+        // Rate actually played with pwm_divider(estimate)
+        double rate = nominal * (1 - crystal / 1e6) * (1 + ppm_cal_estimate() / 1e6);
+        CHECK(ppm_cal_measure(rate) == 1, "window %d rejected", w);
+    }
+    CHECK(fabs(ppm_cal_estimate() - crystal) < .1, "estimate %.3f ppm", ppm_cal_estimate());
+
+    float estimate = ppm_cal_estimate();
+    CHECK(ppm_cal_measure(nominal * 1.001) == 0, "1000 ppm glitch accepted");
+    CHECK(ppm_cal_estimate() == estimate, "estimate moved by a glitch");
+}
+
+int main(int argc, char **argv) {
+    set_history_write(1);
+
+    test_groups();
+    test_crc();
+    test_af_codes();
+    test_ct();
+    test_fir();
+    test_stereo();
+    test_ppm_cal();
+
+    if(failures) printf("%d check(s) failed.\n", failures);
+    else printf("All tests passed.\n");
+    return failures;
+}
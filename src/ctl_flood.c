@@ -0,0 +1,113 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+    
+    ctl_flood.c is a test program that floods the control pipe with commands
+    while generating RDS samples, and measures how fast the commands reach
+    the RDS encoder.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rds.h"
+#include "control_pipe.h"
+#include "subcarrier.h"
+
+#define SAMPLE_RATE 228000
+#define SAMPLES_PER_GROUP 19968 // 104 bits of 192 samples
+#define CHUNK 1024
+
+static char *pipe_name;
+static int num_commands;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg) {
+    int fd = open(pipe_name, O_WRONLY);
+    char buf[4096];
+    int len = 0;
+
+    for(int i=0; i<num_commands; i++) {
+        if(i % 2) len += snprintf(buf+len, sizeof(buf)-len, "PS F%07d\n", i);
+        else len += snprintf(buf+len, sizeof(buf)-len, "RT Flood test, command %d\n", i);
+        if(len > sizeof(buf) - 100) {
+            write(fd, buf, len);
+            len = 0;
+        }
+    }
+    write(fd, buf, len);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char name[64];
+    float samples[CHUNK];
+    float carrier[CHUNK];
+    pthread_t writer_id;
+
+    num_commands = argc > 1 ? atoi(argv[1]) : 20000;
+    snprintf(name, sizeof(name), "/tmp/ctl_flood.%d", getpid());
+    pipe_name = name;
+    mkfifo(pipe_name, 0600);
+    subcarrier_init(228000);
+
+    if(open_control_pipe(pipe_name, 0) < 0) {
+        fprintf(stderr, "Error: could not open control pipe %s.\n", pipe_name);
+        return EXIT_FAILURE;
+    }
+
+    // Every command is acknowledged on stdout, which is not what we measure
+    freopen("/dev/null", "w", stdout);
+
+    double start = now();
+    pthread_create(&writer_id, NULL, writer, NULL);
+
+    long long generated = 0;
+    while(rds_commands_applied() < num_commands) {
+        get_subcarriers(NULL, NULL, carrier, CHUNK);
+        get_rds_samples(samples, carrier, CHUNK);
+        generated += CHUNK;
+    }
+    double elapsed = now() - start;
+
+    pthread_join(writer_id, NULL);
+    close_control_pipe();
+    unlink(pipe_name);
+
+    double groups = (double) generated / SAMPLES_PER_GROUP;
+    fprintf(stderr, "%d commands applied in %.3f s: %.0f commands/s\n",
+        num_commands, elapsed, num_commands / elapsed);
+    fprintf(stderr, "%.0f RDS groups generated (%.1f s of signal, %.1f x real time), %.1f commands per group\n",
+        groups, (double) generated / SAMPLE_RATE, generated / (SAMPLE_RATE * elapsed),
+        num_commands / groups);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,748 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    ctl_socket.c: control API on a Unix domain socket. Clients send one JSON
+    request per line and receive one JSON reply per line; they can also
+    subscribe to change events. The socket is served by the control thread.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+
+#include "ctl_socket.h"
+#include "control_pipe.h"
+#include "rds.h"
+#include "status_shm.h"
+
+#define MAX_CLIENTS 32
+#define CLIENT_BUFFER_SIZE 4096
+#define REPLY_SIZE 4096
+#define JSON_MAX_NODES 128
+#define EVENT_INTERVAL_MS 100
+#define MAX_AF 25
+
+struct ctl_client
+{
+    int fd;
+    int subscribed;
+    char buf[CLIENT_BUFFER_SIZE];
+    int len;
+};
+
+static struct ctl_client clients[MAX_CLIENTS];
+static int listen_fd = -1;
+static int timer_fd = -1;
+static char *socket_path = NULL;
+static int rt_from_dbus = 0;
+static int subscribers = 0;
+
+// Last snapshot sent to the subscribers
+static struct pifmrds_status last_status;
+static int have_last_status = 0;
+
+// Parameters reported by "get", and the ones watched for change events
+static char *param_names[] = {
+    "freq", "pi", "ps", "rt", "rtplus", "ta", "pty", "af",
+    "ppm", "sample_rate", "samples", "time", "lead", "lead_min", "lead_max", "underruns",
+    "source", "audio_rate", "audio_channels", "audio_frames", "peak", "audio_state", "dropouts", NULL
+};
+static char *watched_names[] = {
+    "freq", "pi", "ps", "rt", "rtplus", "ta", "pty", "af", "source", "underruns", "audio_state", NULL
+};
+
+// Names of the MPX_AUDIO_* states of fm_mpx.h
+static char *audio_states[] = { "playing", "silent", "starved" };
+
+
+/* A minimal JSON parser. Strings are decoded in place, in the request line,
+   and values are stored in a fixed pool of nodes: one request never needs
+   more than a few dozens of them.
+ */
+#define JSON_NULL   0
+#define JSON_BOOL   1
+#define JSON_NUMBER 2
+#define JSON_STRING 3
+#define JSON_ARRAY  4
+#define JSON_OBJECT 5
+
+struct json_node
+{
+    int type;
+    double number;  // value of a number, 0 or 1 for a boolean
+    char *string;
+    char *key;      // member name, for the members of an object
+    int child;      // first element or member
+    int next;       // next sibling
+};
+
+struct json_doc
+{
+    char *p;
+    struct json_node nodes[JSON_MAX_NODES];
+    int count;
+};
+
+static void skip_space(struct json_doc *doc) {
+    while(*doc->p == ' ' || *doc->p == '\t' || *doc->p == '\r' || *doc->p == '\n') doc->p++;
+}
+
+static int new_node(struct json_doc *doc, int type) {
+    if(doc->count == JSON_MAX_NODES) return -1;
+
+    struct json_node *node = &doc->nodes[doc->count];
+    memset(node, 0, sizeof(struct json_node));
+    node->type = type;
+    node->child = -1;
+    node->next = -1;
+    return doc->count++;
+}
+
+/* Reads the 4 hexadecimal digits of a \u escape sequence */
+static int parse_hex4(const char *s, unsigned int *value) {
+    char hex[5] = {0};
+    for(int i=0; i<4; i++) {
+        if(!isxdigit((unsigned char) s[i])) return -1;
+        hex[i] = s[i];
+    }
+    *value = strtoul(hex, NULL, 16);
+    return 0;
+}
+
+static char *parse_string(struct json_doc *doc) {
+    char *start = doc->p + 1;
+    char *src = start, *dst = start;
+
+    while(*src != '"') {
+        if(*src == 0) return NULL;
+        if(*src != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+        src++;
+        switch(*src) {
+            case '"': case '\\': case '/': *dst++ = *src; break;
+            case 'b': *dst++ = '\b'; break;
+            case 'f': *dst++ = '\f'; break;
+            case 'n': *dst++ = '\n'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'u': {
+                unsigned int c, low;
+                if(parse_hex4(src + 1, &c) < 0) return NULL;
+                src += 4;
+                // A string can't hold a NUL, and surrogates only come in pairs
+                if(c == 0 || (c >= 0xDC00 && c < 0xE000)) return NULL;
+                if(c >= 0xD800 && c < 0xDC00) {
+                    if(src[1] != '\\' || src[2] != 'u' || parse_hex4(src + 3, &low) < 0) return NULL;
+                    if(low < 0xDC00 || low >= 0xE000) return NULL;
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    src += 6;
+                }
+                // Never longer than the 6 or 12 characters of the escape sequence
+                if(c < 0x80) {
+                    *dst++ = c;
+                } else if(c < 0x800) {
+                    *dst++ = 0xC0 | (c >> 6);
+                    *dst++ = 0x80 | (c & 0x3F);
+                } else if(c < 0x10000) {
+                    *dst++ = 0xE0 | (c >> 12);
+                    *dst++ = 0x80 | ((c >> 6) & 0x3F);
+                    *dst++ = 0x80 | (c & 0x3F);
+                } else {
+                    *dst++ = 0xF0 | (c >> 18);
+                    *dst++ = 0x80 | ((c >> 12) & 0x3F);
+                    *dst++ = 0x80 | ((c >> 6) & 0x3F);
+                    *dst++ = 0x80 | (c & 0x3F);
+                }
+                break;
+            }
+            default: return NULL;
+        }
+        src++;
+    }
+    doc->p = src + 1;
+    *dst = 0;
+
+    return start;
+}
+
+static int parse_value(struct json_doc *doc) {
+    int node;
+
+    skip_space(doc);
+    char c = *doc->p;
+
+    if(c == '{' || c == '[') {
+        char close = (c == '{') ? '}' : ']';
+        if((node = new_node(doc, c == '{' ? JSON_OBJECT : JSON_ARRAY)) < 0) return -1;
+        doc->p++;
+        skip_space(doc);
+        if(*doc->p == close) {
+            doc->p++;
+            return node;
+        }
+        int last = -1;
+        for(;;) {
+            char *key = NULL;
+            if(close == '}') {
+                skip_space(doc);
+                if(*doc->p != '"' || (key = parse_string(doc)) == NULL) return -1;
+                skip_space(doc);
+                if(*doc->p++ != ':') return -1;
+            }
+            int child = parse_value(doc);
+            if(child < 0) return -1;
+            doc->nodes[child].key = key;
+            if(last < 0) doc->nodes[node].child = child;
+            else doc->nodes[last].next = child;
+            last = child;
+
+            skip_space(doc);
+            if(*doc->p == ',') {
+                doc->p++;
+            } else if(*doc->p == close) {
+                doc->p++;
+                return node;
+            } else {
+                return -1;
+            }
+        }
+    }
+    else if(c == '"') {
+        if((node = new_node(doc, JSON_STRING)) < 0) return -1;
+        if((doc->nodes[node].string = parse_string(doc)) == NULL) return -1;
+    }
+    else if(strncmp(doc->p, "true", 4) == 0 || strncmp(doc->p, "false", 5) == 0) {
+        if((node = new_node(doc, JSON_BOOL)) < 0) return -1;
+        doc->nodes[node].number = (c == 't');
+        doc->p += (c == 't') ? 4 : 5;
+    }
+    else if(strncmp(doc->p, "null", 4) == 0) {
+        if((node = new_node(doc, JSON_NULL)) < 0) return -1;
+        doc->p += 4;
+    }
+    else {
+        char *end;
+        double value = strtod(doc->p, &end);
+        if(end == doc->p) return -1;
+        if((node = new_node(doc, JSON_NUMBER)) < 0) return -1;
+        doc->nodes[node].number = value;
+        doc->p = end;
+    }
+
+    return node;
+}
+
+static int json_member(struct json_doc *doc, int object, char *name) {
+    for(int i = doc->nodes[object].child; i >= 0; i = doc->nodes[i].next) {
+        if(strcmp(doc->nodes[i].key, name) == 0) return i;
+    }
+    return -1;
+}
+
+
+/* Replies are built in a fixed buffer, and sent as one line. */
+struct reply
+{
+    char buf[REPLY_SIZE];
+    int len;
+};
+
+static void reply_printf(struct reply *r, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->buf + r->len, REPLY_SIZE - 1 - r->len, fmt, ap);
+    va_end(ap);
+    if(n > 0) r->len += n;
+    if(r->len > REPLY_SIZE - 2) r->len = REPLY_SIZE - 2;
+}
+
+static void reply_string(struct reply *r, char *s, int len) {
+    reply_printf(r, "\"");
+    for(int i=0; i<len && s[i]; i++) {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\') reply_printf(r, "\\%c", c);
+        else if(c < 0x20) reply_printf(r, "\\u%04x", c);
+        else reply_printf(r, "%c", c);
+    }
+    reply_printf(r, "\"");
+}
+
+static int find_param(char *name) {
+    for(int i=0; param_names[i]; i++) {
+        if(strcmp(param_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/*
+ * Writes the value of a parameter, as found in a status snapshot.
+ */
+static void reply_param(struct reply *r, char *name, struct pifmrds_status *s) {
+    if(strcmp(name, "freq") == 0) reply_printf(r, "%.2f", s->freq / 1e6);
+    else if(strcmp(name, "pi") == 0) reply_printf(r, "\"%04X\"", s->pi);
+    else if(strcmp(name, "ps") == 0) reply_string(r, s->ps, 8);
+    else if(strcmp(name, "rt") == 0) {
+        // Without the padding
+        int len = strnlen(s->rt, 64);
+        while(len > 0 && s->rt[len-1] == ' ') len--;
+        reply_string(r, s->rt, len);
+    }
+    else if(strcmp(name, "rtplus") == 0) reply_printf(r, s->rt_plus ? "true" : "false");
+    else if(strcmp(name, "ta") == 0) reply_printf(r, s->ta ? "true" : "false");
+    else if(strcmp(name, "pty") == 0) reply_printf(r, "%u", s->pty);
+    else if(strcmp(name, "af") == 0) {
+        reply_printf(r, "[");
+        for(int i=0; i<s->af_count && i<MAX_AF; i++) {
+            reply_printf(r, i ? ",%.1f" : "%.1f", 87.5 + s->af[i] / 10.);
+        }
+        reply_printf(r, "]");
+    }
+    else if(strcmp(name, "ppm") == 0) reply_printf(r, "%.3f", s->ppm);
+    else if(strcmp(name, "sample_rate") == 0) reply_printf(r, "%u", s->sample_rate);
+    else if(strcmp(name, "samples") == 0) reply_printf(r, "%llu", (unsigned long long) s->samples);
+    else if(strcmp(name, "time") == 0) reply_printf(r, "%.6f", s->timestamp_us / 1e6);
+    else if(strcmp(name, "lead") == 0) reply_printf(r, "%u", s->lead);
+    else if(strcmp(name, "lead_min") == 0) reply_printf(r, "%u", s->lead_min);
+    else if(strcmp(name, "lead_max") == 0) reply_printf(r, "%u", s->lead_max);
+    else if(strcmp(name, "underruns") == 0) reply_printf(r, "%u", s->underruns);
+    else if(strcmp(name, "source") == 0) reply_string(r, s->source, sizeof(s->source));
+    else if(strcmp(name, "audio_rate") == 0) reply_printf(r, "%u", s->audio_rate);
+    else if(strcmp(name, "audio_channels") == 0) reply_printf(r, "%u", s->audio_channels);
+    else if(strcmp(name, "audio_frames") == 0) reply_printf(r, "%llu", (unsigned long long) s->audio_frames);
+    else if(strcmp(name, "peak") == 0) reply_printf(r, "[%.4f,%.4f]", s->peak_left, s->peak_right);
+    else if(strcmp(name, "audio_state") == 0) reply_printf(r, "\"%s\"", audio_states[s->audio_state < 3 ? s->audio_state : 0]);
+    else if(strcmp(name, "dropouts") == 0) reply_printf(r, "%u", s->audio_dropouts);
+}
+
+static void reply_params(struct reply *r, char **names, struct pifmrds_status *s) {
+    reply_printf(r, "{");
+    for(int i=0; names[i]; i++) {
+        reply_printf(r, i ? ",\"%s\":" : "\"%s\":", names[i]);
+        reply_param(r, names[i], s);
+    }
+    reply_printf(r, "}");
+}
+
+
+static void drop_client(struct ctl_client *c) {
+    control_unwatch_fd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    if(c->subscribed) subscribers--;
+    c->subscribed = 0;
+}
+
+/*
+ * Sends a line to a client. A client that does not read its replies and
+ * events fast enough to keep the socket buffer from filling up is dropped,
+ * rather than letting it block the control thread.
+ */
+static int send_reply(struct ctl_client *c, struct reply *r) {
+    r->buf[r->len++] = '\n';
+    if(send(c->fd, r->buf, r->len, MSG_NOSIGNAL | MSG_DONTWAIT) != r->len) {
+        drop_client(c);
+        return -1;
+    }
+    return 0;
+}
+
+static char *error_message(char *buf, size_t size, char *fmt, char *name) {
+    snprintf(buf, size, fmt, name);
+    return buf;
+}
+
+/*
+ * Validates all the parameters of a "set" request, and then queues the RDS
+ * changes as a single transaction, so they reach the encoder together, at
+ * output sample 'at' if it is not 0. Returns NULL, or an error message if
+ * nothing was changed.
+ */
+static char *handle_set(struct json_doc *doc, int params, uint64_t at, char *err, size_t err_size) {
+    struct json_node *n = doc->nodes;
+    int pi = -1, ta = -1, pty = -1, rtplus = -1;
+    char *ps = NULL, *rt = NULL;
+    uint8_t af[MAX_AF];
+    int af_count = -1;
+    uint32_t freq = 0;
+
+    if(n[params].type != JSON_OBJECT) return "\"set\" must be an object";
+
+    for(int i = n[params].child; i >= 0; i = n[i].next) {
+        char *key = n[i].key;
+
+        if(strcmp(key, "pi") == 0) {
+            if(n[i].type == JSON_STRING) pi = strtol(n[i].string, NULL, 16);
+            else if(n[i].type == JSON_NUMBER) pi = n[i].number;
+            if(pi < 0 || pi > 0xFFFF) return error_message(err, err_size, "invalid value for %s", key);
+        }
+        else if(strcmp(key, "ps") == 0 || strcmp(key, "rt") == 0) {
+            if(n[i].type != JSON_STRING) return error_message(err, err_size, "invalid value for %s", key);
+            if(key[0] == 'p') {
+                ps = n[i].string;
+                if(strlen(ps) > 8) ps[8] = 0;
+            } else {
+                if(rt_from_dbus) return "RT is pulled from media metadata";
+                rt = n[i].string;
+                if(strlen(rt) > 64) rt[64] = 0;
+            }
+        }
+        else if(strcmp(key, "ta") == 0 || strcmp(key, "rtplus") == 0) {
+            if(n[i].type != JSON_BOOL) return error_message(err, err_size, "invalid value for %s", key);
+            if(key[0] == 't') {
+                ta = n[i].number;
+            } else {
+                if(rt_from_dbus) return "RT+ is pulled from media metadata";
+                rtplus = n[i].number;
+            }
+        }
+        else if(strcmp(key, "pty") == 0) {
+            if(n[i].type != JSON_NUMBER || n[i].number < 0 || n[i].number > 31)
+                return error_message(err, err_size, "invalid value for %s", key);
+            pty = n[i].number;
+        }
+        else if(strcmp(key, "af") == 0) {
+            if(n[i].type != JSON_ARRAY) return error_message(err, err_size, "invalid value for %s", key);
+            af_count = 0;
+            for(int j = n[i].child; j >= 0; j = n[j].next) {
+                if(n[j].type != JSON_NUMBER || af_count == MAX_AF) return error_message(err, err_size, "invalid value for %s", key);
+                af[af_count] = mhz_to_binary((int)(1e6 * n[j].number));
+                if(af[af_count] == 0) return error_message(err, err_size, "invalid value for %s", key);
+                af_count++;
+            }
+        }
+        else if(strcmp(key, "freq") == 0) {
+            if(n[i].type != JSON_NUMBER || n[i].number < 76 || n[i].number > 108)
+                return "frequency must be in megahertz, between 76 and 108";
+            if(at) return "the frequency cannot be scheduled";
+            freq = 1e6 * n[i].number;
+        }
+        else {
+            return error_message(err, err_size, "unknown parameter: %s", key);
+        }
+    }
+
+    struct rds_command cmds[8 + MAX_AF];
+    int count = 0;
+    if(pi >= 0) cmds[count++] = (struct rds_command) { RDS_CMD_PI, pi };
+    if(ps) {
+        cmds[count] = (struct rds_command) { RDS_CMD_PS };
+        strcpy(cmds[count++].text, ps);
+    }
+    if(rt) {
+        cmds[count] = (struct rds_command) { RDS_CMD_RT };
+        strcpy(cmds[count++].text, rt);
+    }
+    if(rtplus >= 0) cmds[count++] = (struct rds_command) { RDS_CMD_RT_PLUS, rtplus };
+    if(ta >= 0) cmds[count++] = (struct rds_command) { RDS_CMD_TA, ta };
+    if(pty >= 0) cmds[count++] = (struct rds_command) { RDS_CMD_PTY, pty };
+    if(af_count >= 0) {
+        cmds[count++] = (struct rds_command) { RDS_CMD_AF_CLEAR };
+        for(int i=0; i<af_count; i++) cmds[count++] = (struct rds_command) { RDS_CMD_AF_ADD, af[i] };
+    }
+    for(int i=0; i<count; i++) cmds[i].at = at;
+    submit_rds_commands(cmds, count);
+
+    if(ps) raise_control_event(CONTROL_PIPE_PS_SET);
+    if(rt) raise_control_event(CONTROL_PIPE_RT_SET);
+    if(freq) {
+        __atomic_store_n(&requested_freq, freq, __ATOMIC_RELAXED);
+        raise_control_event(CONTROL_PIPE_FREQ_SET);
+    }
+
+    return NULL;
+}
+
+static void handle_request(struct ctl_client *c, char *line, int len) {
+    struct json_doc doc;
+    struct reply r;
+    struct pifmrds_status status;
+    char err[128];
+    char *error = NULL;
+
+    doc.p = line;
+    doc.count = 0;
+    r.len = 0;
+
+    int root = parse_value(&doc);
+    if(root >= 0) skip_space(&doc);
+    // A NUL byte in the line stops the parser before the end
+    if(root < 0 || doc.p != line + len || doc.nodes[root].type != JSON_OBJECT) {
+        reply_printf(&r, "{\"id\":null,\"ok\":false,\"error\":\"invalid request\"}");
+        send_reply(c, &r);
+        return;
+    }
+
+    // The id is sent back as is, to match replies with requests
+    reply_printf(&r, "{\"id\":");
+    int id = json_member(&doc, root, "id");
+    if(id >= 0 && doc.nodes[id].type == JSON_NUMBER) reply_printf(&r, "%.15g", doc.nodes[id].number);
+    else if(id >= 0 && doc.nodes[id].type == JSON_STRING) reply_string(&r, doc.nodes[id].string, REPLY_SIZE);
+    else reply_printf(&r, "null");
+
+    int set = json_member(&doc, root, "set");
+    int get = json_member(&doc, root, "get");
+    int subscribe = json_member(&doc, root, "subscribe");
+
+    if(set >= 0) {
+        // Optional schedule: {"sample": n} on the output timeline, or
+        // {"time": t} in seconds since the Unix epoch
+        uint64_t at = 0;
+        int when = json_member(&doc, root, "at");
+        if(when >= 0) {
+            int sample = doc.nodes[when].type == JSON_OBJECT ? json_member(&doc, when, "sample") : -1;
+            int time = doc.nodes[when].type == JSON_OBJECT ? json_member(&doc, when, "time") : -1;
+            if(sample >= 0 && doc.nodes[sample].type == JSON_NUMBER && doc.nodes[sample].number >= 1)
+                at = doc.nodes[sample].number;
+            else if(time >= 0 && doc.nodes[time].type == JSON_NUMBER)
+                at = wall_clock_to_sample(doc.nodes[time].number);
+            if(at == 0) error = "invalid \"at\"";
+        }
+        if(!error) error = handle_set(&doc, set, at, err, sizeof(err));
+        if(!error) reply_printf(&r, ",\"ok\":true");
+        if(!error && at) reply_printf(&r, ",\"at\":%llu", (unsigned long long) at);
+    }
+    else if(get >= 0) {
+        // A name, a list of names, or "*" (or null) for everything
+        char *names[JSON_MAX_NODES];
+        int count = 0;
+        struct json_node *n = doc.nodes;
+
+        if(n[get].type == JSON_NULL || (n[get].type == JSON_STRING && strcmp(n[get].string, "*") == 0)) {
+            for(; param_names[count]; count++) names[count] = param_names[count];
+        } else if(n[get].type == JSON_STRING) {
+            names[count++] = n[get].string;
+        } else if(n[get].type == JSON_ARRAY) {
+            for(int i = n[get].child; i >= 0; i = n[i].next) {
+                if(n[i].type != JSON_STRING) {
+                    error = "\"get\" takes parameter names";
+                    break;
+                }
+                names[count++] = n[i].string;
+            }
+        } else {
+            error = "\"get\" takes parameter names";
+        }
+        names[count] = NULL;
+
+        for(int i=0; !error && i<count; i++) {
+            if(find_param(names[i]) < 0) error = error_message(err, sizeof(err), "unknown parameter: %s", names[i]);
+        }
+        if(!error && read_status_shm(&status) < 0) error = "status not available yet";
+        if(!error) {
+            reply_printf(&r, ",\"ok\":true,\"result\":");
+            reply_params(&r, names, &status);
+        }
+    }
+    else if(subscribe >= 0) {
+        int on = (doc.nodes[subscribe].type == JSON_BOOL && doc.nodes[subscribe].number);
+        if(on && !c->subscribed) subscribers++;
+        if(!on && c->subscribed) subscribers--;
+        c->subscribed = on;
+        reply_printf(&r, ",\"ok\":true");
+        // Subscribers start with the current values, then only get the changes
+        if(on && read_status_shm(&status) == 0) {
+            reply_printf(&r, ",\"result\":");
+            reply_params(&r, watched_names, &status);
+        }
+    }
+    else {
+        error = "unknown request";
+    }
+
+    if(error) {
+        reply_printf(&r, ",\"ok\":false,\"error\":");
+        reply_string(&r, error, REPLY_SIZE);
+    }
+    reply_printf(&r, "}");
+    send_reply(c, &r);
+}
+
+static void read_client(int fd, uint32_t events, void *ctx) {
+    struct ctl_client *c = ctx;
+    ssize_t len;
+
+    while((len = read(fd, c->buf + c->len, CLIENT_BUFFER_SIZE - 1 - c->len)) > 0) {
+        c->len += len;
+        c->buf[c->len] = 0;
+
+        char *line = c->buf;
+        char *end;
+        while((end = memchr(line, '\n', c->buf + c->len - line)) != NULL) {
+            *end = 0;
+            if(end > line) handle_request(c, line, end - line);
+            if(c->fd < 0) return;
+            line = end + 1;
+        }
+        c->len -= line - c->buf;
+        memmove(c->buf, line, c->len);
+
+        if(c->len == CLIENT_BUFFER_SIZE - 1) {
+            // No room left for the end of the line
+            struct reply r = { .len = 0 };
+            reply_printf(&r, "{\"id\":null,\"ok\":false,\"error\":\"request too long\"}");
+            send_reply(c, &r);
+            if(c->fd >= 0) drop_client(c);
+            return;
+        }
+    }
+    if(len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) drop_client(c);
+}
+
+static void accept_client(int fd, uint32_t events, void *ctx) {
+    int client_fd;
+
+    while((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct ctl_client *c = NULL;
+        for(int i=0; i<MAX_CLIENTS; i++) {
+            if(clients[i].fd < 0) {
+                c = &clients[i];
+                break;
+            }
+        }
+        if(c == NULL) {
+            fprintf(stderr, "Error: too many control clients, connection refused.\n");
+            close(client_fd);
+            continue;
+        }
+        c->fd = client_fd;
+        c->len = 0;
+        c->subscribed = 0;
+        if(control_watch_fd(client_fd, read_client, c) < 0) {
+            close(client_fd);
+            c->fd = -1;
+        }
+    }
+}
+
+/*
+ * Sends the parameters that changed since the last check to the
+ * subscribers, whatever changed them (this socket, the control pipe,
+ * the varying PS, the media player, ...).
+ */
+static void send_events(int fd, uint32_t events, void *ctx) {
+    uint64_t expirations;
+    struct pifmrds_status status;
+
+    read(fd, &expirations, sizeof(expirations));
+    if(subscribers == 0) {
+        have_last_status = 0;
+        return;
+    }
+    if(read_status_shm(&status) < 0) return;
+    if(!have_last_status) {
+        last_status = status;
+        have_last_status = 1;
+        return;
+    }
+
+    struct reply r = { .len = 0 };
+    int changes = 0;
+    reply_printf(&r, "{\"event\":\"change\",\"changes\":{");
+    for(int i=0; watched_names[i]; i++) {
+        struct reply before = { .len = 0 }, after = { .len = 0 };
+        reply_param(&before, watched_names[i], &last_status);
+        reply_param(&after, watched_names[i], &status);
+        if(before.len == after.len && memcmp(before.buf, after.buf, after.len) == 0) continue;
+        reply_printf(&r, changes ? ",\"%s\":" : "\"%s\":", watched_names[i]);
+        reply_printf(&r, "%.*s", after.len, after.buf);
+        changes++;
+    }
+    reply_printf(&r, "}}");
+    last_status = status;
+    if(changes == 0) return;
+
+    for(int i=0; i<MAX_CLIENTS; i++) {
+        if(clients[i].fd >= 0 && clients[i].subscribed) {
+            struct reply copy = r;
+            send_reply(&clients[i], &copy);
+        }
+    }
+}
+
+/*
+ * Creates the control socket, and starts serving it from the control thread.
+ */
+int open_control_socket(char *path, int dbus_mediainfo) {
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    for(int i=0; i<MAX_CLIENTS; i++) clients[i].fd = -1;
+    rt_from_dbus = dbus_mediainfo;
+
+    // Remove the socket left behind by a previous run
+    unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    chmod(path, 0666);
+    socket_path = path;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec interval = {
+        { 0, EVENT_INTERVAL_MS * 1000000 }, { 0, EVENT_INTERVAL_MS * 1000000 }
+    };
+    // The timer is watched first: nothing is served until the socket is
+    if(timer_fd < 0 || timerfd_settime(timer_fd, 0, &interval, NULL) < 0
+        || start_control_thread() < 0
+        || control_watch_fd(timer_fd, send_events, NULL) < 0
+        || control_watch_fd(listen_fd, accept_client, NULL) < 0) {
+        close_control_socket();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Closes the socket and all the connections. The control thread must have
+ * been stopped (close_control_pipe) first.
+ */
+void close_control_socket() {
+    if(listen_fd < 0) return;
+
+    for(int i=0; i<MAX_CLIENTS; i++) {
+        if(clients[i].fd >= 0) close(clients[i].fd);
+        clients[i].fd = -1;
+    }
+    close(listen_fd);
+    if(timer_fd >= 0) close(timer_fd);
+    unlink(socket_path);
+    listen_fd = timer_fd = -1;
+}
@@ -23,301 +23,468 @@
     dbus_mediainfo.c: handles automatic radiotext by getting music metadata from dbus.
 */
 
+/* A single GLib main loop, on its own thread, follows the MPRIS players of
+   the session bus. NameOwnerChanged tells when players come and go, and
+   PropertiesChanged when they change track or start and stop playing, so
+   nothing is ever polled. Players already running are found once at start.
+
+   Every player is kept in a table with its status and metadata. The one
+   followed is the playing player that comes first in the priority list
+   (-dbusprio), or the one which started playing last among equals.
+ */
+
 #include "dbus_mediainfo.h"
+#include "mediainfo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
-#include <dbus/dbus-glib.h>
-#include <dbus/dbus.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <gio/gio.h>
 #include <glib.h>
 
-GError *tmp_error;
-GDBusProxy *get_names_proxy;
-GDBusProxy *get_props_proxy;
+#define MPRIS_PREFIX "org.mpris.MediaPlayer2."
+#define MPRIS_PATH "/org/mpris/MediaPlayer2"
+#define MPRIS_PLAYER "org.mpris.MediaPlayer2.Player"
+#define MAX_PLAYERS 16
+#define MAX_PRIORITIES 16
+
+#define PLAYER_STOPPED  0
+#define PLAYER_PAUSED   1
+#define PLAYER_PLAYING  2
+
+struct player
+{
+    gchar *name;        // well-known name, NULL for a free entry
+    gchar *owner;       // unique name, the sender of its signals
+    int status;
+    gchar *artist;
+    gchar *title;
+    gchar *album;
+    gint64 length;      // in microseconds
+    uint64_t started;   // order in which players started playing
+};
+
+static struct player players[MAX_PLAYERS];
+static struct player *followed = NULL;
+static uint64_t play_count = 0;
+
+// Player names without the MPRIS prefix, the most wanted first
+static char *priorities[MAX_PRIORITIES];
+static int priority_count = 0;
+static char *priority_names = NULL;
+
+static GDBusConnection *bus = NULL;
+static GMainContext *context = NULL;
 static GMainLoop *loop = NULL;
-char *metadata_text = NULL;
-int end_thread = 0;
+static int end_thread = 0;
 
-void *dbus_main(void *userdata)
+
+/*
+ * Sets the players to follow first, as a comma separated list of names
+ * without the MPRIS prefix: "vlc,spotify". Returns -1 on error.
+ */
+int set_player_priority(char *list)
 {
-    metadata_text = (char*)userdata;
-    
-    // Block termination from this thread
-    sigset_t mask;
-	sigemptyset(&mask);
-    for (int i = 0; i < 64; i++)
-    {
-        sigaddset(&mask, i);
-    }
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
-    
-    if (create_dbus() != 0)
-    {
-        fprintf(stderr, "Error: Could not connect to DBus.\n");
-        return NULL;
-    }
-    
-    while (1)
+    char *save;
+
+    // The names point into the copy of the last list given
+    free(priority_names);
+    priority_names = strdup(list);
+    if (priority_names == NULL)
+        return -1;
+
+    priority_count = 0;
+    for (char *name = strtok_r(priority_names, ",", &save); name; name = strtok_r(NULL, ",", &save))
     {
-        if (get_metadata() != 0)
-        {
-            fprintf(stderr, "Error: Could not get metadata.\n");
-            return NULL;
-        }
-        if (end_thread)
+        if (priority_count == MAX_PRIORITIES)
         {
+            fprintf(stderr, "Error: at most %d players can be given a priority.\n", MAX_PRIORITIES);
+            priority_count = 0;
             break;
         }
-        sleep(3);
+        priorities[priority_count++] = name;
     }
+    if (priority_count == 0)
+    {
+        free(priority_names);
+        priority_names = NULL;
+        return -1;
+    }
+    return 0;
+}
 
-    return NULL;
+/*
+ * Position of a player in the priority list. Instances of a player
+ * ("vlc.instance1234") rank like the player itself.
+ */
+static int player_rank(const gchar *name)
+{
+    const gchar *short_name = name + strlen(MPRIS_PREFIX);
+
+    for (int i = 0; i < priority_count; i++)
+    {
+        size_t length = strlen(priorities[i]);
+        if (strncmp(short_name, priorities[i], length) == 0 &&
+            (short_name[length] == 0 || short_name[length] == '.'))
+            return i;
+    }
+    return priority_count;
 }
 
-int create_dbus()
+static struct player *find_player(const gchar *name)
 {
-    seteuid(getuid()); // This needs to run as normal user
-    tmp_error = NULL;
-
-    // Connect to DBus
-    get_names_proxy = g_dbus_proxy_new_for_bus_sync( G_BUS_TYPE_SESSION,
-                                                     G_DBUS_PROXY_FLAGS_NONE,
-                                                     NULL,
-                                                     "org.freedesktop.DBus",
-                                                     "/org/freedesktop/DBus",
-                                                     "org.freedesktop.DBus",
-                                                     NULL,
-                                                     &tmp_error);
-
-    // Check for errors
-    if (tmp_error != NULL) {
-        return -1;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (players[i].name && strcmp(players[i].name, name) == 0)
+            return &players[i];
     }
+    return NULL;
+}
 
-    seteuid(0);
-    return 0;
+static void clear_metadata(struct player *player)
+{
+    g_clear_pointer(&player->artist, g_free);
+    g_clear_pointer(&player->title, g_free);
+    g_clear_pointer(&player->album, g_free);
+    player->length = 0;
 }
 
-int get_metadata()
+/*
+ * Publishes the metadata of the player to follow, if anything changed.
+ */
+static void follow_best_player()
 {
-    // Call method (listing all players)
-    GVariant *reply = g_dbus_proxy_call_sync(get_names_proxy, "ListNames", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &tmp_error);
+    struct player *best = NULL;
 
-    // Check for errors
-    if (tmp_error != NULL) {
-        g_object_unref(get_names_proxy);
-        return -1;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        struct player *player = &players[i];
+        if (player->name == NULL || player->status != PLAYER_PLAYING)
+            continue;
+
+        if (best == NULL)
+            best = player;
+        else if (player_rank(player->name) < player_rank(best->name))
+            best = player;
+        else if (player_rank(player->name) == player_rank(best->name) && player->started > best->started)
+            best = player;
     }
 
-    // Getting array of players
-    GVariant *reply_child = g_variant_get_child_value(reply, 0);
-    gsize reply_count;
-    const gchar **names = g_variant_get_strv(reply_child, &reply_count);
-   
-    for (gsize i = 0; i < reply_count; i += 1) {
-        if (g_str_has_prefix(names[i], "org.mpris.MediaPlayer2.")) {
-            if (get_playback_status(names[i]) == 0)
-            {
-                // printf("%s is playing.\n", names[i]);
-                // Hook into this player
-                add_signal(names[i]);
-                break;
-            }
-        }
+    if (best != followed)
+    {
+        if (best)
+            printf("Following media player %s.\n", best->name + strlen(MPRIS_PREFIX));
+        followed = best;
     }
 
-    g_variant_unref(reply);
-    g_variant_unref(reply_child);
-    g_free(names);
-
-    return 0;
+    // Songs must have well defined ID3 (or equivalent) metadata
+    if (best == NULL)
+        publish_mediainfo(MEDIAINFO_NONE, NULL, NULL, NULL, 0);
+    else if (best->artist == NULL || best->title == NULL)
+        publish_mediainfo(MEDIAINFO_NO_METADATA, NULL, NULL, NULL, 0);
+    else
+        publish_mediainfo(MEDIAINFO_PLAYING, best->artist, best->title, best->album, best->length);
 }
 
-int get_playback_status(const char *player)
+static void update_metadata(struct player *player, GVariant *metadata)
 {
-    GError *tmp_error = NULL;
-
-    GDBusProxy *proxy = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      NULL,
-                                                      player,
-                                                      "/org/mpris/MediaPlayer2",
-                                                      "org.freedesktop.DBus.Properties",
-                                                      NULL,
-                                                      &tmp_error);
-
-    if (tmp_error != NULL) {
-        if (tmp_error->domain == G_IO_ERROR &&
-            tmp_error->code == G_IO_ERROR_NOT_FOUND) {
-            return -1;
+    clear_metadata(player);
+
+    // xesam:artist is a list of strings, some players send a single one
+    GVariant *artist = g_variant_lookup_value(metadata, "xesam:artist", NULL);
+    if (artist)
+    {
+        if (g_variant_is_of_type(artist, G_VARIANT_TYPE_STRING_ARRAY))
+        {
+            const gchar **artists = g_variant_get_strv(artist, NULL);
+            if (artists[0])
+                player->artist = g_strjoinv(", ", (gchar **)artists);
+            g_free(artists);
+        }
+        else if (g_variant_is_of_type(artist, G_VARIANT_TYPE_STRING))
+        {
+            player->artist = g_variant_dup_string(artist, NULL);
         }
-        return -2;
+        g_variant_unref(artist);
     }
 
-    GVariant *parameters_array[2];
+    g_variant_lookup(metadata, "xesam:title", "s", &player->title);
+    g_variant_lookup(metadata, "xesam:album", "s", &player->album);
 
-    parameters_array[0] = g_variant_new("s", "org.mpris.MediaPlayer2.Player");
-    g_variant_ref(parameters_array[0]);
-    parameters_array[1] = g_variant_new("s", "PlaybackStatus");
-    g_variant_ref(parameters_array[1]);
-    GVariant *parameters = g_variant_new_tuple(parameters_array, 2);
-    g_variant_ref(parameters);
-    
-    GVariant *reply = g_dbus_proxy_call_sync(
-        proxy, "Get", parameters, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &tmp_error);
-
-    if (tmp_error != NULL) {
-        g_object_unref(proxy);
-        return -3;
-    }
-
-    int playbackReturn = -1;
-    if (strcmp((char*)g_variant_get_data(reply), "Playing") == 0)
+    GVariant *length = g_variant_lookup_value(metadata, "mpris:length", NULL);
+    if (length)
     {
-        playbackReturn = 0;
+        if (g_variant_is_of_type(length, G_VARIANT_TYPE_INT64))
+            player->length = g_variant_get_int64(length);
+        else if (g_variant_is_of_type(length, G_VARIANT_TYPE_UINT64))
+            player->length = g_variant_get_uint64(length);
+        g_variant_unref(length);
     }
-    
-    g_object_unref(proxy);
-    g_variant_unref(reply);
-    g_variant_unref(parameters);
-    g_variant_unref(parameters_array[0]);
-    g_variant_unref(parameters_array[1]);
 
-    return playbackReturn;
+    // Empty fields are as good as none
+    if (player->artist && player->artist[0] == 0)
+        g_clear_pointer(&player->artist, g_free);
+    if (player->title && player->title[0] == 0)
+        g_clear_pointer(&player->title, g_free);
 }
 
-int add_signal(const char *player)
+/*
+ * Takes the Player properties that changed (a{sv}).
+ */
+static void update_properties(struct player *player, GVariant *properties)
 {
-    loop = g_main_loop_new (NULL, FALSE);
-
-    get_props_proxy = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
-                                                      G_DBUS_PROXY_FLAGS_NONE,
-                                                      NULL,
-                                                      player,
-                                                      "/org/mpris/MediaPlayer2",
-                                                      "org.freedesktop.DBus.Properties",
-                                                      NULL,
-                                                      &tmp_error);
-
-    if (tmp_error != NULL) {
-        if (tmp_error->domain == G_IO_ERROR &&
-            tmp_error->code == G_IO_ERROR_NOT_FOUND) {
-            return -1;
-        }
-        return -2;
+    const gchar *status;
+    if (g_variant_lookup(properties, "PlaybackStatus", "&s", &status))
+    {
+        int new_status = strcmp(status, "Playing") == 0 ? PLAYER_PLAYING :
+                         strcmp(status, "Paused") == 0 ? PLAYER_PAUSED : PLAYER_STOPPED;
+        if (new_status == PLAYER_PLAYING && player->status != PLAYER_PLAYING)
+            player->started = ++play_count;
+        player->status = new_status;
     }
 
-    GVariant *parameters;
-    GVariant *parameters_array[2];
-
-    parameters_array[0] = g_variant_new("s", "org.mpris.MediaPlayer2.Player");
-    parameters_array[1] = g_variant_new("s", "Metadata");
-    parameters = g_variant_new_tuple(parameters_array, 2);
+    GVariant *metadata = g_variant_lookup_value(properties, "Metadata", G_VARIANT_TYPE_VARDICT);
+    if (metadata)
+    {
+        update_metadata(player, metadata);
+        g_variant_unref(metadata);
+    }
+}
 
-    GVariant *reply = g_dbus_proxy_call_sync(
-        get_props_proxy, "Get", parameters, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &tmp_error);
+static void on_get_all(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    gchar *name = user_data;
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
 
-    if (tmp_error != NULL) {
-        g_object_unref(get_props_proxy);
-        return -2;
+    struct player *player = find_player(name);
+    if (reply && player)
+    {
+        GVariant *properties = g_variant_get_child_value(reply, 0);
+        update_properties(player, properties);
+        g_variant_unref(properties);
+        follow_best_player();
+    }
+    else if (error)
+    {
+        fprintf(stderr, "Error: could not get the state of %s: %s\n", name, error->message);
     }
 
-    GVariant *props;
+    if (reply)
+        g_variant_unref(reply);
+    g_clear_error(&error);
+    g_free(name);
+}
 
-    g_variant_get(reply, "(v)", &props);
-    
-    export_metadata(props);
+/*
+ * Asks a player for its whole state, when it appears or when it does not
+ * tell the new values of its properties.
+ */
+static void query_player(struct player *player)
+{
+    g_dbus_connection_call(bus, player->name, MPRIS_PATH, "org.freedesktop.DBus.Properties", "GetAll",
+                           g_variant_new("(s)", MPRIS_PLAYER), G_VARIANT_TYPE("(a{sv})"),
+                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_get_all, g_strdup(player->name));
+}
 
-    g_signal_connect(get_props_proxy,
-                    "g-signal",
-                    G_CALLBACK (on_signal),
-                    NULL);
+static void add_player(const gchar *name, const gchar *owner)
+{
+    struct player *player = find_player(name);
 
-    g_signal_connect(get_props_proxy,
-                    "notify::g-name-owner",
-                    G_CALLBACK (on_name_owner_notify),
-                    NULL);
+    if (player == NULL)
+    {
+        for (int i = 0; i < MAX_PLAYERS && player == NULL; i++)
+        {
+            if (players[i].name == NULL)
+                player = &players[i];
+        }
+        if (player == NULL)
+        {
+            fprintf(stderr, "Error: too many media players, %s is ignored.\n", name);
+            return;
+        }
+        player->name = g_strdup(name);
+        player->status = PLAYER_STOPPED;
+    }
 
-    g_main_loop_run(loop);
+    g_free(player->owner);
+    player->owner = g_strdup(owner);
+    query_player(player);
+}
 
-    g_object_unref(get_props_proxy);
-    g_variant_unref(reply);
-    
-    return 0;
+static void remove_player(const gchar *name)
+{
+    struct player *player = find_player(name);
+    if (player == NULL)
+        return;
+
+    clear_metadata(player);
+    g_clear_pointer(&player->name, g_free);
+    g_clear_pointer(&player->owner, g_free);
+    follow_best_player();
 }
 
-void export_metadata(GVariant *metadata)
+static void on_name_owner_changed(GDBusConnection *connection, const gchar *sender, const gchar *path,
+                                  const gchar *interface, const gchar *signal, GVariant *parameters,
+                                  gpointer user_data)
 {
-    gchar **artists = NULL, *title = NULL;
-    g_variant_lookup(metadata, "xesam:artist", "^a&s", &artists);
-    g_variant_lookup(metadata, "xesam:title", "s", &title);
+    const gchar *name, *old_owner, *new_owner;
+    g_variant_get(parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
 
-    // gchar *value_str = g_variant_print(metadata, TRUE);
-    // printf("md: %s\n", (char*)value_str);
+    if (!g_str_has_prefix(name, MPRIS_PREFIX))
+        return;
 
-    // Song must have well defined ID3 (or equivalent) metadata
-    if (artists && title)
-    {
-        snprintf(metadata_text, METADATA_TEXT_SIZE, "%s - %s", g_strjoinv(", ", artists), title);
-    }
+    if (new_owner[0] == 0)
+        remove_player(name);
     else
+        add_player(name, new_owner);
+}
+
+static void on_properties_changed(GDBusConnection *connection, const gchar *sender, const gchar *path,
+                                  const gchar *interface, const gchar *signal, GVariant *parameters,
+                                  gpointer user_data)
+{
+    const gchar *changed_interface;
+    GVariant *changed;
+    const gchar **invalidated;
+    g_variant_get(parameters, "(&s@a{sv}^a&s)", &changed_interface, &changed, &invalidated);
+
+    // Signals come from the unique name of the player
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        snprintf(metadata_text, METADATA_TEXT_SIZE, "NO METADATA");
-        // This only works in signal, so it's ok
-        g_main_loop_quit(loop);
+        struct player *player = &players[i];
+        if (player->name == NULL || player->owner == NULL || strcmp(player->owner, sender) != 0)
+            continue;
+
+        update_properties(player, changed);
+        if (g_strv_contains(invalidated, "Metadata") || g_strv_contains(invalidated, "PlaybackStatus"))
+            query_player(player);
     }
+    follow_best_player();
 
-    g_free(artists);
-    g_free(title);
+    g_variant_unref(changed);
+    g_free(invalidated);
 }
 
-void on_signal (GDBusProxy *proxy, gchar *sender_name, gchar *signal_name, GVariant *parameters, gpointer user_data)
+static void on_get_name_owner(GObject *source, GAsyncResult *result, gpointer user_data)
 {
-    int exit_loop = 0;
-    gchar *parameters_str;
+    gchar *name = user_data;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, NULL);
 
-    GVariant *child = g_variant_get_child_value(parameters, 1);
+    if (reply)
+    {
+        const gchar *owner;
+        g_variant_get(reply, "(&s)", &owner);
+        add_player(name, owner);
+        g_variant_unref(reply);
+    }
+    g_free(name);
+}
 
-    // gchar *value_str = g_variant_print(child, TRUE);
-    // printf("md: %s\n", (char*)value_str);
+static void on_list_names(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
 
-    if (g_variant_lookup(child, "PlaybackStatus", "s", &parameters_str))
+    if (reply == NULL)
     {
-        if (strcmp((char*)parameters_str, "Paused") == 0 || strcmp((char*)parameters_str, "Stopped") == 0)
-        {
-            exit_loop = 1;
-        }
+        fprintf(stderr, "Error: could not list the media players: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
 
-        g_free (parameters_str);
+    GVariantIter *names;
+    const gchar *name;
+    g_variant_get(reply, "(as)", &names);
+    while (g_variant_iter_loop(names, "&s", &name))
+    {
+        if (g_str_has_prefix(name, MPRIS_PREFIX))
+            g_dbus_connection_call(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                                   "GetNameOwner", g_variant_new("(s)", name), G_VARIANT_TYPE("(s)"),
+                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_get_name_owner, g_strdup(name));
     }
-    else if (g_variant_lookup(child, "Metadata", "a{sv}", &parameters_str))
+    g_variant_iter_free(names);
+    g_variant_unref(reply);
+}
+
+void *dbus_main(void *userdata)
+{
+    // Block termination from this thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int i = 0; i < 64; i++)
     {
-        GVariant *metadata = g_variant_lookup_value(child, "Metadata", G_VARIANT_TYPE_DICTIONARY);
-        export_metadata(metadata);
-        
-        g_variant_unref(metadata);
+        sigaddset(&mask, i);
+    }
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // Callbacks are dispatched by the loop of this thread
+    context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+    __atomic_store_n(&loop, g_main_loop_new(context, FALSE), __ATOMIC_SEQ_CST);
+
+    GError *error = NULL;
+    seteuid(getuid()); // This needs to run as normal user
+    bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    seteuid(0);
+    if (bus == NULL)
+    {
+        fprintf(stderr, "Error: Could not connect to DBus: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
     }
-    
-    g_variant_unref(child);
 
-    if (exit_loop)
+    // Subscribe first, so that no player can slip between the list and the signals
+    guint owner_id = g_dbus_connection_signal_subscribe(bus, "org.freedesktop.DBus", "org.freedesktop.DBus",
+        "NameOwnerChanged", "/org/freedesktop/DBus", "org.mpris.MediaPlayer2",
+        G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE, on_name_owner_changed, NULL, NULL);
+    guint properties_id = g_dbus_connection_signal_subscribe(bus, NULL, "org.freedesktop.DBus.Properties",
+        "PropertiesChanged", MPRIS_PATH, MPRIS_PLAYER,
+        G_DBUS_SIGNAL_FLAGS_NONE, on_properties_changed, NULL, NULL);
+
+    g_dbus_connection_call(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                           "ListNames", NULL, G_VARIANT_TYPE("(as)"),
+                           G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_list_names, NULL);
+
+    // Sequentially consistent with quit_dbus_thread(): at least one of the
+    // two threads sees the store of the other
+    if (!__atomic_load_n(&end_thread, __ATOMIC_SEQ_CST))
+        g_main_loop_run(loop);
+
+    g_dbus_connection_signal_unsubscribe(bus, owner_id);
+    g_dbus_connection_signal_unsubscribe(bus, properties_id);
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        snprintf(metadata_text, METADATA_TEXT_SIZE, "NO MEDIA");
-        g_main_loop_quit(loop);
+        clear_metadata(&players[i]);
+        g_clear_pointer(&players[i].name, g_free);
+        g_clear_pointer(&players[i].owner, g_free);
     }
+    g_object_unref(bus);
+
+    return NULL;
 }
 
-void on_name_owner_notify (GObject *object, GParamSpec *pspec, gpointer user_data)
+static gboolean stop_loop(gpointer data)
 {
-    snprintf(metadata_text, METADATA_TEXT_SIZE, "NO MEDIA");
-    g_main_loop_quit(loop);
+    g_main_loop_quit(data);
+    return G_SOURCE_REMOVE;
 }
 
 void quit_dbus_thread()
 {
-    end_thread = 1;
-    g_main_loop_quit(loop);
-}
\ No newline at end of file
+    __atomic_store_n(&end_thread, 1, __ATOMIC_SEQ_CST);
+    GMainLoop *running = __atomic_load_n(&loop, __ATOMIC_SEQ_CST);
+    if (running)
+    {
+        // Queued on the context rather than quitting directly, which would
+        // be lost if the loop has not started running yet
+        GSource *source = g_idle_source_new();
+        g_source_set_callback(source, stop_loop, running, NULL);
+        g_source_attach(source, context);
+        g_source_unref(source);
+    }
+}
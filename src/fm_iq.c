@@ -0,0 +1,185 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    fm_iq.c: FM modulation of the multiplex into complex baseband (IQ).
+*/
+
+/* The multiplex is brought to the IQ rate by a short polyphase FIR filter
+   (IQ_TAPS samples of the multiplex per output sample), then integrated
+   into the phase of the carrier. Linear interpolation would be cheaper,
+   but at four times the MPX rate it loses about 1.8 dB of RDS at 57 kHz
+   and leaves images of it at about -21 dB; the filter, a windowed sinc
+   cut at half the MPX rate, keeps 57 kHz within 0.1 dB and the images
+   below -50 dB. Its output lags the multiplex by IQ_TAPS/2 samples. The phase is a 32-bit
+   accumulator, which wraps around by itself once per turn, and its top
+   bits index a sine table holding one cycle plus a quarter, where the
+   cosine is read a quarter of a cycle after the sine.
+
+   Each block is done in two passes: the phase increments for the whole
+   block first, then the accumulation and the table lookups. Both loops
+   are straight runs over arrays, which keeps them fast: the modulator
+   takes a small share of the time of the multiplex generator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "fm_iq.h"
+#include "subcarrier.h"
+
+#define TABLE_BITS  14
+#define TABLE_SIZE  (1 << TABLE_BITS)
+
+#define IQ_TAPS     8
+#define IQ_PHASES   256         // positions between two MPX samples
+
+static float *sine = NULL;          // TABLE_SIZE + TABLE_SIZE/4 entries
+static uint32_t *increment = NULL;  // phase increments of a block
+static int increment_size = 0;
+
+static float coef[(IQ_PHASES + 1) * IQ_TAPS];   // filter, for each position
+static float *input = NULL;         // end of the previous block, then the block
+static int input_size = 0;
+
+static int step_num, step_den;      // MPX samples per IQ sample, reduced
+static int position;                // in 1/step_den of an MPX sample
+static uint32_t phase;
+static double scale;                // phase increment per unit of multiplex
+
+
+/*
+ * Prepares the modulator for an IQ rate of at least the MPX rate.
+ * 'deviation' is the frequency shift in Hz for a sample of 10, full scale
+ * for the generator; a negative deviation lowers the frequency for
+ * positive samples, as the clock divider of the transmitter does.
+ * Returns -1 on error.
+ */
+int fm_iq_open(int mpx_rate, int iq_rate, double deviation) {
+    if(iq_rate < mpx_rate) {
+        fprintf(stderr, "Error: the IQ rate must be at least the MPX rate (%d Hz).\n", mpx_rate);
+        return -1;
+    }
+    // Beyond half the IQ rate, the carrier would alias and the phase
+    // increments of full scale would not fit in 32 bits
+    if(fabs(deviation) >= iq_rate / 2.) {
+        fprintf(stderr, "Error: the deviation (%.0f Hz) must be less than half the IQ rate.\n", fabs(deviation));
+        return -1;
+    }
+
+    int g = gcd(mpx_rate, iq_rate);
+    step_num = mpx_rate / g;
+    step_den = iq_rate / g;
+    position = 0;
+    phase = 1 << (31 - TABLE_BITS); // rounds the index to the nearest entry
+    scale = deviation / 10 / iq_rate * 4294967296.;
+
+    sine = malloc((TABLE_SIZE + TABLE_SIZE/4) * sizeof(float));
+    if(sine == NULL) return -1;
+    for(int i=0; i<TABLE_SIZE + TABLE_SIZE/4; i++) {
+        sine[i] = sin(2 * M_PI * i / TABLE_SIZE);
+    }
+
+    // Hamming windowed sinc. Each set of taps is normalised, so that a
+    // constant multiplex gives exactly the same carrier offset.
+    for(int p=0; p<=IQ_PHASES; p++) {
+        float *h = coef + p * IQ_TAPS;
+        double sum = 0;
+        for(int j=0; j<IQ_TAPS; j++) {
+            double t = j - (IQ_TAPS/2 - 1) - (double)p / IQ_PHASES;
+            double x = M_PI * t;
+            h[j] = (t == 0 ? 1 : sin(x) / x) * (.54 + .46 * cos(2 * M_PI * t / IQ_TAPS));
+            sum += h[j];
+        }
+        for(int j=0; j<IQ_TAPS; j++) h[j] /= sum;
+    }
+    input = calloc(IQ_TAPS - 1, sizeof(float));
+    if(input == NULL) return -1;
+    input_size = IQ_TAPS - 1;
+    return 0;
+}
+
+/* Number of IQ samples at most produced from 'count' MPX samples */
+int fm_iq_max_output(int count) {
+    return (int)(((int64_t)count * step_den + step_num - 1) / step_num) + 1;
+}
+
+/*
+ * Modulates 'count' samples of the multiplex into interleaved I and Q
+ * samples in 'iq'. Returns the number of IQ samples, or -1 on error.
+ */
+int fm_iq_modulate(const float *mpx, int count, float *iq) {
+    int max = fm_iq_max_output(count);
+    if(max > increment_size) {
+        free(increment);
+        increment = malloc(max * sizeof(uint32_t));
+        if(increment == NULL) return -1;
+        increment_size = max;
+    }
+
+    if(count + IQ_TAPS - 1 > input_size) {
+        float *bigger = realloc(input, (count + IQ_TAPS - 1) * sizeof(float));
+        if(bigger == NULL) return -1;
+        input = bigger;
+        input_size = count + IQ_TAPS - 1;
+    }
+    memcpy(input + IQ_TAPS - 1, mpx, count * sizeof(float));
+
+    // Phase increments, between MPX samples i + IQ_TAPS/2 - 1 and i + IQ_TAPS/2
+    // of 'input', for the nearest of the IQ_PHASES positions
+    int n = 0;
+    for(int i=0; i<count; i++) {
+        const float *x = input + i;
+        for(; position < step_den; position += step_num) {
+            int p = ((int64_t)position * IQ_PHASES + step_den/2) / step_den;
+            const float *h = coef + p * IQ_TAPS;
+            float v = 0;
+            for(int j=0; j<IQ_TAPS; j++) v += h[j] * x[j];
+            // Peaks above full scale wrap around, like the phase itself
+            increment[n++] = (uint32_t)llrint(v * scale);
+        }
+        position -= step_den;
+    }
+    memmove(input, input + count, (IQ_TAPS - 1) * sizeof(float));
+
+    // Carrier phase and its sine and cosine
+    uint32_t p = phase;
+    for(int i=0; i<n; i++) {
+        p += increment[i];
+        uint32_t index = p >> (32 - TABLE_BITS);
+        iq[2*i] = sine[index + TABLE_SIZE/4];
+        iq[2*i+1] = sine[index];
+    }
+    phase = p;
+
+    return n;
+}
+
+void fm_iq_close() {
+    free(sine);
+    sine = NULL;
+    free(increment);
+    increment = NULL;
+    increment_size = 0;
+    free(input);
+    input = NULL;
+    input_size = 0;
+}
@@ -0,0 +1,29 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FM_IQ_H
+#define FM_IQ_H
+
+extern int fm_iq_open(int mpx_rate, int iq_rate, double deviation);
+extern int fm_iq_max_output(int count);
+extern int fm_iq_modulate(const float *mpx, int count, float *iq);
+extern void fm_iq_close();
+
+#endif /* FM_IQ_H */
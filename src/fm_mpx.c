@@ -26,38 +26,73 @@
 */
 
 #include <sndfile.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <math.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include "rds.h"
-#include "pulse_module.h"
+#include "fm_mpx.h"
 #include "control_pipe.h"
+#include "audio_ring.h"
+#include "raw_input.h"
+#include "subcarrier.h"
+#include "lowpass.h"
 
 
-#define PI 3.141592654
 #define	SIGPA 64
 
+#ifdef NO_PULSE
+// Built without PulseAudio, as in libpifmrds_core.a: there is no sink to
+// capture
+static int pulse_capture_open(struct audio_ring *ring) { return -1; }
+static int pulse_capture_rate() { return 44100; }
+static uint64_t pulse_capture_latency() { return 0; }
+static void pulse_capture_close() {}
+#else
+#include "pulse_module.h"
+#endif
+
 
-#define FIR_HALF_SIZE 30 
-#define FIR_SIZE (2*FIR_HALF_SIZE-1)
+// Drift compensation for live input: amount of input to keep buffered,
+// gains of the PI controller and maximum correction of the resampling ratio
+#define DRIFT_TARGET_MS 100
+#define DRIFT_AVERAGING .05
+#define DRIFT_KP 3e-3
+#define DRIFT_KI 1e-6
+#define DRIFT_MAX_CORRECTION 5e-3
+
+// Length of the ring between an audio reader thread and the generator
+#define INPUT_RING_MS 1000
+
+// Input quieter than SILENCE_LEVEL (about -80 dBFS) for SILENCE_HOLD_MS puts
+// the generator in its idle path; audio fades back in over FADE_MS
+#define SILENCE_LEVEL 1e-4
+#define SILENCE_HOLD_MS 2000
+#define FADE_MS 20
 
 
 size_t length;
+int mpx_rate;
 
 // coefficients of the low-pass FIR filter
 float low_pass_fir[FIR_HALF_SIZE];
 
 
-float carrier_38[] = {0.0, 0.8660254037844386, 0.8660254037844388, 1.2246467991473532e-16, -0.8660254037844384, -0.8660254037844386};
-
-float carrier_19[] = {0.0, 0.5, 0.8660254037844386, 1.0, 0.8660254037844388, 0.5, 1.2246467991473532e-16, -0.5, -0.8660254037844384, -1.0, -0.8660254037844386, -0.5};
-    
-int phase_38 = 0;
-int phase_19 = 0;
+// Subcarriers of the current block: 19 kHz pilot, 38 kHz stereo, 57 kHz RDS
+float *carrier_19;
+float *carrier_38;
+float *carrier_57;
 
 
 float downsample_factor;
+float nominal_downsample_factor;
+int nominal_rate;
 
 
 float *audio_buffer;
@@ -65,14 +100,41 @@ int audio_index = 0;
 int audio_len = 0;
 float audio_pos;
 
+struct mpx_audio_status audio_status = { .source = "none" };
+
 float fir_buffer_mono[FIR_SIZE] = {0};
 float fir_buffer_stereo[FIR_SIZE] = {0};
 int fir_index = 0;
 int channels;
 
 SNDFILE *inf;
-int pa_mode = 0; // flag
-int modulefd; // fd for pulse audio pipe
+int loop_input = 0; // a file, rewound at its end
+
+// While idle (silent or starved input), the audio filters are skipped and
+// only the pilot is added to RDS, so that receivers stay locked in stereo
+int idle_state = MPX_AUDIO_PLAYING;
+int silent_frames = 0;
+int silence_hold;
+int fade_pos = 0;
+int fade_length;
+// Set by the first block read: running dry before it is not a dropout
+int audio_started = 0;
+
+// Audio pushed by a reader thread (PulseAudio capture or raw PCM) instead
+// of read from 'inf'
+struct audio_ring input_ring;
+int ring_input = 0;
+int pulse_input = 0;
+
+// Live input (PulseAudio sink, a pipe on stdin or a named pipe) is produced on another
+// clock than the one the DMA engine consumes samples at, so the resampling
+// ratio is continuously steered to keep the buffered input constant.
+int live_fd = -1;
+int live_frame_size;
+float drift_target;
+float drift_fill = 0;
+float drift_integral = 0;
+int drift_locked = 0;
 
 float *alloc_empty_buffer(size_t length) {
     float *p = malloc(length * sizeof(float));
@@ -84,32 +146,165 @@ float *alloc_empty_buffer(size_t length) {
 }
 
 
+/* Size in bytes of one sample of a libsndfile format */
+static int sample_size(int format) {
+    switch(format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_PCM_U8: return 1;
+        case SF_FORMAT_PCM_16: return 2;
+        case SF_FORMAT_PCM_24: return 3;
+        case SF_FORMAT_DOUBLE: return 8;
+        default: return 4;
+    }
+}
+
+/* Measures how much live input is buffered (in the pipe and in audio_buffer)
+   and adjusts the resampling ratio with a PI controller so that this amount
+   stays at DRIFT_TARGET_MS. Latency then stays constant however far the
+   clocks of the audio source and of the DMA engine drift apart.
+ */
+static void steer_resampler() {
+    float fill = audio_len / channels;
+    if(ring_input) fill += audio_ring_fill(&input_ring) / channels;
+    if(pulse_input) {
+        // What the sound server holds for us is buffered input too (in µs)
+        fill += pulse_capture_latency() * nominal_rate / 1e6;
+    } else {
+        int bytes;
+        if(ioctl(live_fd, FIONREAD, &bytes) < 0) return;
+        fill += (float)bytes / live_frame_size;
+    }
+
+    if(fill == 0) {
+        // Underrun: nothing to steer until the source is back
+        drift_locked = 0;
+        return;
+    }
+    if(! drift_locked) {
+        // Wait for the buffer to fill up before taking control
+        if(fill < drift_target) return;
+        drift_locked = 1;
+        drift_fill = fill;
+    }
+
+    // The source writes in bursts, so the level is averaged first
+    drift_fill += DRIFT_AVERAGING * (fill - drift_fill);
+
+    float error = (drift_fill - drift_target) / drift_target;
+    drift_integral += DRIFT_KI * error;
+    if(drift_integral > DRIFT_MAX_CORRECTION) drift_integral = DRIFT_MAX_CORRECTION;
+    if(drift_integral < -DRIFT_MAX_CORRECTION) drift_integral = -DRIFT_MAX_CORRECTION;
+
+    float correction = DRIFT_KP * error + drift_integral;
+    if(correction > DRIFT_MAX_CORRECTION) correction = DRIFT_MAX_CORRECTION;
+    if(correction < -DRIFT_MAX_CORRECTION) correction = -DRIFT_MAX_CORRECTION;
+
+    // More input than wanted: consume it faster, i.e. fewer output samples
+    // per input frame
+    downsample_factor = nominal_downsample_factor / (1 + correction);
+}
+
+/* Reads up to 'count' samples of the audio source */
+static int read_audio(float *buffer, int count) {
+    if(ring_input) return audio_ring_read(&input_ring, buffer, count);
+    return sf_read_float(inf, buffer, count);
+}
+
+/* Updates the status with the block of audio just read */
+static void measure_levels(int count) {
+    float peak[2] = {0, 0};
+    int c = channels > 1 ? 1 : 0;
+
+    for(int i=0; i<count; i+=channels) {
+        float l = fabsf(audio_buffer[i]);
+        float r = fabsf(audio_buffer[i+c]);
+        if(l > peak[0]) peak[0] = l;
+        if(r > peak[1]) peak[1] = r;
+    }
+    audio_status.peak[0] = peak[0];
+    audio_status.peak[1] = peak[1];
+    audio_status.frames += count / channels;
+    if(count > 0) audio_started = 1;
+}
+
 int fm_mpx_open(char *filename, int pulseaudio, size_t len) {
     length = len;
 
+    // The generator may be opened again after fm_mpx_close()
+    audio_index = audio_len = 0;
+    fir_index = 0;
+    bzero(fir_buffer_mono, sizeof(fir_buffer_mono));
+    bzero(fir_buffer_stereo, sizeof(fir_buffer_stereo));
+    idle_state = MPX_AUDIO_PLAYING;
+    silent_frames = fade_pos = 0;
+    audio_started = 0;
+    ring_input = pulse_input = loop_input = 0;
+    live_fd = -1;
+    drift_locked = 0;
+    drift_integral = drift_fill = 0;
+    audio_pos = 0;
+
+    mpx_rate = get_rds_sample_rate();
+    fade_length = mpx_rate * FADE_MS / 1000;
+    if(subcarrier_init(mpx_rate) < 0) return -1;
+    carrier_19 = alloc_empty_buffer(length);
+    carrier_38 = alloc_empty_buffer(length);
+    carrier_57 = alloc_empty_buffer(length);
+    if(carrier_19 == NULL || carrier_38 == NULL || carrier_57 == NULL) return -1;
+
     if(filename != NULL || pulseaudio)
     {
         // Open the input file
         SF_INFO sfinfo;
-        pa_mode = 1;
 
         // stdin, pulse sink or file on the filesystem?
         if(pulseaudio)
         {
-            pulse_module();
-            modulefd = open("/tmp/pifmfifo", O_RDONLY);
-            fcntl(modulefd, F_SETFL, fcntl(modulefd, F_GETFL) | O_NONBLOCK);
-
-            sfinfo.samplerate = 44100;
+            sfinfo.samplerate = pulse_capture_rate();
             sfinfo.channels = 2;
-            sfinfo.format = SF_FORMAT_RAW | SF_FORMAT_PCM_16;
+            sfinfo.format = SF_FORMAT_RAW | SF_FORMAT_FLOAT;
 
-            if(! (inf = sf_open_fd(modulefd, SFM_READ, &sfinfo, 0))) {
-                fprintf(stderr, "Error: could not open pulse sink.\n") ;
+            if(audio_ring_init(&input_ring, sfinfo.samplerate * sfinfo.channels * INPUT_RING_MS / 1000, 2) < 0 ||
+               pulse_capture_open(&input_ring) < 0) {
+                fprintf(stderr, "Error: could not capture from the PulseAudio sink.\n") ;
+                audio_ring_free(&input_ring);
                 return -1;
             } else {
                 printf("Using PulseAudio sink for audio input.\n");
             }
+            strcpy(audio_status.source, "pulse");
+            inf = NULL;
+            ring_input = 1;
+            pulse_input = 1;
+
+        } else if(raw_input_format()) {
+            // Headerless PCM, described on the command line
+            int fd = filename[0] == '-' ? fileno(stdin) : open(filename, O_RDONLY);
+            if(fd < 0) {
+                fprintf(stderr, "Error: could not open input file %s.\n", filename);
+                return -1;
+            }
+            sfinfo.samplerate = raw_input_rate();
+            sfinfo.channels = raw_input_channels();
+
+            if(audio_ring_init(&input_ring, sfinfo.samplerate * sfinfo.channels * INPUT_RING_MS / 1000, sfinfo.channels) < 0 ||
+               raw_input_open(fd, &input_ring) < 0) {
+                fprintf(stderr, "Error: could not read raw audio from %s.\n", filename);
+                audio_ring_free(&input_ring);
+                if(fd != fileno(stdin)) close(fd);
+                return -1;
+            }
+            if(filename[0] == '-') {
+                printf("Using stdin for raw audio input.\n");
+                strcpy(audio_status.source, "stdin");
+            } else {
+                printf("Using raw audio from: %s\n", filename);
+                snprintf(audio_status.source, sizeof(audio_status.source), "%s", filename);
+            }
+            inf = NULL;
+            ring_input = 1;
+            struct stat st;
+            if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) live_fd = fd;
 
         } else if(filename[0] == '-') {
             if(! (inf = sf_open_fd(fileno(stdin), SFM_READ, &sfinfo, 0))) {
@@ -118,6 +313,9 @@ int fm_mpx_open(char *filename, int pulseaudio, size_t len) {
             } else {
                 printf("Using stdin for audio input.\n");
             }
+            strcpy(audio_status.source, "stdin");
+            struct stat st;
+            if(fstat(fileno(stdin), &st) == 0 && S_ISFIFO(st.st_mode)) live_fd = fileno(stdin);
         } else {
             if(! (inf = sf_open(filename, SFM_READ, &sfinfo))) {
                 fprintf(stderr, "Error: could not open input file %s.\n", filename) ;
@@ -125,38 +323,36 @@ int fm_mpx_open(char *filename, int pulseaudio, size_t len) {
             } else {
                 printf("Using audio file: %s\n", filename);
             }
+            loop_input = 1;
+            snprintf(audio_status.source, sizeof(audio_status.source), "%s", filename);
         }
 
         int in_samplerate = sfinfo.samplerate;
-        downsample_factor = 228000. / in_samplerate;
+        downsample_factor = (float)mpx_rate / in_samplerate;
+        nominal_downsample_factor = downsample_factor;
+        nominal_rate = in_samplerate;
     
         printf("Input: %d Hz, upsampling factor: %.2f\n", in_samplerate, downsample_factor);
 
         channels = sfinfo.channels;
+        audio_status.rate = in_samplerate;
+        audio_status.channels = channels;
+        silence_hold = in_samplerate * SILENCE_HOLD_MS / 1000;
         if(channels > 1) {
             printf("%d channels, generating stereo multiplex.\n", channels);
         } else {
             printf("1 channel, monophonic operation.\n");
         }
+
+        if(live_fd >= 0 || pulse_input) {
+            live_frame_size = raw_input_format() ? raw_input_frame_size() : channels * sample_size(sfinfo.format);
+            drift_target = in_samplerate * DRIFT_TARGET_MS / 1000.;
+            printf("Live input, keeping %d ms buffered to compensate clock drift.\n", DRIFT_TARGET_MS);
+        }
     
     
         // Create the low-pass FIR filter
-        float cutoff_freq = 15000 * .8;
-        if(in_samplerate/2 < cutoff_freq) cutoff_freq = in_samplerate/2 * .8;
-    
-    
-    
-        low_pass_fir[FIR_HALF_SIZE-1] = 2 * cutoff_freq / 228000 /2;
-        // Here we divide this coefficient by two because it will be counted twice
-        // when applying the filter
-
-        // Only store half of the filter since it is symmetric
-        for(int i=1; i<FIR_HALF_SIZE; i++) {
-            low_pass_fir[FIR_HALF_SIZE-1-i] = 
-                sin(2 * PI * cutoff_freq * i / 228000) / (PI * i)      // sinc
-                * (.54 - .46 * cos(2*PI * (i+FIR_HALF_SIZE) / (2*FIR_HALF_SIZE)));
-                                                              // Hamming window
-        }
+        float cutoff_freq = lowpass_init(low_pass_fir, in_samplerate, mpx_rate);
         printf("Created low-pass FIR filter for audio channels, with cutoff at %.1f Hz\n", cutoff_freq);
     
         /*
@@ -178,121 +374,196 @@ int fm_mpx_open(char *filename, int pulseaudio, size_t len) {
     return 0;
 }
 
+/* Leaves the idle path at the start of a block of audio: the filters start
+   from silence and the audio fades in.
+ */
+static void resume_audio() {
+    bzero(fir_buffer_mono, sizeof(fir_buffer_mono));
+    bzero(fir_buffer_stereo, sizeof(fir_buffer_stereo));
+    fade_pos = 0;
+    idle_state = MPX_AUDIO_PLAYING;
+    audio_status.state = idle_state;
+}
+
+static void enter_idle(int state) {
+    if(state == MPX_AUDIO_STARVED) {
+        if(idle_state == MPX_AUDIO_PLAYING && audio_started) audio_status.dropouts++;
+        // Build the buffer up again before playing
+        drift_locked = 0;
+    }
+    idle_state = state;
+    audio_status.state = state;
+}
+
+/* Follows the level of each block read, to switch between the audio and the
+   idle paths.
+ */
+static void track_silence(int count) {
+    if(audio_status.peak[0] < SILENCE_LEVEL && audio_status.peak[1] < SILENCE_LEVEL) {
+        silent_frames += count / channels;
+        if(silent_frames >= silence_hold && idle_state == MPX_AUDIO_PLAYING) enter_idle(MPX_AUDIO_SILENT);
+        else if(idle_state == MPX_AUDIO_STARVED) enter_idle(MPX_AUDIO_SILENT);
+    } else {
+        silent_frames = 0;
+        if(idle_state != MPX_AUDIO_PLAYING) resume_audio();
+    }
+}
+
+/* Moves to the next input frame, reading a new block when needed. Returns 1
+   if a frame is available, 0 if live input has run dry, and -1 on error.
+ */
+static int next_frame() {
+    if(audio_len > channels) {
+        audio_index += channels;
+        audio_len -= channels;
+        return 1;
+    }
+
+    for(int j=0; j<2; j++) { // one retry
+        audio_len = read_audio(audio_buffer, length);
+        if (audio_len < 0) {
+            fprintf(stderr, "Error reading audio\n");
+            return -1;
+        }
+        if(audio_len > 0) break;
+
+        // Live input keeps RDS and the pilot on air until it is back
+        if(! loop_input) return 0;
+        if(sf_seek(inf, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "Could not rewind in audio file, terminating\n");
+            return -1;
+        }
+    }
+    if(audio_len == 0) return 0;
+
+    measure_levels(audio_len);
+    track_silence(audio_len);
+    audio_index = 0;
+    return 1;
+}
+
 // samples provided by this function are in 0..10: they need to be divided by
 // 10 after.
 int fm_mpx_get_samples(float *mpx_buffer) {
-    get_rds_samples(mpx_buffer, length);
-
-    if(inf == NULL) return 0; // if there is no audio, stop here
+    // The carriers move on even when there is no audio to put on them
+    get_subcarriers(carrier_19, carrier_38, carrier_57, length);
+    get_rds_samples(mpx_buffer, carrier_57, length);
+
+    if(inf == NULL && !ring_input) return 0; // if there is no audio, stop here
+
+    int starved = 0;
+    if(live_fd >= 0 || pulse_input) {
+        steer_resampler();
+        // After an underrun, live input is only played again once the drift
+        // compensation has its buffer back, not in bits as it trickles in
+        if(idle_state == MPX_AUDIO_STARVED && !drift_locked) starved = 1;
+    }
     
     for(int i=0; i<length; i++) {
-        if(audio_pos >= downsample_factor) {
+        if(audio_pos >= downsample_factor && !starved) {
             audio_pos -= downsample_factor;
+
+            int ret = next_frame();
+            if(ret < 0) return -1;
+            if(ret == 0) {
+                // Try again with the next block
+                starved = 1;
+                enter_idle(MPX_AUDIO_STARVED);
+            }
+        }
+        // The input does not move while there is none
+        if(!starved) audio_pos++;
+
+        if(idle_state == MPX_AUDIO_PLAYING) {
+            // First store the current sample(s) into the FIR filter's ring buffer
+            if(channels == 1) {
+                // Same level as a stereo input carrying the same sound on both channels
+                fir_buffer_mono[fir_index] = 2 * audio_buffer[audio_index];
+            } else {
+                // In stereo operation, generate sum and difference signals
+                fir_buffer_mono[fir_index] = 
+                    audio_buffer[audio_index] + audio_buffer[audio_index+1];
+                fir_buffer_stereo[fir_index] = 
+                    audio_buffer[audio_index] - audio_buffer[audio_index+1];
+            }
+            fir_index++;
+            if(fir_index >= FIR_SIZE) fir_index = 0;
+            
+            // Now apply the FIR low-pass filter
             
-            if(audio_len == 0) {
-                for(int j=0; j<2; j++) { // one retry
-                    audio_len = sf_read_float(inf, audio_buffer, length);
-                    if (audio_len == 0 && pa_mode) { // Program needs to keep running, even if no desktop audio - for RDS mainly. We introduce artificial latency.
-                            usleep(10000);
-                            return 0;
-                    }
-                    
-                    if (audio_len < 0) {
-                        fprintf(stderr, "Error reading audio\n");
-                        return -1;
-                    }
-                    if(audio_len == 0) {
-                        if( sf_seek(inf, 0, SEEK_SET) < 0 ) {
-                            fprintf(stderr, "Could not rewind in audio file, terminating\n");
-                            return -1;
-                        }
-                    } else {
-                        break;
-                    }
+            /* As the FIR filter is symmetric, we do not multiply all 
+               the coefficients independently, but two-by-two, thus reducing
+               the total number of multiplications by a factor of two
+            */
+            float out_mono = 0;
+            float out_stereo = 0;
+            int ifbi = fir_index;  // ifbi = increasing FIR Buffer Index
+            int dfbi = fir_index;  // dfbi = decreasing FIR Buffer Index
+            for(int fi=0; fi<FIR_HALF_SIZE; fi++) {  // fi = Filter Index
+                dfbi--;
+                if(dfbi < 0) dfbi = FIR_SIZE-1;
+                out_mono += 
+                    low_pass_fir[fi] * 
+                        (fir_buffer_mono[ifbi] + fir_buffer_mono[dfbi]);
+                if(channels > 1) {
+                    out_stereo += 
+                        low_pass_fir[fi] * 
+                            (fir_buffer_stereo[ifbi] + fir_buffer_stereo[dfbi]);
                 }
-                audio_index = 0;
-            } else {
-                audio_index += channels;
-                audio_len -= channels;
+                ifbi++;
+                if(ifbi >= FIR_SIZE) ifbi = 0;
             }
-        }
+            // End of FIR filter
 
-        
-        // First store the current sample(s) into the FIR filter's ring buffer
-        if(channels == 0) {
-            fir_buffer_mono[fir_index] = audio_buffer[audio_index];
-        } else {
-            // In stereo operation, generate sum and difference signals
-            fir_buffer_mono[fir_index] = 
-                audio_buffer[audio_index] + audio_buffer[audio_index+1];
-            fir_buffer_stereo[fir_index] = 
-                audio_buffer[audio_index] - audio_buffer[audio_index+1];
-        }
-        fir_index++;
-        if(fir_index >= FIR_SIZE) fir_index = 0;
-        
-        // Now apply the FIR low-pass filter
-        
-        /* As the FIR filter is symmetric, we do not multiply all 
-           the coefficients independently, but two-by-two, thus reducing
-           the total number of multiplications by a factor of two
-        */
-        float out_mono = 0;
-        float out_stereo = 0;
-        int ifbi = fir_index;  // ifbi = increasing FIR Buffer Index
-        int dfbi = fir_index;  // dfbi = decreasing FIR Buffer Index
-        for(int fi=0; fi<FIR_HALF_SIZE; fi++) {  // fi = Filter Index
-            dfbi--;
-            if(dfbi < 0) dfbi = FIR_SIZE-1;
-            out_mono += 
-                low_pass_fir[fi] * 
-                    (fir_buffer_mono[ifbi] + fir_buffer_mono[dfbi]);
-            if(channels > 1) {
-                out_stereo += 
-                    low_pass_fir[fi] * 
-                        (fir_buffer_stereo[ifbi] + fir_buffer_stereo[dfbi]);
+            if(fade_pos < fade_length) {
+                float gain = (float)fade_pos++ / fade_length;
+                out_mono *= gain;
+                out_stereo *= gain;
             }
-            ifbi++;
-            if(ifbi >= FIR_SIZE) ifbi = 0;
-        }
-        // End of FIR filter
-        
 
-        mpx_buffer[i] = 
-            mpx_buffer[i] +    // RDS data samples are currently in mpx_buffer
-            4.05*out_mono;     // Unmodulated monophonic (or stereo-sum) signal
-            
-        if(channels>1) {
-            mpx_buffer[i] +=
-                4.05 * carrier_38[phase_38] * out_stereo + // Stereo difference signal
-                .9*carrier_19[phase_19];                  // Stereo pilot tone
-
-            phase_19++;
-            phase_38++;
-            if(phase_19 >= 12) phase_19 = 0;
-            if(phase_38 >= 6) phase_38 = 0;
+            mpx_buffer[i] = 
+                mpx_buffer[i] +    // RDS data samples are currently in mpx_buffer
+                4.05*out_mono;     // Unmodulated monophonic (or stereo-sum) signal
+
+            if(channels>1) {
+                mpx_buffer[i] +=
+                    4.05 * carrier_38[i] * out_stereo; // Stereo difference signal
+            }
         }
-            
-        audio_pos++;   
-        
+    }
+
+    // The pilot never stops, even on the idle path
+    if(channels>1) {
+        for(int i=0; i<length; i++) mpx_buffer[i] += .9*carrier_19[i]; // Stereo pilot tone
     }
     
     return 0;
 }
 
 
+void fm_mpx_get_status(struct mpx_audio_status *status) {
+    *status = audio_status;
+}
+
 int fm_mpx_close() {
-    if(sf_close(inf) ) {
+    if(inf != NULL && sf_close(inf) ) {
         fprintf(stderr, "Error closing audio file");
     }
     
-    if(audio_buffer != NULL) free(audio_buffer);
-
-    // Terminate pulseaudio context
-    if (pa_mode)
+    inf = NULL;
+    free(audio_buffer);
+    audio_buffer = NULL;
+    free(carrier_19);
+    free(carrier_38);
+    free(carrier_57);
+    subcarrier_close();
+
+    // Stop the reader before its ring goes away
+    if (ring_input)
     {
-        pulse_unload();
-        close(modulefd);
+        if (pulse_input) pulse_capture_close();
+        else raw_input_close();
+        audio_ring_free(&input_ring);
     }
     
     return 0;
@@ -22,6 +22,27 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdint.h>
+#include <stddef.h>
+
+// States of the audio path
+#define MPX_AUDIO_PLAYING 0
+#define MPX_AUDIO_SILENT 1     // input below the silence level, idle path
+#define MPX_AUDIO_STARVED 2    // live input ran dry, idle path
+
+// What the multiplex generator is currently playing
+struct mpx_audio_status
+{
+    char source[64];
+    uint64_t frames;    // input frames read so far
+    uint32_t rate;
+    uint32_t channels;
+    float peak[2];      // peak levels of the last block read (0..1)
+    uint32_t state;     // MPX_AUDIO_*
+    uint32_t dropouts;  // times live input ran dry while playing
+};
+
 extern int fm_mpx_open(char *filename, int pulseaudio, size_t len);
 extern int fm_mpx_get_samples(float *mpx_buffer);
-extern int fm_mpx_close();
\ No newline at end of file
+extern int fm_mpx_close();
+extern void fm_mpx_get_status(struct mpx_audio_status *status);
\ No newline at end of file
@@ -0,0 +1,53 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    lowpass.c: the low-pass filter of the audio, shared by the generator
+    and the offline renderer.
+*/
+
+#include <stdio.h>
+#include <math.h>
+
+#include "lowpass.h"
+
+
+#define PI 3.141592654
+
+
+/*
+ * Computes the FIR_HALF_SIZE coefficients of the filter for audio at
+ * 'in_rate' upsampled to 'out_rate'. Returns the cutoff frequency.
+ */
+float lowpass_init(float *fir, int in_rate, int out_rate) {
+    float cutoff_freq = 15000 * .8;
+    if(in_rate/2 < cutoff_freq) cutoff_freq = in_rate/2 * .8;
+
+    fir[FIR_HALF_SIZE-1] = 2 * cutoff_freq / out_rate /2;
+    // Here we divide this coefficient by two because it will be counted twice
+    // when applying the filter
+
+    // Only store half of the filter since it is symmetric
+    for(int i=1; i<FIR_HALF_SIZE; i++) {
+        fir[FIR_HALF_SIZE-1-i] = 
+            sin(2 * PI * cutoff_freq * i / out_rate) / (PI * i)    // sinc
+            * (.54 - .46 * cos(2*PI * (i+FIR_HALF_SIZE) / (2*FIR_HALF_SIZE)));
+                                                          // Hamming window
+    }
+    return cutoff_freq;
+}
@@ -0,0 +1,157 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hand-off of the media player metadata from the D-Bus thread to the RDS
+   encoder.
+
+   The D-Bus thread publishes every change as a new record, by swapping it
+   into a one-record mailbox, and signals an eventfd. The control thread
+   wakes up on the eventfd and swaps the mailbox with NULL: from then on the
+   record is its own, and a record replaced in the mailbox before being
+   taken was never seen by the control thread. No record is ever shared, so
+   neither side needs a lock, and the encoder never polls for changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "mediainfo.h"
+#include "control_pipe.h"
+#include "rds.h"
+
+// RT length, and the room kept for the title when "Artist - Title" is too long
+#define RT_LENGTH 64
+#define TITLE_MIN 30
+
+static struct mediainfo *mailbox = NULL;
+static struct mediainfo *current = NULL; // owned by the control thread
+static uint32_t next_version = 1;        // used by the D-Bus thread only
+static int event_fd = -1;
+
+
+/*
+ * Publishes new metadata, from the D-Bus thread. Returns -1 on error.
+ */
+int publish_mediainfo(int state, const char *artist, const char *title, const char *album, int64_t length_us) {
+    struct mediainfo *info = calloc(1, sizeof(struct mediainfo));
+    if(info == NULL) return -1;
+
+    info->version = next_version++;
+    info->state = state;
+    snprintf(info->artist, MEDIAINFO_FIELD_SIZE, "%s", artist ? artist : "");
+    snprintf(info->title, MEDIAINFO_FIELD_SIZE, "%s", title ? title : "");
+    snprintf(info->album, MEDIAINFO_FIELD_SIZE, "%s", album ? album : "");
+    info->length_us = length_us;
+
+    free(__atomic_exchange_n(&mailbox, info, __ATOMIC_ACQ_REL));
+
+    uint64_t one = 1;
+    if(event_fd >= 0) write(event_fd, &one, sizeof(one));
+    return 0;
+}
+
+static int same_mediainfo(struct mediainfo *a, struct mediainfo *b) {
+    return a->state == b->state && a->length_us == b->length_us &&
+        strcmp(a->artist, b->artist) == 0 && strcmp(a->title, b->title) == 0 &&
+        strcmp(a->album, b->album) == 0;
+}
+
+/*
+ * Sends "Artist - Title" as RT, with RT+ tags on both parts. When it does
+ * not fit, the title is shortened first, down to TITLE_MIN characters.
+ */
+static void send_mediainfo(struct mediainfo *info) {
+    struct rds_transaction t;
+    char rt[RT_LENGTH + 1];
+    int artist_length = strlen(info->artist);
+    int title_length = strlen(info->title);
+
+    rds_begin(&t);
+    if(info->state == MEDIAINFO_PLAYING && artist_length > 0 && title_length > 0) {
+        if(artist_length + 3 + title_length > RT_LENGTH) {
+            int room = RT_LENGTH - 3 - artist_length;
+            int min = title_length < TITLE_MIN ? title_length : TITLE_MIN;
+            title_length = room > min ? room : min;
+            artist_length = RT_LENGTH - 3 - title_length;
+        }
+        snprintf(rt, sizeof(rt), "%.*s - %.*s", artist_length, info->artist, title_length, info->title);
+        rds_set(&t, RDS_CMD_RT, 0, rt);
+        rds_set(&t, RDS_CMD_RT_PLUS_TAGS,
+            RDS_RT_PLUS_TAGS(0, artist_length, artist_length + 3, title_length), NULL);
+    } else {
+        snprintf(rt, sizeof(rt), "%s", info->state == MEDIAINFO_NONE ? "NO MEDIA" : "NO METADATA");
+        rds_set(&t, RDS_CMD_RT, 0, rt);
+    }
+    submit_rds_commands(t.cmds, t.count);
+
+    if(info->length_us > 0)
+        printf("Mediainfo changed (%u): %s [%s, %d:%02d]\n", info->version, rt, info->album,
+            (int)(info->length_us / 60000000), (int)(info->length_us / 1000000 % 60));
+    else
+        printf("Mediainfo changed (%u): %s\n", info->version, rt);
+}
+
+/*
+ * Takes the last published record, on the control thread.
+ */
+static void take_mediainfo(int fd, uint32_t events, void *ctx) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+
+    struct mediainfo *info = __atomic_exchange_n(&mailbox, NULL, __ATOMIC_ACQ_REL);
+    if(info == NULL) return;
+
+    // Players repeat their metadata along with other properties
+    if(current && same_mediainfo(current, info)) {
+        free(info);
+        return;
+    }
+    free(current);
+    current = info;
+    send_mediainfo(info);
+}
+
+/*
+ * To be called before the D-Bus thread starts. Returns -1 on error.
+ */
+int open_mediainfo() {
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(event_fd < 0) return -1;
+
+    if(start_control_thread() < 0) return -1;
+    if(control_watch_fd(event_fd, take_mediainfo, NULL) < 0) return -1;
+
+    return 0;
+}
+
+/*
+ * To be called once the D-Bus and control threads have been stopped.
+ */
+void close_mediainfo() {
+    if(event_fd >= 0) close(event_fd);
+    event_fd = -1;
+
+    free(mailbox);
+    free(current);
+    mailbox = current = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEDIAINFO_H
+#define MEDIAINFO_H
+
+#include <stdint.h>
+
+#define MEDIAINFO_NONE          0 // no player is playing
+#define MEDIAINFO_NO_METADATA   1 // a player is playing, without artist or title
+#define MEDIAINFO_PLAYING       2
+
+#define MEDIAINFO_FIELD_SIZE 128
+
+/* A record is never changed once published: the D-Bus thread makes a new
+   one for every change, and hands it over to the control thread.
+ */
+struct mediainfo
+{
+    uint32_t version;
+    int state;
+    char artist[MEDIAINFO_FIELD_SIZE];
+    char title[MEDIAINFO_FIELD_SIZE];
+    char album[MEDIAINFO_FIELD_SIZE];
+    int64_t length_us;  // track length, 0 if unknown
+};
+
+extern int open_mediainfo();
+extern void close_mediainfo();
+extern int publish_mediainfo(int state, const char *artist, const char *title, const char *album, int64_t length_us);
+
+#endif /* MEDIAINFO_H */
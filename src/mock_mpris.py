@@ -0,0 +1,126 @@
+#!/usr/bin/python3
+
+
+#   PiFmRds - FM/RDS transmitter for the Raspberry Pi
+#   Copyright (C) 2021 Jan Němec
+#
+#   See https://github.com/ChristopheJacquet/PiFmRds
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#   This program is a mock MPRIS media player, to test -dbus without a real
+#   player. It registers org.mpris.MediaPlayer2.<name> (default: mock) on
+#   the session bus and reads commands on its standard input:
+#
+#       play Artist - Title [/ Album [/ seconds]]
+#       pause
+#       stop
+#       quit
+#
+#   Each command changes the PlaybackStatus and Metadata properties and
+#   emits PropertiesChanged, like a real player. It requires PyGObject
+#   (python3-gi).
+
+
+import sys
+from gi.repository import Gio, GLib
+
+PATH = '/org/mpris/MediaPlayer2'
+PLAYER = 'org.mpris.MediaPlayer2.Player'
+NAME = 'org.mpris.MediaPlayer2.' + (sys.argv[1] if len(sys.argv) > 1 else 'mock')
+
+INTERFACES = Gio.DBusNodeInfo.new_for_xml('''
+<node>
+  <interface name="org.mpris.MediaPlayer2">
+    <property name="Identity" type="s" access="read"/>
+  </interface>
+  <interface name="org.mpris.MediaPlayer2.Player">
+    <property name="PlaybackStatus" type="s" access="read"/>
+    <property name="Metadata" type="a{sv}" access="read"/>
+  </interface>
+</node>''').interfaces
+
+state = {
+    'PlaybackStatus': GLib.Variant('s', 'Stopped'),
+    'Metadata': GLib.Variant('a{sv}', {}),
+}
+connection = None
+track = 0
+
+
+def get_property(conn, sender, path, interface, name):
+    if interface == PLAYER:
+        return state[name]
+    return GLib.Variant('s', 'Mock player')
+
+
+def set_state(status, metadata=None):
+    state['PlaybackStatus'] = GLib.Variant('s', status)
+    changed = {'PlaybackStatus': state['PlaybackStatus']}
+    if metadata is not None:
+        state['Metadata'] = GLib.Variant('a{sv}', metadata)
+        changed['Metadata'] = state['Metadata']
+    connection.emit_signal(None, PATH, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                           GLib.Variant('(sa{sv}as)', (PLAYER, changed, [])))
+
+
+def play(args):
+    global track
+    fields = [f.strip() for f in args.split('/')]
+    artist, _, title = fields[0].partition(' - ')
+    track += 1
+    metadata = {'mpris:trackid': GLib.Variant('o', '/org/mpris/MediaPlayer2/Track/%d' % track)}
+    if artist and title:
+        metadata['xesam:artist'] = GLib.Variant('as', [artist])
+        metadata['xesam:title'] = GLib.Variant('s', title)
+    if len(fields) > 1:
+        metadata['xesam:album'] = GLib.Variant('s', fields[1])
+    if len(fields) > 2:
+        metadata['mpris:length'] = GLib.Variant('x', int(float(fields[2]) * 1000000))
+    set_state('Playing', metadata)
+
+
+def on_input(channel, condition):
+    line = sys.stdin.readline()
+    if not line:
+        loop.quit()
+        return False
+    command, _, args = line.strip().partition(' ')
+    if command == 'play':
+        play(args)
+    elif command == 'pause':
+        set_state('Paused')
+    elif command == 'stop':
+        set_state('Stopped', {})
+    elif command == 'quit':
+        loop.quit()
+        return False
+    else:
+        print('Unknown command: %s' % command, file=sys.stderr)
+    return True
+
+
+def on_bus_acquired(conn, name):
+    global connection
+    connection = conn
+    for interface in INTERFACES:
+        conn.register_object(PATH, interface, None, get_property, None)
+
+
+Gio.bus_own_name(Gio.BusType.SESSION, NAME, Gio.BusNameOwnerFlags.NONE,
+                 on_bus_acquired, None, None)
+GLib.io_add_watch(GLib.IOChannel.unix_new(sys.stdin.fileno()), GLib.PRIORITY_DEFAULT,
+                  GLib.IO_IN | GLib.IO_HUP, on_input)
+loop = GLib.MainLoop()
+loop.run()
@@ -0,0 +1,198 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    mpx_sink.c: writes the multiplex to a file, a pipe or standard output.
+*/
+
+/* Instead of the GPIO, the multiplex can go to a file, to standard output,
+   or to a named pipe feeding an exciter that takes composite MPX. Each
+   block of the generator is converted into one buffer and written with a
+   single write() call. The output is either paced on the monotonic clock,
+   at the sample rate, or written as fast as the reader takes it.
+   The IQ formats carry the FM modulated carrier instead, at the rate
+   given to fm_iq_open() (see fm_iq.c), for SDR playback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include "mpx_sink.h"
+#include "fm_iq.h"
+
+static int sink_fd = -1;
+static int sink_fmt;
+static int sink_realtime;
+static int sink_rate;
+static void *sink_buffer = NULL;
+static int sink_buffer_size = 0;
+static struct timespec deadline;
+
+
+/*
+ * Returns the code of a format given by name (f32 or s16), or -1 if
+ * unknown.
+ */
+int sink_format(char *name) {
+    if(strcmp(name, "f32") == 0) return SINK_F32;
+    if(strcmp(name, "s16") == 0) return SINK_S16;
+    if(strcmp(name, "cs8") == 0) return SINK_CS8;
+    if(strcmp(name, "cs16") == 0) return SINK_CS16;
+    if(strcmp(name, "cf32") == 0) return SINK_CF32;
+    return -1;
+}
+
+/*
+ * Opens the output: "-" for standard output, else a file (created or
+ * truncated) or a named pipe. Returns -1 on error.
+ */
+int mpx_sink_open(char *path, int format, int realtime, int rate) {
+    if(strcmp(path, "-") == 0) {
+        // The messages of the program go to standard error from now on,
+        // so that they do not end up in the stream
+        fflush(stdout);
+        sink_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        sink_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if(sink_fd < 0) {
+        fprintf(stderr, "Error: could not open output %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    sink_fmt = format;
+    sink_realtime = realtime;
+    sink_rate = rate;
+    mpx_sink_start();
+    return 0;
+}
+
+/*
+ * Starts the real-time pacing from now. To be called once the generator is
+ * ready, so that the time it took to open does not make the first blocks
+ * late.
+ */
+void mpx_sink_start() {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+}
+
+static int write_all(const void *data, size_t size) {
+    const char *p = data;
+    while(size > 0) {
+        ssize_t n = write(sink_fd, p, size);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) {
+            fprintf(stderr, "Error writing the output: %s.\n", strerror(errno));
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Waits until the samples written so far are due, on the monotonic clock */
+static void pace(int count) {
+    deadline.tv_nsec += (long)((double)count * 1e9 / sink_rate);
+    while(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        deadline.tv_sec++;
+    }
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+static int reserve(int size) {
+    if(size > sink_buffer_size) {
+        free(sink_buffer);
+        sink_buffer = malloc(size);
+        if(sink_buffer == NULL) return -1;
+        sink_buffer_size = size;
+    }
+    return 0;
+}
+
+/* Modulates the samples into the buffer, returns its size in bytes */
+static int modulate(const float *samples, int count) {
+    if(reserve(fm_iq_max_output(count) * 2 * sizeof(float)) < 0) return -1;
+
+    float *iq = sink_buffer;
+    int n = 2 * fm_iq_modulate(samples, count, iq);
+    if(n < 0) return -1;
+
+    // Narrower formats are converted in place, from the start
+    if(sink_fmt == SINK_CS8) {
+        int8_t *out = sink_buffer;
+        for(int i=0; i<n; i++) out[i] = (int8_t)lrintf(iq[i] * 127);
+        return n;
+    }
+    if(sink_fmt == SINK_CS16) {
+        int16_t *out = sink_buffer;
+        for(int i=0; i<n; i++) out[i] = (int16_t)lrintf(iq[i] * 32767);
+        return n * sizeof(int16_t);
+    }
+    return n * sizeof(float);
+}
+
+/*
+ * Writes 'count' samples of the generator (10 being full scale). Returns -1
+ * on error.
+ */
+int mpx_sink_write(const float *samples, int count) {
+    int size;
+
+    if(SINK_IQ(sink_fmt)) {
+        size = modulate(samples, count);
+        if(size < 0) return -1;
+    } else if(sink_fmt == SINK_S16) {
+        size = count * sizeof(int16_t);
+        if(reserve(size) < 0) return -1;
+        int16_t *out = sink_buffer;
+        for(int i=0; i<count; i++) {
+            float v = samples[i] * (32767 / 10.f);
+            if(v > 32767) v = 32767;
+            if(v < -32767) v = -32767;
+            out[i] = (int16_t)v;
+        }
+    } else {
+        size = count * sizeof(float);
+        if(reserve(size) < 0) return -1;
+        float *out = sink_buffer;
+        for(int i=0; i<count; i++) out[i] = samples[i] / 10;
+    }
+
+    if(write_all(sink_buffer, size) < 0) return -1;
+    if(sink_realtime) pace(count);
+    return 0;
+}
+
+void mpx_sink_close() {
+    if(sink_fd >= 0) close(sink_fd);
+    sink_fd = -1;
+    free(sink_buffer);
+    sink_buffer = NULL;
+    sink_buffer_size = 0;
+    if(SINK_IQ(sink_fmt)) fm_iq_close();
+}
@@ -0,0 +1,39 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MPX_SINK_H
+#define MPX_SINK_H
+
+// Sample formats of the output
+#define SINK_F32    1   // MPX, float32 little-endian
+#define SINK_S16    2   // MPX, signed 16 bits little-endian
+#define SINK_CS8    3   // FM modulated IQ, signed 8 bits
+#define SINK_CS16   4   // FM modulated IQ, signed 16 bits little-endian
+#define SINK_CF32   5   // FM modulated IQ, float32 little-endian
+
+#define SINK_IQ(format) ((format) >= SINK_CS8)
+
+extern int sink_format(char *name);
+extern int mpx_sink_open(char *path, int format, int realtime, int rate);
+extern void mpx_sink_start();
+extern int mpx_sink_write(const float *samples, int count);
+extern void mpx_sink_close();
+
+#endif /* MPX_SINK_H */
@@ -0,0 +1,108 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    noise_shaper.c: quantises the multiplex signal to integer steps of the
+    frequency control word, with optional sigma-delta noise shaping.
+*/
+
+#include <math.h>
+
+#include "noise_shaper.h"
+
+/* The DMA engine can only play integer offsets of the frequency control
+   word, so every multiplex sample is rounded to a whole step. Order 0 simply
+   truncates, as the modulator always did, and the quantisation noise is
+   spread evenly over the whole 0-114 kHz band.
+
+   Order 1 and 2 feed the rounding error back into the next samples, so that
+   the noise transfer function is (1 - z^-1) or (1 - z^-1)^2. The noise then
+   moves from the audio band to the top of the spectrum, above the stereo
+   subcarrier. The total noise power goes up, but it is mostly out of the
+   band receivers listen to. No extra control blocks are needed: each sample
+   is still a single word.
+ */
+
+#define SHAPER_BLOCK 1024
+
+static int shaper_order = 0;
+static float err1 = 0; // rounding error of the previous sample
+static float err2 = 0; // and of the one before
+
+void noise_shaper_init(int order) {
+    if(order < 0) order = 0;
+    if(order > NOISE_SHAPER_MAX_ORDER) order = NOISE_SHAPER_MAX_ORDER;
+    shaper_order = order;
+    err1 = err2 = 0;
+}
+
+/* Converts 'count' multiplex samples to frequency control word offsets.
+   The samples are first scaled in a separate pass (which the compiler can
+   vectorise), the feedback loop itself is inherently sequential.
+ */
+void noise_shape(float *in, int32_t *out, float scale, int count) {
+    float scaled[SHAPER_BLOCK];
+
+    while(count > 0) {
+        int n = count < SHAPER_BLOCK ? count : SHAPER_BLOCK;
+
+        for(int i=0; i<n; i++) {
+            scaled[i] = in[i] * scale;
+        }
+
+        switch(shaper_order) {
+            case 0:
+                for(int i=0; i<n; i++) {
+                    out[i] = (int32_t) floorf(scaled[i]);
+                }
+                break;
+            case 1:
+                for(int i=0; i<n; i++) {
+                    float v = scaled[i] - err1;
+                    float q = floorf(v + .5f);
+                    err1 = q - v;
+                    out[i] = (int32_t) q;
+                }
+                break;
+            case 2:
+                for(int i=0; i<n; i++) {
+                    float v = scaled[i] - 2*err1 + err2;
+                    float q = floorf(v + .5f);
+                    err2 = err1;
+                    err1 = q - v;
+                    out[i] = (int32_t) q;
+                }
+                break;
+        }
+
+        in += n;
+        out += n;
+        count -= n;
+    }
+}
+
+/* Converts 'count' multiplex samples into the words the DMA engine writes
+   to the clock divider: the noise shaped offsets added to 'base', the word
+   of the carrier (with the clock manager password).
+ */
+void noise_shape_words(float *in, uint32_t *words, uint32_t base, float scale, int count) {
+    noise_shape(in, (int32_t *)words, scale, count);
+    for(int i=0; i<count; i++) {
+        words[i] += base;
+    }
+}
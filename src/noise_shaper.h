@@ -0,0 +1,32 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NOISE_SHAPER_H
+#define NOISE_SHAPER_H
+
+#include <stdint.h>
+
+#define NOISE_SHAPER_MAX_ORDER 2
+
+extern void noise_shaper_init(int order);
+extern void noise_shape(float *in, int32_t *out, float scale, int count);
+extern void noise_shape_words(float *in, uint32_t *words, uint32_t base, float scale, int count);
+
+#endif /* NOISE_SHAPER_H */
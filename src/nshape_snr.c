@@ -0,0 +1,133 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+    
+    nshape_snr.c is a test program that measures the audio-band SNR of the
+    frequency control words produced by the noise shaper, for every order.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "noise_shaper.h"
+
+
+#define PI 3.141592654
+#define SAMPLE_RATE 228000
+#define BLOCK 5000
+#define LENGTH (BLOCK * 90)
+#define FIR_HALF_SIZE 128
+// Arbitrary carrier word, as in pi_fm_rds.c: the offsets are added to it
+#define BASE_WORD (0x5A << 24 | 20000)
+
+
+/* Windowed-sinc low-pass filter, cutoff in Hz */
+static void make_low_pass(float *fir, float cutoff) {
+    for(int i=-FIR_HALF_SIZE; i<=FIR_HALF_SIZE; i++) {
+        float x = i == 0 ? 2 * cutoff / SAMPLE_RATE :
+            sin(2 * PI * cutoff * i / SAMPLE_RATE) / (PI * i);
+        fir[i+FIR_HALF_SIZE] = x * (.54 + .46 * cos(PI * i / FIR_HALF_SIZE));
+    }
+}
+
+/* Power of the signal after low-pass filtering */
+static double filtered_power(float *signal, float *fir) {
+    double power = 0;
+    int n = 0;
+    for(int i=2*FIR_HALF_SIZE; i<LENGTH; i++) {
+        double acc = 0;
+        for(int j=0; j<=2*FIR_HALF_SIZE; j++) {
+            acc += fir[j] * signal[i-j];
+        }
+        power += acc * acc;
+        n++;
+    }
+    return power / n;
+}
+
+static double power(float *signal) {
+    double p = 0;
+    for(int i=0; i<LENGTH; i++) p += signal[i] * signal[i];
+    return p / LENGTH;
+}
+
+/* Simple test program */
+int main(int argc, char **argv) {
+    // Tone amplitude, in frequency control word steps
+    float amplitude = argc > 1 ? atof(argv[1]) : 2;
+
+    float *mpx = malloc(LENGTH * sizeof(float));
+    float *error = malloc(LENGTH * sizeof(float));
+    uint32_t *words = malloc(LENGTH * sizeof(uint32_t));
+    int32_t deviation[BLOCK];
+    float lp15[2*FIR_HALF_SIZE+1], lp53[2*FIR_HALF_SIZE+1];
+
+    make_low_pass(lp15, 15000);
+    make_low_pass(lp53, 53000);
+
+    // 1 kHz tone plus a small 57 kHz component standing for RDS
+    for(int i=0; i<LENGTH; i++) {
+        mpx[i] = amplitude * sin(2 * PI * 1000 * i / SAMPLE_RATE) +
+            .1 * sin(2 * PI * 57000 * i / SAMPLE_RATE);
+    }
+
+    printf("1 kHz tone, %.2f steps peak\n\n", amplitude);
+    printf("order   SNR 0-15k   noise 0-15k   15-53k   53-114k (dB rel. 1 step^2)\n");
+
+    double signal_power = amplitude * amplitude / 2;
+    double baseline = 0;
+
+    for(int order=0; order<=NOISE_SHAPER_MAX_ORDER; order++) {
+        noise_shaper_init(order);
+
+        // Generate the word stream exactly as the DMA loop does
+        for(int i=0; i<LENGTH; i+=BLOCK) {
+            noise_shape(mpx+i, deviation, 1, BLOCK);
+            for(int j=0; j<BLOCK; j++) {
+                words[i+j] = BASE_WORD + deviation[j];
+            }
+        }
+
+        // Quantisation error recovered from the words
+        double mean = 0;
+        for(int i=0; i<LENGTH; i++) {
+            error[i] = (int32_t)(words[i] - BASE_WORD) - mpx[i];
+            mean += error[i];
+        }
+        mean /= LENGTH;
+        for(int i=0; i<LENGTH; i++) error[i] -= mean;
+
+        double n15 = filtered_power(error, lp15);
+        double n53 = filtered_power(error, lp53);
+        double total = power(error);
+        double snr = 10 * log10(signal_power / n15);
+        if(order == 0) baseline = snr;
+
+        printf("%5d   %6.1f dB     %8.1f    %6.1f    %6.1f     (%+.1f dB)\n", order, snr,
+            10 * log10(n15), 10 * log10(n53 - n15), 10 * log10(total - n53), snr - baseline);
+    }
+
+    free(mpx);
+    free(error);
+    free(words);
+
+    return EXIT_SUCCESS;
+}
@@ -16,6 +16,7 @@
  *
  * I (Christophe Jacquet) have adapted their idea to transmitting samples
  * at 228 kHz, allowing to build the 57 kHz subcarrier for RDS BPSK data.
+ * (The rate can now be chosen with -mpxrate.)
  *
  * To make it work on the Raspberry Pi 2, I used a fix by Richard Hirst
  * (again) to request memory using Broadcom's mailbox interface. This fix
@@ -111,6 +112,19 @@
 #include "fm_mpx.h"
 #include "control_pipe.h"
 #include "dbus_mediainfo.h"
+#include "ppm_cal.h"
+#include "noise_shaper.h"
+#include "telemetry.h"
+#include "status_shm.h"
+#include "ctl_socket.h"
+#include "uecp.h"
+#include "timer_wheel.h"
+#include "rds_tasks.h"
+#include "mediainfo.h"
+#include "pulse_module.h"
+#include "raw_input.h"
+#include "mpx_sink.h"
+#include "fm_iq.h"
 
 #include "mailbox.h"
 #define MBFILE            DEVICE_FILE_NAME    /* From mailbox.h */
@@ -137,8 +151,9 @@
 #error Unknown Raspberry Pi version (variable RASPI)
 #endif
 
-#define NUM_SAMPLES        50000
-#define NUM_CBS            (NUM_SAMPLES * 2)
+#define NUM_SAMPLES        50000 // at 228 kHz, scaled for other rates
+#define CBS_PER_SAMPLE     2
+#define NUM_CBS            (num_samples * CBS_PER_SAMPLE)
 
 #define BCM2708_DMA_NO_WIDE_BURSTS    (1<<26)
 #define BCM2708_DMA_WAIT_RESP        (1<<3)
@@ -207,6 +222,11 @@ typedef struct {
          stride, next, pad[2];
 } dma_cb_t;
 
+// The sample words follow the control blocks, one per sample. The padding
+// words of the control blocks are reserved (to be zero) in the datasheet,
+// so they are not used to hold them.
+#define CB_SAMPLE(i)      (ctl_samples[i])
+
 #define BUS_TO_PHYS(x) ((x)&~0xC0000000)
 
 
@@ -224,16 +244,22 @@ static volatile uint32_t *clk_reg;
 static volatile uint32_t *dma_reg;
 static volatile uint32_t *gpio_reg;
 
+// One (sample, delay) pair of control blocks per sample. The delay block is
+// the same for every sample, but it cannot be shared: its 'next' pointer has
+// to lead to the following sample block. See "DMA memory layout" in README.
 struct control_data_s {
-    dma_cb_t cb[NUM_CBS];
-    uint32_t sample[NUM_SAMPLES];
+    dma_cb_t cb[0];
 };
 
+// Length of the DMA ring in samples, settable with -ring
+static int num_samples = NUM_SAMPLES;
+
 #define PAGE_SIZE    4096
 #define PAGE_SHIFT    12
-#define NUM_PAGES    ((sizeof(struct control_data_s) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+#define NUM_PAGES    ((NUM_CBS * sizeof(dma_cb_t) + num_samples * sizeof(uint32_t) + PAGE_SIZE - 1) >> PAGE_SHIFT)
 
 static struct control_data_s *ctl;
+static uint32_t *ctl_samples;
 
 pthread_t dbus_thread_id;
 
@@ -266,7 +292,15 @@ terminate(int num)
     }
     
     fm_mpx_close();
+    mpx_sink_close();
     close_control_pipe();
+    close_timer_wheel();
+    close_mediainfo();
+    close_control_socket();
+    close_uecp_server();
+    save_ppm();
+    telemetry_print(stdout);
+    close_status_shm();
 
     if (mbox.virt_addr != NULL) {
         unmapmem(mbox.virt_addr, NUM_PAGES * 4096);
@@ -298,7 +332,14 @@ show_help(char *arg)
 
     fatal("Syntax: pi_fm_rds [-freq freq] [-audio file] [-ppm ppm_error] [-pi pi_code]\n"
           "                  [-ps ps_text] [-rt rt_text] [-pty pty] [-ctl control_pipe]\n"
-          "                  [-rdsh history_file] [-pulse] [-dbus] [-af freqs]\n");
+          "                  [-rdsh history_file] [-pulse] [-dbus] [-af freqs]\n"
+          "                  [-ppmcal ppm_file] [-ring ms] [-nshape order] [-shm name]\n"
+          "                  [-sock control_socket] [-uecp port|path|pty]\n"
+          "                  [-psseq frames] [-psscroll text] [-rtseq frames]\n"
+          "                  [-dbusprio players] [-pulserate rate] [-pulselatency ms]\n"
+          "                  [-rawfmt s16le|s24le|f32le] [-rate rate] [-channels count]\n"
+          "                  [-mpxrate rate] [-output file|-] [-outfmt f32|s16|cs8|cs16|cf32]\n"
+          "                  [-outfast] [-iqrate rate] [-iqdev deviation]\n");
 }
 
 static uint32_t
@@ -336,10 +377,64 @@ map_peripheral(uint32_t base, uint32_t len)
 #define SUBSIZE 1
 #define DATA_SIZE 5000
 
+// Number of samples ahead of the DMA read position where a retune takes
+// effect. It must cover the time needed to rebase the queued samples.
+#define RETUNE_GUARD 1000
 
-int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_s rds_data, float ppm, char *control_pipe) {
-    // Catch all signals possible - it is vital we kill the DMA engine
-    // on process exit!
+
+// Calculate the frequency control word
+// The fractional part is stored in the lower 12 bits
+static uint32_t
+freq_to_ctl(uint32_t carrier_freq)
+{
+    return ((float)(PLLFREQ / carrier_freq)) * ( 1 << 12 );
+}
+
+// PWM clock divider (integer part << 12 | 12-bit fraction) giving the
+// multiplex sample rate for an oscillator off by 'ppm'
+static uint32_t
+pwm_divider(float ppm)
+{
+    // The PWM range is 2 bits, two clock cycles per sample
+    float divider = (PLLFREQ/(2.*get_rds_sample_rate()*(1.+ppm/1.e6)));
+    uint32_t idivider = (uint32_t) divider;
+    uint32_t fdivider = (uint32_t) ((divider - idivider)*pow(2, 12));
+
+    return (idivider<<12) | fdivider;
+}
+
+/* Moves the carrier to another frequency while the DMA engine keeps running.
+   The samples already queued between the DMA read position (plus a guard)
+   and the writer position are rebased to the new frequency, so the switch
+   reaches the air within a few milliseconds and the audio is not interrupted.
+   'written' is the position on the output timeline of the writer. Returns
+   the position of the first sample played at the new frequency.
+ */
+static uint64_t
+retune(uint32_t old_freq_ctl, uint32_t new_freq_ctl, int last_sample, uint64_t written)
+{
+    uint32_t cur_cb = mem_phys_to_virt(dma_reg[DMA_CONBLK_AD]);
+    int this_sample = (cur_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * CBS_PER_SAMPLE);
+    int queued = last_sample - this_sample;
+
+    if (queued < 0)
+        queued += num_samples;
+
+    int i = (this_sample + RETUNE_GUARD) % num_samples;
+    for (int n = RETUNE_GUARD; n < queued; n++) {
+        CB_SAMPLE(i) += new_freq_ctl - old_freq_ctl;
+        if (++i == num_samples)
+            i = 0;
+    }
+
+    // With less than the guard queued, the change starts with the next sample written
+    return written - queued + (queued < RETUNE_GUARD ? queued : RETUNE_GUARD);
+}
+
+
+static void
+catch_signals()
+{
     for (int i = 0; i < 64; i++) {
         struct sigaction sa;
 
@@ -347,7 +442,131 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
         sa.sa_handler = terminate;
         sigaction(i, &sa, NULL);
     }
+}
+
+/* Starts the baseband generator, the RDS encoder and the control interfaces,
+   which are the same whatever the output. 'buffered' is the number of
+   samples the output plays before the first generated one. Returns -1 if
+   the generator could not start, else 1 if a control interface is open.
+ */
+static int
+start_generator(char *audio_file, int pulseaudio, struct rds_data_s *rds_data, char *control_pipe, char *control_socket, char *uecp, char *status_name, int buffered) {
+    // Initialize the baseband generator
+    if(fm_mpx_open(audio_file, pulseaudio, DATA_SIZE) < 0) return -1;
+
+    // Look at previous RDS history
+    // int history_reused = reuse_rds_history(rds_data->dbus_mediainfo);
+    
+    // Initialize the RDS modulator
+    // if(history_reused == 0) {
+    //     set_rds_pi(rds_data->pi);
+    //     set_rds_rt(rds_data->rt);
+    //     set_rds_pty(rds_data->pty);
+
+    //     printf("Adding specified alternative frequencies.\n");
+    //     for (int i = 0; i < rds_data->af_count; i++)
+    //     {
+    //         add_rds_af(rds_data->af_pool[i]);
+    //     }
+    // }
+    // int varying_ps = 0;
+
+    manage_rds_startparams(rds_data);
+    // if(!history_reused) {
+    //     if(rds_data->ps) {
+    //         disable_varying_ps();
+    //         set_rds_ps(rds_data->ps);
+    //     } else {
+    //         rds_data->ps = "<Varying>";
+    //         varying_ps = 1;
+    //     }
+    //     printf("PI: %04X, PS: \"%s\", PTY: %d.\nRT: \"%s\"\n", rds_data->pi, rds_data->ps, rds_data->pty, rds_data->rt);
+    // } else
+    // {
+    //     printf("RDS parameters set from history. All explicit RDS parameters ignored.\n");
+    //     if (history_reused == 2)
+    //     {
+    //         varying_ps = 1;
+    //     }
+    // }
         
+
+    // Initialize the control pipe reader
+    if(control_pipe) {
+        if(open_control_pipe(control_pipe, rds_data->dbus_mediainfo) == 0) {
+            printf("Reading control commands on %s.\n", control_pipe);
+        } else {
+            printf("Failed to open control pipe: %s.\n", control_pipe);
+            control_pipe = NULL;
+        }
+    }
+
+    // Initialize dbus_mediainfo
+    if(rds_data->dbus_mediainfo)
+    {
+        // disable_varying_ps();
+        // rds_data->ps_var = 0;
+        if(open_mediainfo() == 0) {
+            pthread_create(&dbus_thread_id, NULL, dbus_main, NULL);
+        } else {
+            printf("Failed to start the mediainfo reader.\n");
+        }
+    }    
+    
+    telemetry_init(buffered, get_rds_sample_rate());
+
+    // The output plays 'buffered' samples before the first generated one:
+    // that is where it lies on the output timeline
+    set_rds_sample_offset(buffered);
+
+    // Initialize the status page. Without -shm, it stays private to the
+    // process, where the control interfaces use it
+    if(status_name) {
+        if(open_status_shm(status_name) == 0) {
+            printf("Publishing status in shared memory %s.\n", status_name);
+        } else {
+            printf("Failed to create shared memory status %s.\n", status_name);
+        }
+    }
+    if(open_status_shm(NULL) < 0) {
+        printf("Failed to create the status page.\n");
+    }
+
+    // Initialize the control socket, which answers queries from the status page
+    if(control_socket) {
+        if(open_control_socket(control_socket, rds_data->dbus_mediainfo) == 0) {
+            printf("Accepting control connections on %s.\n", control_socket);
+        } else {
+            printf("Failed to open control socket: %s.\n", control_socket);
+            control_socket = NULL;
+        }
+    }
+
+    // Initialize the UECP server
+    if(uecp) {
+        if(open_uecp_server(uecp, rds_data->dbus_mediainfo) == 0) {
+            printf("Accepting UECP frames on %s.\n", uecp);
+        } else {
+            printf("Failed to open UECP server: %s.\n", uecp);
+            uecp = NULL;
+        }
+    }
+
+    // PS and RT sequences run on the control thread, from the first
+    // generated sample
+    if(rds_data->ps_var) set_varying_ps();
+    if(start_rds_tasks(buffered, rds_data->dbus_mediainfo) < 0) {
+        printf("Failed to start the RDS tasks.\n");
+    }
+
+    return control_pipe || control_socket || uecp;
+}
+
+int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_s rds_data, float ppm, char *ppm_file, char *control_pipe, char *control_socket, char *uecp, char *status_name) {
+    // Catch all signals possible - it is vital we kill the DMA engine
+    // on process exit!
+    catch_signals();
+
     dma_reg = map_peripheral(DMA_VIRT_BASE, DMA_LEN);
     pwm_reg = map_peripheral(PWM_VIRT_BASE, PWM_LEN);
     clk_reg = map_peripheral(CLK_VIRT_BASE, CLK_LEN);
@@ -357,7 +576,7 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
     mbox.handle = mbox_open();
     if (mbox.handle < 0)
         fatal("Failed to open mailbox. Check kernel support for vcio / BCM2708 mailbox.\n");
-    printf("Allocating physical memory: size = %d     ", NUM_PAGES * 4096);
+    printf("Allocating physical memory: size = %d     ", (int)(NUM_PAGES * 4096));
     if(! (mbox.mem_ref = mem_alloc(mbox.handle, NUM_PAGES * 4096, 4096, MEM_FLAG))) {
         fatal("Could not allocate memory.\n");
     }
@@ -371,6 +590,8 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
         fatal("Could not map memory.\n");
     }
     printf("virt_addr = %p\n", mbox.virt_addr);
+    printf("DMA ring: %d samples (%.1f ms), %d bytes per sample.\n",
+                num_samples, num_samples * 1000. / get_rds_sample_rate(), (int)(CBS_PER_SAMPLE * sizeof(dma_cb_t) + sizeof(uint32_t)));
     
 
     // GPIO4 needs to be ALT FUNC 0 to output the clock
@@ -382,25 +603,25 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
     clk_reg[GPCLK_CNTL] = 0x5A << 24 | 1 << 9 | 1 << 4 | 6;
 
     ctl = (struct control_data_s *) mbox.virt_addr;
+    ctl_samples = (uint32_t *)(ctl->cb + NUM_CBS);
     dma_cb_t *cbp = ctl->cb;
     uint32_t phys_sample_dst = CM_GP0DIV;
     uint32_t phys_pwm_fifo_addr = PWM_PHYS_BASE + 0x18;
 
 
-    // Calculate the frequency control word
-    // The fractional part is stored in the lower 12 bits
-    uint32_t freq_ctl = ((float)(PLLFREQ / carrier_freq)) * ( 1 << 12 );
+    uint32_t freq_ctl = freq_to_ctl(carrier_freq);
 
 
-    for (int i = 0; i < NUM_SAMPLES; i++) {
-        ctl->sample[i] = 0x5a << 24 | freq_ctl;    // Silence
+    for (int i = 0; i < num_samples; i++) {
         // Write a frequency sample
+        CB_SAMPLE(i) = 0x5a << 24 | freq_ctl;    // Silence
         cbp->info = BCM2708_DMA_NO_WIDE_BURSTS | BCM2708_DMA_WAIT_RESP;
-        cbp->src = mem_virt_to_phys(ctl->sample + i);
+        cbp->src = mem_virt_to_phys(&CB_SAMPLE(i));
         cbp->dst = phys_sample_dst;
         cbp->length = 4;
         cbp->stride = 0;
         cbp->next = mem_virt_to_phys(cbp + 1);
+        cbp->pad[0] = cbp->pad[1] = 0;
         cbp++;
         // Delay
         cbp->info = BCM2708_DMA_NO_WIDE_BURSTS | BCM2708_DMA_WAIT_RESP | BCM2708_DMA_D_DREQ | BCM2708_DMA_PER_MAP(5);
@@ -409,6 +630,7 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
         cbp->length = 4;
         cbp->stride = 0;
         cbp->next = mem_virt_to_phys(cbp + 1);
+        cbp->pad[0] = cbp->pad[1] = 0;
         cbp++;
     }
     cbp--;
@@ -418,7 +640,8 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
     // register.
     //
     // Set the range to 2 bits. PLLD is at 500 MHz, therefore to get 228 kHz
-    // we need a divisor of 500000000 / 2000 / 228 = 1096.491228
+    // (the default sample rate, see -mpxrate) we need a divisor of
+    // 500000000 / 2000 / 228 = 1096.491228
     //
     // This is 1096 + 2012*2^-12 theoretically
     //
@@ -427,14 +650,21 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
     // the fractional part should be 1916 instead of 2012 to get exactly 
     // 228 kHz. However RDS decoding is still okay even at 2012.
     //
-    // So we use the 'ppm' parameter to compensate for the oscillator error
+    // So we use the 'ppm' parameter to compensate for the oscillator error.
+    // With -ppmcal, the error is then tracked continuously and the divider
+    // reprogrammed on the fly (see ppm_cal.c).
 
-    float divider = (PLLFREQ/(2000*228*(1.+ppm/1.e6)));
-    uint32_t idivider = (uint32_t) divider;
-    uint32_t fdivider = (uint32_t) ((divider - idivider)*pow(2, 12));
+    if (ppm_file) {
+        ppm = load_ppm(ppm_file, ppm);
+        ppm_cal_start(ppm_file, ppm, get_rds_sample_rate());
+    }
+    uint32_t divider = pwm_divider(ppm);
+    uint32_t idivider = divider >> 12;
+    uint32_t fdivider = divider & 0xFFF;
     
-    printf("ppm corr is %.4f, divider is %.4f (%d + %d*2^-12) [nominal 1096.4912].\n", 
-                ppm, divider, idivider, fdivider);
+    printf("ppm corr is %.4f, divider is %.4f (%d + %d*2^-12) [nominal %.4f].\n", 
+                ppm, idivider + fdivider / 4096., idivider, fdivider,
+                PLLFREQ / (2. * get_rds_sample_rate()));
 
     pwm_reg[PWM_CTL] = 0;
     udelay(10);
@@ -465,157 +695,159 @@ int tx(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_
 
     
     uint32_t last_cb = (uint32_t)ctl->cb;
+    // Samples put into the ring since start, including the initial silence
+    uint64_t samples_written = num_samples;
 
     // Data structures for baseband data
     float data[DATA_SIZE];
+    uint32_t words[DATA_SIZE];
     int data_len = 0;
     int data_index = 0;
 
-    // Data structures for mediainfo
-    char mediainfo[64];
-    char mediainfo_new[64];
-
-    // Initialize the baseband generator
-    if(fm_mpx_open(audio_file, pulseaudio, DATA_SIZE) < 0) return 1;
-
-    // Look at previous RDS history
-    // int history_reused = reuse_rds_history(rds_data.dbus_mediainfo);
-    
-    // Initialize the RDS modulator
-    char myps[9] = {0};
-    // if(history_reused == 0) {
-    //     set_rds_pi(rds_data.pi);
-    //     set_rds_rt(rds_data.rt);
-    //     set_rds_pty(rds_data.pty);
-
-    //     printf("Adding specified alternative frequencies.\n");
-    //     for (int i = 0; i < rds_data.af_count; i++)
-    //     {
-    //         add_rds_af(rds_data.af_pool[i]);
-    //     }
-    // }
-    uint16_t count = 0;
-    uint16_t count2 = 0;
-    // int varying_ps = 0;
-
-    manage_rds_startparams(&rds_data);
-    // if(!history_reused) {
-    //     if(rds_data.ps) {
-    //         disable_varying_ps();
-    //         set_rds_ps(rds_data.ps);
-    //     } else {
-    //         rds_data.ps = "<Varying>";
-    //         varying_ps = 1;
-    //     }
-    //     printf("PI: %04X, PS: \"%s\", PTY: %d.\nRT: \"%s\"\n", rds_data.pi, rds_data.ps, rds_data.pty, rds_data.rt);
-    // } else
-    // {
-    //     printf("RDS parameters set from history. All explicit RDS parameters ignored.\n");
-    //     if (history_reused == 2)
-    //     {
-    //         varying_ps = 1;
-    //     }
-    // }
-        
-
-    // Initialize the control pipe reader
-    if(control_pipe) {
-        if(open_control_pipe(control_pipe) == 0) {
-            printf("Reading control commands on %s.\n", control_pipe);
-        } else {
-            printf("Failed to open control pipe: %s.\n", control_pipe);
-            control_pipe = NULL;
-        }
-    }
-
-    // Initialize dbus_mediainfo
-    if(rds_data.dbus_mediainfo)
-    {
-        // disable_varying_ps();
-        // rds_data.ps_var = 0;
-        strcpy(mediainfo_new, rds_data.rt);
-        pthread_create(&dbus_thread_id, NULL, dbus_main, (void*)mediainfo_new);
-    }    
-    
+    // Initialize the generator, RDS and the control interfaces
+    int control = start_generator(audio_file, pulseaudio, &rds_data, control_pipe, control_socket, uecp, status_name, num_samples);
+    if(control < 0) return 1;
     printf("Starting to transmit on %3.1f MHz.\n", carrier_freq/1e6);
 
     for (;;) {
-        // Default (varying) PS
-        if(rds_data.ps_var) {
-            if(count == 512) {
-                snprintf(myps, 9, "%08d", count2);
-                set_history_write(1);
-                set_rds_ps(myps);
-                set_history_write(0);
-                count2++;
-            }
-            else if(count == 1024) {
-                set_history_write(1);
-                set_rds_ps("RPi-Live");
-                set_history_write(0);
-                count = 0;
-            }
-            count++;
-        }
-        
-        if(control_pipe && poll_control_pipe(rds_data.dbus_mediainfo) == CONTROL_PIPE_PS_SET && rds_data.ps_var == 1) {
-            rds_data.ps_var = 0;
-            disable_varying_ps();
+        if(control) {
+            // Commands are parsed by the control thread, RDS changes are
+            // applied by the encoder itself at the next group boundary
+            int ctl_events = poll_control_pipe();
+            if((ctl_events & CONTROL_EVENT(CONTROL_PIPE_PS_SET)) && rds_data.ps_var == 1) {
+                rds_data.ps_var = 0;
+                disable_varying_ps();
+            }
+            if(ctl_events & CONTROL_EVENT(CONTROL_PIPE_FREQ_SET)) {
+                uint32_t new_freq_ctl = freq_to_ctl(requested_freq);
+                uint64_t at = retune(freq_ctl, new_freq_ctl,
+                    (last_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * CBS_PER_SAMPLE),
+                    samples_written);
+                printf("On %3.1f MHz from sample #%llu\n", requested_freq/1e6, (unsigned long long)at);
+                // The words of the current block not copied yet move too
+                for (int i = data_index; i < DATA_SIZE; i++)
+                    words[i] += new_freq_ctl - freq_ctl;
+                freq_ctl = new_freq_ctl;
+                carrier_freq = requested_freq;
+            }
         }
+        flush_rds_history();
         
+        uint64_t sleep_start = telemetry_now();
         usleep(5000);
-
-        // polling mediaplayer2
-        if (rds_data.dbus_mediainfo)
-        {
-            if (strcmp(mediainfo_new, mediainfo) != 0)
-            {
-                strcpy(mediainfo, mediainfo_new);
-                set_rds_rt(mediainfo);
-                if (strcmp("NO MEDIA", mediainfo) != 0 && strcmp("NO METADATA", mediainfo) != 0)
-                    set_rds_rt_tags();
-                printf("Mediainfo changed: %s\n", mediainfo);
-            }
-        }      
+        telemetry_sleep(5000, sleep_start, telemetry_now());
 
         uint32_t cur_cb = mem_phys_to_virt(dma_reg[DMA_CONBLK_AD]);
-        int last_sample = (last_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2);
-        int this_sample = (cur_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2);
+        int last_sample = (last_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * CBS_PER_SAMPLE);
+        int this_sample = (cur_cb - (uint32_t)mbox.virt_addr) / (sizeof(dma_cb_t) * CBS_PER_SAMPLE);
         int free_slots = this_sample - last_sample;
 
         if (free_slots < 0)
-            free_slots += NUM_SAMPLES;
+            free_slots += num_samples;
+
+        telemetry_wakeup(free_slots, telemetry_now());
+        // Output timeline: samples_written counts every sample put in the
+        // ring since start, the sample on the air is num_samples - free_slots
+        // behind
+        set_output_position(samples_written - (num_samples - free_slots), samples_written);
+        update_status_shm(carrier_freq, samples_written - (num_samples - free_slots),
+            num_samples - free_slots);
+        samples_written += free_slots;
+
+        if (ppm_file && ppm_cal_update(free_slots)) {
+            uint32_t new_divider = pwm_divider(ppm_cal_estimate());
+            if (new_divider != divider) {
+                // The divider can be changed while the clock is running,
+                // just like GP0DIV is for every sample
+                clk_reg[PWMCLK_DIV] = 0x5A000000 | new_divider;
+                divider = new_divider;
+                printf("ppm estimate is now %.2f\n", ppm_cal_estimate());
+            }
+        }
 
         while (free_slots >= SUBSIZE) {
             
             // get more baseband samples if necessary
             if(data_len == 0) {
-                // clock_t t = clock();
+                uint64_t mpx_start = telemetry_now();
                 if( fm_mpx_get_samples(data) < 0 ) {
                     terminate(0);
                 }
-                // t = clock() - t;
-                // double time_taken = ((double)t)/CLOCKS_PER_SEC;
-                // printf("get_sample elapsed: %f\n", time_taken);
+                telemetry_mpx(mpx_start, telemetry_now());
+                noise_shape_words(data, words, 0x5A << 24 | freq_ctl, DEVIATION / 10., DATA_SIZE);
                 data_len = DATA_SIZE;
                 data_index = 0;
             }
             
-            float dval = data[data_index] * (DEVIATION / 10.);
+            CB_SAMPLE(last_sample) = words[data_index];
             data_index++;
             data_len--;
 
-            int intval = (int)((floor)(dval));
-            //int frac = (int)((dval - (float)intval) * SUBSIZE);
-
-
-            ctl->sample[last_sample++] = (0x5A << 24 | freq_ctl) + intval; //(frac > j ? intval + 1 : intval);
-            if (last_sample == NUM_SAMPLES)
+            last_sample++;
+            if (last_sample == num_samples)
                 last_sample = 0;
 
             free_slots -= SUBSIZE;
         }
-        last_cb = (uint32_t)mbox.virt_addr + last_sample * sizeof(dma_cb_t) * 2;
+        last_cb = (uint32_t)mbox.virt_addr + last_sample * sizeof(dma_cb_t) * CBS_PER_SAMPLE;
+    }
+
+    return 0;
+}
+
+/* Same as tx(), but the multiplex goes to a file, a pipe or standard output
+   instead of the GPIO. No hardware is touched: the output either paces
+   itself on the clock, or runs as fast as its reader.
+ */
+int tx_sink(uint32_t carrier_freq, char *audio_file, int pulseaudio, struct rds_data_s rds_data, char *control_pipe, char *control_socket, char *uecp, char *status_name, char *output, int format, int realtime, int iq_rate, float iq_deviation) {
+    catch_signals();
+
+    float data[DATA_SIZE];
+    uint64_t samples_written = 0;
+
+    if(SINK_IQ(format)) {
+        // The deviation is in steps of the clock divider, as for the GPIO:
+        // a step moves the carrier by f^2 / (PLLFREQ * 2^12), downwards
+        double deviation = -iq_deviation * ((double)carrier_freq * carrier_freq / PLLFREQ / 4096);
+        if(iq_rate == 0) iq_rate = 4 * get_rds_sample_rate();
+        if(fm_iq_open(get_rds_sample_rate(), iq_rate, deviation) < 0) return 1;
+        printf("FM modulating at %d samples/s, %.1f kHz for full scale.\n", iq_rate, fabs(deviation) / 1e3);
+    }
+
+    if(mpx_sink_open(output, format, realtime, get_rds_sample_rate()) < 0) return 1;
+
+    // Nothing is buffered ahead of the generator
+    int control = start_generator(audio_file, pulseaudio, &rds_data, control_pipe, control_socket, uecp, status_name, 0);
+    if(control < 0) return 1;
+    printf("Writing the multiplex to %s.\n", strcmp(output, "-") == 0 ? "standard output" : output);
+    mpx_sink_start();
+
+    for (;;) {
+        if(control) {
+            int ctl_events = poll_control_pipe();
+            if((ctl_events & CONTROL_EVENT(CONTROL_PIPE_PS_SET)) && rds_data.ps_var == 1) {
+                rds_data.ps_var = 0;
+                disable_varying_ps();
+            }
+            // There is no carrier to move, only the status follows
+            if(ctl_events & CONTROL_EVENT(CONTROL_PIPE_FREQ_SET))
+                carrier_freq = requested_freq;
+        }
+        flush_rds_history();
+
+        set_output_position(samples_written, samples_written);
+        update_status_shm(carrier_freq, samples_written, 0);
+
+        uint64_t mpx_start = telemetry_now();
+        if( fm_mpx_get_samples(data) < 0 ) {
+            terminate(0);
+        }
+        telemetry_mpx(mpx_start, telemetry_now());
+
+        if(mpx_sink_write(data, DATA_SIZE) < 0) {
+            terminate(1);
+        }
+        samples_written += DATA_SIZE;
     }
 
     return 0;
@@ -627,8 +859,19 @@ int main(int argc, char **argv) {
     char *audio_file = NULL;
     int pulseaudio = 0;
     char *control_pipe = NULL;
+    char *control_socket = NULL;
+    char *uecp = NULL;
     uint32_t carrier_freq = 107900000;
     float ppm = 0;
+    char *ppm_file = NULL;
+    char *status_name = NULL;
+    float ring_ms = 0;
+    char *output = NULL;
+    int output_format = SINK_F32;
+    int output_realtime = 1;
+    int iq_rate = 0;
+    float iq_deviation = DEVIATION;
+    int raw_options = 0;
     
     // RDS specifically
     struct rds_data_s rds_data;
@@ -657,6 +900,9 @@ int main(int argc, char **argv) {
         else if(strcmp("-dbus", arg) == 0) {
             rds_data.dbus_mediainfo = 1;
         }
+        else if(strcmp("-outfast", arg) == 0) {
+            output_realtime = 0;
+        }
         else if (strcmp("-help", arg) == 0)
         {
             show_help(NULL);
@@ -700,10 +946,127 @@ int main(int argc, char **argv) {
                 i++;
                 ppm = atof(param);
             }
+            else if (strcmp("-ppmcal", arg) == 0) {
+                i++;
+                ppm_file = param;
+            }
+            else if (strcmp("-shm", arg) == 0) {
+                i++;
+                status_name = param;
+            }
+            else if (strcmp("-nshape", arg) == 0) {
+                i++;
+                int order = atoi(param);
+                if (order < 0 || order > NOISE_SHAPER_MAX_ORDER)
+                    fatal("Incorrect noise shaping order. Must be 0, 1 or 2.\n");
+                noise_shaper_init(order);
+            }
+            else if (strcmp("-ring", arg) == 0) {
+                i++;
+                ring_ms = atof(param);
+                if (ring_ms < 20 || ring_ms > 500)
+                    fatal("Incorrect ring length. Must be in milliseconds, between 20 and 500.\n");
+            }
+            else if (strcmp("-mpxrate", arg) == 0) {
+                i++;
+                int rate = atoi(param);
+                if (rate < 128000 || rate > 400000 || set_rds_sample_rate(rate) < 0)
+                    fatal("Incorrect MPX sample rate. Must be in Hz, between 128000 and 400000, like 171000, 192000, 228000 or 285000.\n");
+            }
+            else if (strcmp("-output", arg) == 0) {
+                i++;
+                output = param;
+            }
+            else if (strcmp("-outfmt", arg) == 0) {
+                i++;
+                output_format = sink_format(param);
+                if (output_format < 0)
+                    fatal("Incorrect output format. Must be f32, s16, cs8, cs16 or cf32.\n");
+            }
+            else if (strcmp("-iqrate", arg) == 0) {
+                i++;
+                iq_rate = atoi(param);
+                if (iq_rate < 300000 || iq_rate > 20000000)
+                    fatal("Incorrect IQ sample rate. Must be in Hz, between 300000 and 20000000.\n");
+            }
+            else if (strcmp("-iqdev", arg) == 0) {
+                i++;
+                iq_deviation = atof(param);
+                if (iq_deviation <= 0 || iq_deviation > 100)
+                    fatal("Incorrect deviation. Must be between 0 and 100, like 25 for WBFM or 3.5 for NBFM.\n");
+            }
             else if (strcmp("-ctl", arg) == 0) {
                 i++;
                 control_pipe = param;
             }
+            else if (strcmp("-sock", arg) == 0) {
+                i++;
+                control_socket = param;
+            }
+            else if (strcmp("-uecp", arg) == 0) {
+                i++;
+                uecp = param;
+            }
+            else if (strcmp("-pulserate", arg) == 0) {
+                i++;
+                int rate = atoi(param);
+                if (rate != 44100 && rate != 48000)
+                    fatal("Incorrect PulseAudio rate. Must be 44100 or 48000.\n");
+                pulse_capture_config(rate, 0);
+                pulseaudio = 1;
+            }
+            else if (strcmp("-pulselatency", arg) == 0) {
+                i++;
+                int latency = atoi(param);
+                if (latency < 1 || latency > 1000)
+                    fatal("Incorrect PulseAudio latency. Must be in milliseconds, between 1 and 1000.\n");
+                pulse_capture_config(0, latency);
+                pulseaudio = 1;
+            }
+            else if (strcmp("-rawfmt", arg) == 0) {
+                i++;
+                int format = raw_format(param);
+                if (format < 0)
+                    fatal("Incorrect raw audio format. Must be s16le, s24le or f32le.\n");
+                raw_input_config(format, 0, 0);
+            }
+            else if (strcmp("-rate", arg) == 0) {
+                i++;
+                int rate = atoi(param);
+                if (rate < 8000 || rate > 192000)
+                    fatal("Incorrect raw audio rate. Must be in Hz, between 8000 and 192000.\n");
+                raw_input_config(0, rate, 0);
+                raw_options = 1;
+            }
+            else if (strcmp("-channels", arg) == 0) {
+                i++;
+                int count = atoi(param);
+                if (count < 1 || count > 8)
+                    fatal("Incorrect raw audio channel count. Must be between 1 and 8.\n");
+                raw_input_config(0, 0, count);
+                raw_options = 1;
+            }
+            else if (strcmp("-dbusprio", arg) == 0) {
+                i++;
+                if (set_player_priority(param) < 0)
+                    fatal("Incorrect player priority. Must be a list of player names, like vlc,spotify.\n");
+                rds_data.dbus_mediainfo = 1;
+            }
+            else if (strcmp("-psseq", arg) == 0) {
+                i++;
+                if (set_ps_sequence(param) < 0)
+                    fatal("Incorrect PS sequence. Must be of the form \"TEXT1:2.5|TEXT2:1\".\n");
+            }
+            else if (strcmp("-psscroll", arg) == 0) {
+                i++;
+                if (set_ps_scroll(param) < 0)
+                    fatal("Incorrect scrolling PS. Must be of the form \"text\" or \"text:0.5\".\n");
+            }
+            else if (strcmp("-rtseq", arg) == 0) {
+                i++;
+                if (set_rt_sequence(param) < 0)
+                    fatal("Incorrect RT sequence. Must be of the form \"Text one:10|Text two:15\".\n");
+            }
             else if (strcmp("-rdsh", arg)==0) {
                 i++;
                 bind_rds_history(param);
@@ -733,7 +1096,21 @@ int main(int argc, char **argv) {
         }
     }
 
-    int errcode = tx(carrier_freq, audio_file, pulseaudio, rds_data, ppm, control_pipe);
+    // WAV files and PulseAudio describe themselves
+    if (raw_options && !raw_input_format())
+        fatal("Options -rate and -channels describe raw audio, they need -rawfmt.\n");
+
+    // The ring holds a duration, whatever the sample rate
+    if (ring_ms > 0)
+        num_samples = (int)(ring_ms * get_rds_sample_rate() / 1000);
+    else
+        num_samples = (int)((int64_t)NUM_SAMPLES * get_rds_sample_rate() / 228000);
+
+    int errcode;
+    if (output)
+        errcode = tx_sink(carrier_freq, audio_file, pulseaudio, rds_data, control_pipe, control_socket, uecp, status_name, output, output_format, output_realtime, iq_rate, iq_deviation);
+    else
+        errcode = tx(carrier_freq, audio_file, pulseaudio, rds_data, ppm, ppm_file, control_pipe, control_socket, uecp, status_name);
     
     terminate(errcode);
 }
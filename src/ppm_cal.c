@@ -0,0 +1,149 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    ppm_cal.c: continuous estimation of the oscillator error, by measuring
+    how fast the DMA engine consumes samples against the system clock.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timex.h>
+
+#include "ppm_cal.h"
+
+// Length of one measurement window, in seconds
+#define CAL_WINDOW 10.
+// Weight of a new measurement in the running estimate
+#define CAL_GAIN 0.25
+// Measurements further off than this are glitches (clock steps, stalls)
+#define CAL_MAX_ERROR 500.
+// Save the estimate every this many accepted windows (10 minutes)
+#define CAL_SAVE_EVERY 60
+
+static char *ppm_filename = NULL;
+static float ppm_estimate = 0;
+static double nominal_rate;
+
+static int cal_started = 0;
+static int cal_windows = 0;
+static long long cal_consumed;
+static struct timespec cal_start;
+
+/*
+ * Reads the oscillator error remembered by a previous run. Returns 'ppm'
+ * if the file does not exist or cannot be parsed.
+ */
+float load_ppm(char *filename, float ppm) {
+    FILE *f = fopen(filename, "r");
+    if(f == NULL) return ppm;
+
+    char buf[32];
+    if(fgets(buf, sizeof(buf), f) && strncmp(buf, "PPM ", 4) == 0) {
+        ppm = atof(buf+4);
+    }
+    fclose(f);
+
+    return ppm;
+}
+
+void save_ppm() {
+    if(ppm_filename == NULL) return;
+
+    FILE *f = fopen(ppm_filename, "w");
+    if(f == NULL) {
+        fprintf(stderr, "Error: could not write ppm file %s.\n", ppm_filename);
+        return;
+    }
+    fprintf(f, "PPM %.3f\n", ppm_estimate);
+    fclose(f);
+}
+
+/*
+ * Starts the calibration from the given estimate. 'sample_rate' is the rate
+ * the DMA engine should consume samples at when the estimate is correct.
+ */
+void ppm_cal_start(char *filename, float ppm, double sample_rate) {
+    ppm_filename = filename;
+    ppm_estimate = ppm;
+    nominal_rate = sample_rate;
+    cal_started = 0;
+}
+
+/*
+ * Accounts for 'consumed' samples played by the DMA engine since the
+ * previous call. Must be called right after reading the DMA position.
+ *
+ * The reference is CLOCK_MONOTONIC, which NTP (or a PPS source through NTP)
+ * disciplines. The raw clock runs off the same crystal as the PLL and would
+ * not show its error, so nothing is measured while the clock is unsynced.
+ *
+ * Returns 1 when the estimate has been updated and the clock divider should
+ * be reprogrammed, 0 otherwise.
+ */
+int ppm_cal_update(int consumed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if(! cal_started) {
+        cal_start = now;
+        cal_consumed = 0;
+        cal_started = 1;
+        return 0;
+    }
+    cal_consumed += consumed;
+
+    double elapsed = (now.tv_sec - cal_start.tv_sec) + (now.tv_nsec - cal_start.tv_nsec) / 1e9;
+    if(elapsed < CAL_WINDOW) return 0;
+
+    double rate = cal_consumed / elapsed;
+
+    cal_start = now;
+    cal_consumed = 0;
+
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    if(adjtimex(&tx) == TIME_ERROR) return 0; // reference clock not synchronised
+
+    return ppm_cal_measure(rate);
+}
+
+/*
+ * Updates the estimate with the consumption rate measured over one window.
+ * Returns 1 if the measurement was accepted, 0 if it was a glitch.
+ */
+int ppm_cal_measure(double rate) {
+    double error = (rate / nominal_rate - 1.) * 1e6;
+    if(fabs(error) > CAL_MAX_ERROR) return 0;
+
+    // A positive estimate means a slow oscillator, and makes the divider
+    // smaller. The rate error is what is left once the divider corrects the
+    // estimate: too fast means the estimate is too large, so it is removed.
+    ppm_estimate -= CAL_GAIN * error;
+
+    if(++cal_windows % CAL_SAVE_EVERY == 0) save_ppm();
+
+    return 1;
+}
+
+float ppm_cal_estimate() {
+    return ppm_estimate;
+}
@@ -0,0 +1,31 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PPM_CAL_H
+#define PPM_CAL_H
+
+extern float load_ppm(char *filename, float ppm);
+extern void save_ppm();
+extern void ppm_cal_start(char *filename, float ppm, double sample_rate);
+extern int ppm_cal_update(int consumed);
+extern int ppm_cal_measure(double rate);
+extern float ppm_cal_estimate();
+
+#endif /* PPM_CAL_H */
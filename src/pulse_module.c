@@ -23,126 +23,266 @@
     pulse_module.c: creates and manages a virtual sink for pulseaudio integration.
 */
 
+/* Captures what the desktop plays: a null sink, made the default one, takes
+   the audio of the players, and a record stream on its monitor source
+   brings it to the multiplex generator. Everything runs on the thread of a
+   threaded mainloop, which pushes the samples into an audio ring. The same
+   works against PipeWire, whose pulse server implements the null sink.
+ */
+
 #include "pulse_module.h"
 
-pa_mainloop *pa_ml;
-pa_mainloop_api *pa_mlapi;
-pa_context *context;
-int ret;
-uint32_t module_idx;
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SINK_NAME "pifmrds"
+#define CAPTURE_CHANNELS 2
+
+static pa_threaded_mainloop *mainloop = NULL;
+static pa_context *context = NULL;
+static pa_stream *stream = NULL;
+static uint32_t module_idx = PA_INVALID_INDEX;
+static struct audio_ring *capture_ring = NULL;
+static pa_sample_spec sample_spec = { PA_SAMPLE_FLOAT32LE, 48000, CAPTURE_CHANNELS };
+static int capture_latency_ms = 20;
+static int capture_state = 0; // 1: capturing, -1: failed
+static int closing = 0;
+static uint64_t capture_latency_us = 0;
+
 
-void pulse_module()
+static void stream_state_cb(pa_stream *s, void *userdata);
+static void stream_read_cb(pa_stream *s, size_t nbytes, void *userdata);
+
+/*
+ * Sets the rate (44100 or 48000 Hz) and the fragment size (in ms) of the
+ * capture stream. To be called before pulse_capture_open().
+ */
+void pulse_capture_config(int rate, int latency_ms)
 {
-    pa_ml = pa_mainloop_new();
-    pa_mlapi = pa_mainloop_get_api(pa_ml);
-    context = pa_context_new(pa_mlapi, "pifmrds");
+    if (rate > 0) sample_spec.rate = rate;
+    if (latency_ms > 0) capture_latency_ms = latency_ms;
+}
 
-    // This function connects to the pulse server
-    pa_context_connect(context, NULL, 0, NULL);
+int pulse_capture_rate()
+{
+    return sample_spec.rate;
+}
 
-    // This function defines a callback so the server will tell us its state.
-    pa_context_set_state_callback(context, context_state_cb, NULL);
+/*
+ * Time in microseconds that the audio waiting on the server side lasts,
+ * measured by the timing updates of the stream: with the ring, it is what
+ * is buffered between the player and the generator.
+ */
+uint64_t pulse_capture_latency()
+{
+    return __atomic_load_n(&capture_latency_us, __ATOMIC_RELAXED);
+}
 
-    if (pa_mainloop_run(pa_ml, &ret) < 0) {
-        printf("pa_mainloop_run() failed.");
-        exit(1);
-    }
+static void fail(const char *what)
+{
+    fprintf(stderr, "Error: %s: %s.\n", what, pa_strerror(pa_context_errno(context)));
+    capture_state = -1;
+    pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void move_input_cb(pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
+{
+    if (eol > 0 || i == NULL)
+        return;
+
+    pa_operation *op = pa_context_move_sink_input_by_name(c, i->index, SINK_NAME, NULL, NULL);
+    if (op) pa_operation_unref(op);
 }
 
-void context_state_cb(pa_context *c, void *userdata)
+static void start_record_stream(pa_context *c)
 {
-    if (pa_context_get_state(c) == PA_CONTEXT_READY)
+    stream = pa_stream_new(c, "PiFmRds capture", &sample_spec, NULL);
+    if (stream == NULL)
     {
-        pa_context_load_module(c, "module-pipe-sink", "file=/tmp/pifmfifo sink_name=pifmrds rate=44100 format=s16le sink_properties=device.description=PiFmRds", sink_ready_cb, userdata);
+        fail("could not create the capture stream");
+        return;
     }
+    pa_stream_set_state_callback(stream, stream_state_cb, NULL);
+    pa_stream_set_read_callback(stream, stream_read_cb, NULL);
+
+    // Only the fragment size matters for a record stream: the server sends
+    // data in fragments of that length
+    pa_buffer_attr attr;
+    attr.maxlength = (uint32_t) -1;
+    attr.tlength = (uint32_t) -1;
+    attr.prebuf = (uint32_t) -1;
+    attr.minreq = (uint32_t) -1;
+    attr.fragsize = pa_usec_to_bytes(capture_latency_ms * 1000, &sample_spec);
+
+    if (pa_stream_connect_record(stream, SINK_NAME ".monitor", &attr,
+            PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE) < 0)
+        fail("could not connect the capture stream");
 }
 
-void sink_ready_cb(pa_context *c, uint32_t idx, void *userdata)
+static void sink_ready_cb(pa_context *c, uint32_t idx, void *userdata)
 {
-    if (idx == PA_INVALID_INDEX) {
-        fprintf(stderr, "Error: invalid index in sink_ready_cb().\n") ;
+    if (idx == PA_INVALID_INDEX)
+    {
+        fail("could not create the null sink");
         return;
     }
     module_idx = idx;
     printf("Sink created!\n");
 
-    // // This is just to write file header (sndfile complains on read otherwise)
-    // SF_INFO sf_info;
-    // sf_info.samplerate = 44100;
-    // sf_info.channels = 2;
-    // sf_info.format = SF_FORMAT_IRCAM | SF_FORMAT_PCM_16;
-
-    // SNDFILE *inf;
-    // int modulefd = open("/tmp/pifmfifo", O_WRONLY);
+    // Players follow the default sink, those already playing are moved
+    pa_operation *op = pa_context_set_default_sink(c, SINK_NAME, NULL, NULL);
+    if (op) pa_operation_unref(op);
+    op = pa_context_get_sink_input_info_list(c, move_input_cb, NULL);
+    if (op) pa_operation_unref(op);
 
-    // if(! (inf = sf_open_fd(modulefd, SFM_WRITE, &sf_info, 0))) {
-    //     fprintf(stderr, "Error: could not open write pipe; %s.\n", sf_strerror (inf));
-    // } else {
-    //     printf("Using write pipe.\n");
-    // }
-    // sf_close(inf);
-    // close(modulefd);
-
-    pa_context_get_sink_info_list(c, list_sinks_cb, (void*)idx);
+    start_record_stream(c);
 }
 
-void list_sinks_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata)
+static void context_state_cb(pa_context *c, void *userdata)
 {
-    if (eol > 0) {
-        return;
-    }
-
-    if (i->owner_module == (uint32_t)userdata)
+    switch (pa_context_get_state(c))
     {
-        pa_context_set_default_sink(c, i->name, default_sink_cb, NULL);
-        pa_context_get_sink_input_info_list(c, list_inputs_cb, (void*)i->index);
+        case PA_CONTEXT_READY: {
+            char arguments[256];
+            snprintf(arguments, sizeof(arguments),
+                "sink_name=" SINK_NAME " rate=%u format=float32le channels=%d "
+                "sink_properties=device.description=PiFmRds", sample_spec.rate, CAPTURE_CHANNELS);
+            pa_operation *op = pa_context_load_module(c, "module-null-sink", arguments, sink_ready_cb, NULL);
+            if (op) pa_operation_unref(op);
+            break;
+        }
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            if (!closing)
+                fail("lost the connection to the sound server");
+            break;
+        default:
+            break;
     }
 }
 
-void default_sink_cb(pa_context *c, int success, void *userdata)
+static void stream_state_cb(pa_stream *s, void *userdata)
 {
-    if (success == 0)
-        printf("Set sink module as default.\n");    
+    switch (pa_stream_get_state(s))
+    {
+        case PA_STREAM_READY: {
+            const pa_buffer_attr *attr = pa_stream_get_buffer_attr(s);
+            printf("Capturing %s.monitor: %u Hz, float32, fragments of %u bytes.\n",
+                SINK_NAME, sample_spec.rate, attr ? attr->fragsize : 0);
+            capture_state = 1;
+            pa_threaded_mainloop_signal(mainloop, 0);
+            break;
+        }
+        case PA_STREAM_FAILED:
+            fail("capture stream failed");
+            break;
+        default:
+            break;
+    }
 }
 
-void list_inputs_cb(pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
+static void stream_read_cb(pa_stream *s, size_t nbytes, void *userdata)
 {
-    if (eol > 0) {
-        pa_mainloop_quit(pa_ml, ret);
-        return; // this may be pointless, but better safe...
+    while (pa_stream_readable_size(s) > 0)
+    {
+        const void *data;
+        size_t length;
+        if (pa_stream_peek(s, &data, &length) < 0)
+            return;
+        if (length == 0)
+            break;
+
+        // A hole (data == NULL) is left out: the generator sees an underrun
+        if (data)
+            audio_ring_write(capture_ring, data, length / sizeof(float));
+        pa_stream_drop(s);
     }
 
-    pa_context_move_sink_input_by_index(c, i->index, (uint32_t)userdata, NULL, NULL);
+    pa_usec_t latency;
+    int negative;
+    if (pa_stream_get_latency(s, &latency, &negative) == 0)
+        __atomic_store_n(&capture_latency_us, negative ? 0 : latency, __ATOMIC_RELAXED);
 }
 
-void pulse_unload()
+/*
+ * Creates the sink and starts capturing into 'ring' (stereo). Returns -1
+ * on error.
+ */
+int pulse_capture_open(struct audio_ring *ring)
 {
-    pa_ml = pa_mainloop_new();
-    pa_mlapi = pa_mainloop_get_api(pa_ml);
-    context = pa_context_new(pa_mlapi, "pifmrds");
+    capture_ring = ring;
+    capture_state = 0;
+    closing = 0;
 
-    // This function connects to the pulse server
-    pa_context_connect(context, NULL, 0, NULL);
+    mainloop = pa_threaded_mainloop_new();
+    if (mainloop == NULL)
+        return -1;
+    context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "pifmrds");
+    if (context == NULL)
+    {
+        pa_threaded_mainloop_free(mainloop);
+        mainloop = NULL;
+        return -1;
+    }
+    pa_context_set_state_callback(context, context_state_cb, NULL);
 
-    // This function defines a callback so the server will tell us its state.
-    pa_context_set_state_callback(context, context_unload_cb, NULL);
+    pa_threaded_mainloop_lock(mainloop);
+    if (pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(mainloop) < 0)
+    {
+        pa_threaded_mainloop_unlock(mainloop);
+        fprintf(stderr, "Error: could not connect to the sound server.\n");
+        pulse_capture_close();
+        return -1;
+    }
+    while (capture_state == 0)
+        pa_threaded_mainloop_wait(mainloop);
+    pa_threaded_mainloop_unlock(mainloop);
 
-    if (pa_mainloop_run(pa_ml, &ret) < 0) {
-        printf("pa_mainloop_run() failed.");
-        exit(1);
+    if (capture_state != 1)
+    {
+        // Unloads the sink if it was created, and stops the mainloop
+        pulse_capture_close();
+        return -1;
     }
+    return 0;
 }
 
-void context_unload_cb(pa_context *c, void *userdata)
+static void sink_unload_cb(pa_context *c, int success, void *userdata)
 {
-    if (pa_context_get_state(c) == PA_CONTEXT_READY)
-    {
-        pa_context_unload_module(context, module_idx, sink_unload_cb, NULL);
-    }
+    if (success)
+        printf("\nSink module unloaded successfully!\n");
+    pa_threaded_mainloop_signal(mainloop, 0);
 }
 
-void sink_unload_cb(pa_context *c, int success, void *userdata)
+void pulse_capture_close()
 {
-    printf("\nSink module unloaded successfully!\n");
-    pa_mainloop_quit(pa_ml, ret);
-}
\ No newline at end of file
+    if (mainloop == NULL)
+        return;
+
+    pa_threaded_mainloop_lock(mainloop);
+    closing = 1;
+    if (stream)
+    {
+        pa_stream_disconnect(stream);
+        pa_stream_unref(stream);
+        stream = NULL;
+    }
+    if (module_idx != PA_INVALID_INDEX && pa_context_get_state(context) == PA_CONTEXT_READY)
+    {
+        pa_operation *op = pa_context_unload_module(context, module_idx, sink_unload_cb, NULL);
+        while (op && pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+            pa_threaded_mainloop_wait(mainloop);
+        if (op) pa_operation_unref(op);
+    }
+    pa_context_disconnect(context);
+    pa_threaded_mainloop_unlock(mainloop);
+
+    pa_threaded_mainloop_stop(mainloop);
+    pa_context_unref(context);
+    pa_threaded_mainloop_free(mainloop);
+    mainloop = NULL;
+    context = NULL;
+    module_idx = PA_INVALID_INDEX;
+}
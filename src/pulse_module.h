@@ -24,22 +24,15 @@
 #ifndef PULSE_H
 #define PULSE_H
 
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
+#include <stdint.h>
 #include <pulse/pulseaudio.h>
-#include <sndfile.h>
 
-void pulse_module();
-void context_state_cb(pa_context *c, void *userdata);
-void sink_ready_cb(pa_context *c, uint32_t idx, void *userdata);
-void list_sinks_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata);
-void default_sink_cb(pa_context *c, int success, void *userdata);
-void list_inputs_cb(pa_context *c, const pa_sink_input_info *i, int eol, void *userdata);
+#include "audio_ring.h"
 
-void pulse_unload();
-void context_unload_cb(pa_context *c, void *userdata);
-void sink_unload_cb(pa_context *c, int success, void *userdata);
+void pulse_capture_config(int rate, int latency_ms);
+int pulse_capture_open(struct audio_ring *ring);
+int pulse_capture_rate();
+uint64_t pulse_capture_latency();
+void pulse_capture_close();
 
-#endif /* PULSE_H */
\ No newline at end of file
+#endif /* PULSE_H */
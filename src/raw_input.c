@@ -0,0 +1,224 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    raw_input.c: reads headerless PCM from stdin or a named pipe.
+*/
+
+/* Raw PCM has no header to describe it, so its format, rate and channel
+   count come from the command line. A reader thread pulls large blocks with
+   read() and converts them in place into the input ring of the generator:
+   there is no intermediate float buffer, and the conversion loops are
+   simple enough for the compiler to vectorize. The ring holds at most two
+   channels, as the multiplex only uses the first two.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "raw_input.h"
+
+// Size of one read(): 64 KiB is the default capacity of a pipe
+#define RAW_READ_BYTES 65536
+
+static int raw_fmt = 0;
+static int raw_rate = 44100;
+static int raw_channels = 2;
+
+static int raw_fd = -1;
+static struct audio_ring *raw_ring = NULL;
+static uint8_t *raw_buffer = NULL;
+static pthread_t raw_thread;
+static int raw_running = 0;
+
+
+/*
+ * Returns the code of a format given by name (s16le, s24le or f32le), or
+ * -1 if unknown.
+ */
+int raw_format(char *name) {
+    if(strcmp(name, "s16le") == 0) return RAW_S16LE;
+    if(strcmp(name, "s24le") == 0) return RAW_S24LE;
+    if(strcmp(name, "f32le") == 0) return RAW_F32LE;
+    return -1;
+}
+
+/*
+ * Sets the format, rate and channel count of the raw input. Zero leaves a
+ * setting unchanged. To be called before raw_input_open().
+ */
+void raw_input_config(int format, int rate, int channels) {
+    if(format > 0) raw_fmt = format;
+    if(rate > 0) raw_rate = rate;
+    if(channels > 0) raw_channels = channels;
+}
+
+/*
+ * Returns the format of the raw input, or 0 if the input is not raw.
+ */
+int raw_input_format() {
+    return raw_fmt;
+}
+
+int raw_input_rate() {
+    return raw_rate;
+}
+
+/*
+ * Channels as stored in the ring: one or two.
+ */
+int raw_input_channels() {
+    return raw_channels > 1 ? 2 : 1;
+}
+
+int raw_input_frame_size() {
+    switch(raw_fmt) {
+        case RAW_S16LE: return 2 * raw_channels;
+        case RAW_S24LE: return 3 * raw_channels;
+        default: return 4 * raw_channels;
+    }
+}
+
+
+/* Converters of 'count' contiguous samples */
+
+static void convert_s16le(const uint8_t *in, float *out, size_t count) {
+    const int16_t *s = (const int16_t *)in;
+    for(size_t i=0; i<count; i++) out[i] = s[i] * (1.f / 32768);
+}
+
+static void convert_s24le(const uint8_t *in, float *out, size_t count) {
+    for(size_t i=0; i<count; i++) {
+        // Place the sample in the top bits so that the sign comes with it
+        int32_t v = (uint32_t)in[3*i] << 8 | (uint32_t)in[3*i+1] << 16 | (uint32_t)in[3*i+2] << 24;
+        out[i] = v * (1.f / 2147483648.f);
+    }
+}
+
+static void convert_f32le(const uint8_t *in, float *out, size_t count) {
+    memcpy(out, in, count * sizeof(float));
+}
+
+/*
+ * Converts 'frames' frames into the ring layout: all channels at once when
+ * they are kept, else the first two of each frame.
+ */
+static void convert_frames(const uint8_t *in, float *out, size_t frames) {
+    void (*convert)(const uint8_t *in, float *out, size_t count);
+    switch(raw_fmt) {
+        case RAW_S16LE: convert = convert_s16le; break;
+        case RAW_S24LE: convert = convert_s24le; break;
+        default: convert = convert_f32le;
+    }
+
+    if(raw_channels <= 2) {
+        convert(in, out, frames * raw_channels);
+        return;
+    }
+
+    int frame_size = raw_input_frame_size();
+    for(size_t f=0; f<frames; f++) convert(in + f * frame_size, out + 2 * f, 2);
+}
+
+/*
+ * Moves 'frames' frames from the read buffer into the ring, waiting for the
+ * generator to make room: a pipe then simply blocks its writer.
+ */
+static void push_frames(const uint8_t *in, size_t frames) {
+    int frame_size = raw_input_frame_size();
+    int ring_channels = raw_input_channels();
+
+    while(frames > 0 && __atomic_load_n(&raw_running, __ATOMIC_RELAXED)) {
+        float *dest;
+        size_t space = audio_ring_write_space(raw_ring, &dest) / ring_channels;
+        if(space == 0) {
+            usleep(5000);
+            continue;
+        }
+        if(space > frames) space = frames;
+
+        convert_frames(in, dest, space);
+        audio_ring_commit(raw_ring, space * ring_channels);
+        in += space * frame_size;
+        frames -= space;
+    }
+}
+
+static void *raw_reader(void *arg) {
+    int frame_size = raw_input_frame_size();
+    size_t kept = 0;
+
+    while(__atomic_load_n(&raw_running, __ATOMIC_RELAXED)) {
+        ssize_t n = read(raw_fd, raw_buffer + kept, RAW_READ_BYTES - kept);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) {
+            perror("Error reading raw audio");
+            break;
+        }
+        if(n == 0) break; // the writer is gone
+
+        size_t bytes = kept + n;
+        size_t frames = bytes / frame_size;
+        push_frames(raw_buffer, frames);
+
+        // A read may end in the middle of a frame
+        kept = bytes - frames * frame_size;
+        memmove(raw_buffer, raw_buffer + frames * frame_size, kept);
+    }
+    return NULL;
+}
+
+/*
+ * Starts reading raw PCM from 'fd' into 'ring', which must have been set up
+ * with raw_input_channels() channels. Returns -1 on error.
+ */
+int raw_input_open(int fd, struct audio_ring *ring) {
+    // Whole frames always fit in the buffer
+    raw_buffer = malloc(RAW_READ_BYTES);
+    if(raw_buffer == NULL) return -1;
+
+    raw_fd = fd;
+    raw_ring = ring;
+    raw_running = 1;
+    if(pthread_create(&raw_thread, NULL, raw_reader, NULL) != 0) {
+        fprintf(stderr, "Error: could not start the raw audio reader.\n");
+        raw_running = 0;
+        free(raw_buffer);
+        raw_buffer = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void raw_input_close() {
+    if(raw_buffer == NULL) return;
+
+    // The reader is likely blocked in read() on a silent pipe
+    __atomic_store_n(&raw_running, 0, __ATOMIC_RELAXED);
+    pthread_cancel(raw_thread);
+    pthread_join(raw_thread, NULL);
+
+    if(raw_fd != STDIN_FILENO) close(raw_fd);
+    raw_fd = -1;
+    free(raw_buffer);
+    raw_buffer = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RAW_INPUT_H
+#define RAW_INPUT_H
+
+#include "audio_ring.h"
+
+#define RAW_S16LE   1
+#define RAW_S24LE   2
+#define RAW_F32LE   3
+
+extern int raw_format(char *name);
+extern void raw_input_config(int format, int rate, int channels);
+extern int raw_input_format();
+extern int raw_input_rate();
+extern int raw_input_channels();
+extern int raw_input_frame_size();
+extern int raw_input_open(int fd, struct audio_ring *ring);
+extern void raw_input_close();
+
+#endif /* RAW_INPUT_H */
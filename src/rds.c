@@ -26,8 +26,10 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "rds.h"
 #include "waveforms.h"
 #include "control_pipe.h"
+#include "subcarrier.h"
 
 #define RT_LENGTH 64
 #define PS_LENGTH 8
@@ -46,6 +48,7 @@ struct {
     uint8_t rt_artist_start;
     uint8_t rt_artist_length;
     int rt_plus_toggle;
+    int rt_ab;
     uint8_t pty;
 } rds_params = { 0 };
 /* Here, the first member of the struct must be a scalar to avoid a
@@ -62,15 +65,30 @@ struct {
 #define BLOCK_SIZE 16
 
 #define BITS_PER_GROUP (GROUP_LENGTH * (BLOCK_SIZE+POLY_DEG))
-#define SAMPLES_PER_BIT 192
-#define FILTER_SIZE (sizeof(waveform_biphase)/sizeof(float))
-#define SAMPLE_BUFFER_SIZE (SAMPLES_PER_BIT + FILTER_SIZE)
+#define BIT_RATE_2 2375 // twice the bit rate of 1187.5 bit/s
+
+// Most phases of the biphase symbol, i.e. fractions of a sample at which a
+// bit may start
+#define MAX_BIT_PHASES 64
+
+/* Sample rate of the multiplex. A bit lasts bit_num / bit_den samples, and
+   the symbol is tabulated for each of the bit_den fractions of a sample a
+   bit can start at.
+ */
+int sample_rate = 0;
+int bit_num;
+int bit_den;
+int samples_per_group;
+float *biphase = NULL;
+int filter_size;
+float *sample_buffer = NULL;
+int sample_buffer_size;
 
 
 char *rdsh_filename = NULL; // RDS-history filename
 int varying_ps = 1;
 int suppress_write = 0;
-int clear_rt = 0;
+int rt_state = 0;
 
 uint16_t offset_words[] = {0x0FC, 0x198, 0x168, 0x1B4};
 // We don't handle offset word C' here for the sake of simplicity
@@ -82,6 +100,52 @@ int af_count = 0;
 // PTY
 uint16_t pty_mask = 0x1F << 5;
 
+// TP (traffic programme) and CT (clock time)
+int traffic_programme = 1;
+int ct_enabled = 1;
+
+// Order in which the group types are sent
+#define GROUP_SEQUENCE_MAX 32
+uint8_t group_sequence[GROUP_SEQUENCE_MAX] = {
+    RDS_GROUP_0A, RDS_GROUP_0A, RDS_GROUP_0A, RDS_GROUP_0A, RDS_GROUP_2A, RDS_GROUP_3A, RDS_GROUP_11A
+};
+int group_sequence_length = 7;
+int group_state = 0;
+
+/* Commands from the control thread. This is a single-producer,
+   single-consumer ring: the control thread fills it, and get_rds_group
+   empties it at the start of every group, so a parameter never changes in
+   the middle of a group. Commands queued together become visible together.
+ */
+#define QUEUE_SIZE 64 // must be a power of two
+struct rds_command rds_queue[QUEUE_SIZE];
+uint32_t queue_head = 0; // next command to apply (consumer)
+uint32_t queue_tail = 0; // next free slot (producer)
+uint32_t commands_applied = 0;
+int history_dirty = 0;
+
+/* Transactions scheduled for later, waiting in arrival order. They are
+   placed on the output timeline: the number of samples put on the air
+   since the transmitter started. Sample n generated here is the sample
+   n + sample_offset of the timeline, the offset being the DMA samples
+   played before the first generated one.
+ */
+#define PENDING_SIZE 64
+struct rds_command pending[PENDING_SIZE];
+int pending_count = 0;
+uint64_t rds_sample_count = 0;
+uint64_t sample_offset = 0;
+uint64_t group_start = 0; // timeline position of the group being built
+
+// Where the RT+ state of the transaction being applied is kept
+struct apply_state
+{
+    int rt_changed;
+    int rt_plus;        // -1: unchanged, 0: off, 1: parsed from RT, 2: rt_tags
+    int rt_tags;
+    int persistent; // something to keep in the history file was applied
+};
+
 /* Classical CRC computation */
 uint16_t crc(uint16_t block) {
     uint16_t crc = 0;
@@ -97,7 +161,8 @@ uint16_t crc(uint16_t block) {
         }
     }
     
-    return crc;
+    // The shifts leave bits above the checkword
+    return crc & ((1 << POLY_DEG) - 1);
 }
 
 /* Possibly generates a CT (clock time) group if the minute has just changed
@@ -122,7 +187,7 @@ int get_rds_ct_group(uint16_t *blocks) {
                         (int)((utc->tm_year - l) * 365.25) +
                         (int)((utc->tm_mon + 2 + l*12) * 30.6001);
         
-        blocks[1] = 0x4400 | (mjd>>15);
+        blocks[1] = 0x4000 | (mjd>>15);
         blocks[2] = (mjd<<1) | (utc->tm_hour>>4);
         blocks[3] = (utc->tm_hour & 0xF)<<12 | utc->tm_min<<6;
         
@@ -137,22 +202,245 @@ int get_rds_ct_group(uint16_t *blocks) {
     } else return 0;
 }
 
+/* Queues commands for the next group boundary. Either all of them are
+   queued, or none is and -1 is returned because the queue is full.
+ */
+int queue_rds_commands(struct rds_command *cmds, int count) {
+    uint32_t tail = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+
+    if(QUEUE_SIZE - (tail - head) < count) return -1;
+
+    for(int i=0; i<count; i++) {
+        rds_queue[(tail + i) & (QUEUE_SIZE-1)] = cmds[i];
+        rds_queue[(tail + i) & (QUEUE_SIZE-1)].commit = (i == count-1);
+    }
+    __atomic_store_n(&queue_tail, tail + count, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+uint32_t rds_commands_applied() {
+    return __atomic_load_n(&commands_applied, __ATOMIC_RELAXED);
+}
+
+static void apply_rds_command(struct rds_command *cmd) {
+    switch(cmd->type) {
+        case RDS_CMD_PS: set_rds_ps(cmd->text); break;
+        case RDS_CMD_TA: set_rds_ta(cmd->value); break;
+        case RDS_CMD_PTY: set_rds_pty(cmd->value); break;
+        case RDS_CMD_AF_ADD: add_rds_af(cmd->value); break;
+        case RDS_CMD_AF_CLEAR: clear_rds_af(); break;
+        case RDS_CMD_PI: set_rds_pi(cmd->value); break;
+        case RDS_CMD_TP: set_rds_tp(cmd->value); break;
+        case RDS_CMD_CT: set_rds_ct(cmd->value); break;
+        case RDS_CMD_GROUP_SEQUENCE:
+            set_rds_group_sequence((uint8_t *) cmd->text, cmd->value);
+            break;
+    }
+}
+
+/* Stores a new RT. The A/B flag changes, which tells receivers to clear
+   their display, and the transmission restarts from the first segment.
+ */
+static void store_rt(char *rt) {
+    strncpy(rds_params.rt, rt, RT_LENGTH);
+    for(int i=0; i<RT_LENGTH; i++) {
+        if(rds_params.rt[i] == 0) rds_params.rt[i] = 32;
+    }
+    rds_params.rt_ab ^= 1;
+    rt_state = 0;
+}
+
+/* RT+ tags always describe the RT being sent: they are computed once the
+   whole transaction has been applied, whatever the order of its commands.
+   A new RT without RT+ in the same transaction turns RT+ off.
+ */
+static void commit_rt_plus(int rt_changed, int rt_plus, int rt_tags) {
+    if(rt_plus == 2) {
+        set_rds_rt_plus_tags(rt_tags >> 24, (rt_tags >> 16) & 0xFF, (rt_tags >> 8) & 0xFF, rt_tags & 0xFF);
+    } else if(rt_plus == 1) {
+        set_rds_rt_tags();
+    } else if(rt_plus == 0 || rt_changed) {
+        if(rt_plus == -1 && rds_params.rt_title_length != 0 && rds_params.rt_artist_length != 0)
+            printf("Not broadcasting RT+ anymore. Must be toggled back on manually after each RT change.\n");
+        clear_rds_rt_tags();
+    }
+}
+
+static void apply_transaction_command(struct rds_command *cmd, struct apply_state *state) {
+    if(cmd->type == RDS_CMD_RT) {
+        store_rt(cmd->text);
+        state->rt_changed = 1;
+    } else if(cmd->type == RDS_CMD_RT_PLUS) {
+        state->rt_plus = cmd->value;
+    } else if(cmd->type == RDS_CMD_RT_PLUS_TAGS) {
+        state->rt_plus = 2;
+        state->rt_tags = cmd->value;
+    } else {
+        apply_rds_command(cmd);
+    }
+    // Texts of PS and RT sequences come back by themselves, they are not
+    // worth a write of the history file
+    if(!((cmd->type == RDS_CMD_PS || cmd->type == RDS_CMD_RT) && cmd->value == RDS_TEXT_TRANSIENT))
+        state->persistent = 1;
+    if(cmd->commit) {
+        commit_rt_plus(state->rt_changed, state->rt_plus, state->rt_tags);
+        state->rt_changed = 0;
+        state->rt_plus = -1;
+    }
+    __atomic_store_n(&commands_applied, commands_applied + 1, __ATOMIC_RELAXED);
+}
+
+/* A scheduled transaction is applied at the group boundary nearest to its
+   time, so at most half a group (44 ms) early or late.
+ */
+static int is_due(struct rds_command *cmd) {
+    return cmd->at <= group_start + samples_per_group / 2;
+}
+
+/* Applies the due transactions, between two groups, so that receivers
+   never see part of a transaction. The history file is not written here,
+   which would mean file I/O while generating samples: it is only marked
+   dirty, and flush_rds_history() writes it from the transmitter loop.
+ */
+static void apply_rds_commands() {
+    uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE);
+    struct apply_state state = { 0, -1, 0, 0 };
+
+    if(head == tail && pending_count == 0) return;
+
+    int suppress = suppress_write;
+    suppress_write = 1;
+
+    // Scheduled transactions that have become due, in arrival order
+    int kept = 0;
+    for(int i=0; i<pending_count; ) {
+        int end = i;
+        while(!pending[end].commit) end++;
+        int due = is_due(&pending[i]);
+        for(; i<=end; i++) {
+            if(due) apply_transaction_command(&pending[i], &state);
+            else pending[kept++] = pending[i];
+        }
+    }
+    pending_count = kept;
+
+    // New transactions: applied now, or put aside until their time
+    while(head != tail) {
+        struct rds_command *first = &rds_queue[head & (QUEUE_SIZE-1)];
+        int length = 1;
+        while(!rds_queue[(head + length - 1) & (QUEUE_SIZE-1)].commit) length++;
+
+        int later = !is_due(first);
+        if(later && pending_count + length > PENDING_SIZE) {
+            printf("Too many scheduled changes, applying them now.\n");
+            later = 0;
+        }
+        for(int i=0; i<length; i++, head++) {
+            struct rds_command *cmd = &rds_queue[head & (QUEUE_SIZE-1)];
+            if(later) pending[pending_count++] = *cmd;
+            else apply_transaction_command(cmd, &state);
+        }
+    }
+
+    suppress_write = suppress;
+    if(state.persistent) history_dirty = 1;
+
+    __atomic_store_n(&queue_head, head, __ATOMIC_RELEASE);
+}
+
+/* Sets the position on the output timeline of the first generated sample.
+ */
+void set_rds_sample_offset(uint64_t offset) {
+    sample_offset = offset;
+}
+
+/* Sets the sample rate of the multiplex and computes the biphase symbol for
+   it. To be called before the first samples are generated (228 kHz
+   otherwise). Returns -1 if a bit would need too many phases.
+ */
+int set_rds_sample_rate(int rate) {
+    // A bit is 2 * rate / 2375 samples
+    int g = gcd(2 * rate, BIT_RATE_2);
+    if(BIT_RATE_2 / g > MAX_BIT_PHASES) {
+        fprintf(stderr, "Error: RDS bits do not fit a %d Hz sample grid.\n", rate);
+        return -1;
+    }
+
+    free(biphase);
+    free(sample_buffer);
+    sample_rate = rate;
+    bit_num = 2 * rate / g;
+    bit_den = BIT_RATE_2 / g;
+    samples_per_group = (int)(BITS_PER_GROUP * (double)bit_num / bit_den);
+
+    biphase = biphase_waveform((double)bit_num / bit_den, bit_den, &filter_size);
+    sample_buffer_size = filter_size + bit_num / bit_den + 1;
+    sample_buffer = calloc(sample_buffer_size, sizeof(float));
+    if(biphase == NULL || sample_buffer == NULL) return -1;
+    return 0;
+}
+
+int get_rds_sample_rate() {
+    return sample_rate ? sample_rate : 228000;
+}
+
+/* Transactions group changes of several parameters: they are all applied
+   at the same group boundary, RT+ is computed from the final RT, and the
+   history file is written once.
+ */
+void rds_begin(struct rds_transaction *t) {
+    t->count = 0;
+    t->at = 0;
+}
+
+int rds_set(struct rds_transaction *t, int type, int value, char *text) {
+    if(t->count == RDS_TRANSACTION_SIZE) return -1;
+
+    struct rds_command *cmd = &t->cmds[t->count++];
+    memset(cmd, 0, sizeof(struct rds_command));
+    cmd->type = type;
+    cmd->value = value;
+    if(text) strncpy(cmd->text, text, sizeof(cmd->text) - 1);
+    return 0;
+}
+
+/* Returns -1 if the command queue is full: nothing is applied then, and
+   the transaction can be committed again later.
+ */
+int rds_commit(struct rds_transaction *t) {
+    if(t->count == 0) return 0;
+    for(int i=0; i<t->count; i++) t->cmds[i].at = t->at;
+    return queue_rds_commands(t->cmds, t->count);
+}
+
+void flush_rds_history() {
+    if(history_dirty) {
+        history_dirty = 0;
+        write_rds_history();
+    }
+}
+
 /* Creates an RDS group. This generates sequences of the form 0A, 0A, 0A, 0A, 2A, etc.
    The pattern is of length 5, the variable 'state' keeps track of where we are in the
    pattern. 'ps_state' and 'rt_state' keep track of where we are in the PS (0A) sequence
    or RT (2A) sequence, respectively.
 */
 void get_rds_group(int *buffer) {
-    static int state = 0;
     static int ps_state = 0;
-    static int rt_state = 0;
     static int af_state = 0;
+    apply_rds_commands();
+
     uint16_t blocks[GROUP_LENGTH] = {rds_params.pi, 0, 0, 0};
     
     // Generate block content
-    if(! get_rds_ct_group(blocks)) { // CT (clock time) has priority on other group types
-        if(state < 4) {
-            blocks[1] = 0x0400 | ps_state;
+    // CT (clock time) has priority on other group types
+    if(! (ct_enabled && get_rds_ct_group(blocks))) {
+        uint8_t group = group_sequence[group_state];
+        if(group == RDS_GROUP_0A) {
+            blocks[1] = 0x0000 | ps_state;
             if(rds_params.ta) blocks[1] |= 0x0010;
             if (af_count > 0)
             {
@@ -173,39 +461,28 @@ void get_rds_group(int *buffer) {
             blocks[3] = rds_params.ps[ps_state*2]<<8 | rds_params.ps[ps_state*2+1];
             ps_state++;
             if(ps_state >= 4) ps_state = 0;
-        } else if (state == 4) { // state == 4 (counting from 0)
-            if (clear_rt)
-            {
-                blocks[1] = 0x2410 | rt_state;
-                blocks[2] = 0x000D<<8;
-                blocks[3] = 0;
-                rt_state = 0;
-                clear_rt--;
-            }
-            else
-            {
-                blocks[1] = 0x2400 | rt_state;
-                blocks[2] = rds_params.rt[rt_state*4+0]<<8 | rds_params.rt[rt_state*4+1];
-                blocks[3] = rds_params.rt[rt_state*4+2]<<8 | rds_params.rt[rt_state*4+3];
-                rt_state++;
-                if(rt_state >= 16) rt_state = 0;
-            }
+        } else if (group == RDS_GROUP_2A) {
+            blocks[1] = 0x2000 | rds_params.rt_ab << 4 | rt_state;
+            blocks[2] = rds_params.rt[rt_state*4+0]<<8 | rds_params.rt[rt_state*4+1];
+            blocks[3] = rds_params.rt[rt_state*4+2]<<8 | rds_params.rt[rt_state*4+3];
+            rt_state++;
+            if(rt_state >= 16) rt_state = 0;
         }
-        else if (state == 5) // 3A (RT+ announce)
+        else if (group == RDS_GROUP_3A) // 3A (RT+ announce)
         {
-            blocks[1] = 0x3400 | 0x16; // Type 3A /w RT+ tags in type 11A 
+            blocks[1] = 0x3000 | 0x16; // Type 3A /w RT+ tags in type 11A 
             // blocks[2] = 0;
             blocks[3] = 0x4BD7;
             // printf("3A ");
         }
-        else if (state == 6) // 11A (RT+ markers)
+        else if (group == RDS_GROUP_11A) // 11A (RT+ markers)
         {
             rds_params.rt_title_start &= 0x3F;
             rds_params.rt_title_length &= 0x3F;
             rds_params.rt_artist_start &= 0x3F;
             rds_params.rt_artist_length &= 0x1F;
 
-            blocks[1] = 0xB400;
+            blocks[1] = 0xB000;
             if (rds_params.rt_plus_toggle)
                 blocks[1] |= 0b10000;   // Item toggle bit
 
@@ -224,9 +501,10 @@ void get_rds_group(int *buffer) {
             // printf("11A\n");
         }
     
-        state++;
-        if(state >= 7) state = 0;
+        group_state++;
+        if(group_state >= group_sequence_length) group_state = 0;
     }
+    blocks[1] |= traffic_programme << 10; // Adding TP
     blocks[1] |= rds_params.pty << 5; // Adding PTY
     // printf("block1: %04X\n", blocks[1]);
     
@@ -246,28 +524,28 @@ void get_rds_group(int *buffer) {
 }
 
 /* Get a number of RDS samples. This generates the envelope of the waveform using
-   pre-generated elementary waveform samples, and then it amplitude-modulates the 
-   envelope with a 57 kHz carrier, which is very efficient as 57 kHz is 4 times the
-   sample frequency we are working at (228 kHz).
+   pre-computed elementary waveform samples, and then it amplitude-modulates the 
+   envelope with the 57 kHz carrier given for the same samples, which is locked
+   to the pilot (see subcarrier.c).
  */
-void get_rds_samples(float *buffer, int count) {
+void get_rds_samples(float *buffer, const float *carrier, int count) {
     static int bit_buffer[BITS_PER_GROUP];
     static int bit_pos = BITS_PER_GROUP;
-    static float sample_buffer[SAMPLE_BUFFER_SIZE] = {0};
     
     static int prev_output = 0;
     static int cur_output = 0;
     static int cur_bit = 0;
-    static int sample_count = SAMPLES_PER_BIT;
+    static int bit_clock = 0; // until the next bit starts, in 1/bit_den samples
     static int inverting = 0;
-    static int phase = 0;
 
-    static int in_sample_index = 0;
-    static int out_sample_index = SAMPLE_BUFFER_SIZE-1;
+    static int out_sample_index = 0;
+
+    if(biphase == NULL && set_rds_sample_rate(228000) < 0) return;
         
     for(int i=0; i<count; i++) {
-        if(sample_count >= SAMPLES_PER_BIT) {
+        if(bit_clock <= 0) {
             if(bit_pos >= BITS_PER_GROUP) {
+                group_start = sample_offset + rds_sample_count + i;
                 get_rds_group(bit_buffer);
                 bit_pos = 0;
             }
@@ -279,43 +557,33 @@ void get_rds_samples(float *buffer, int count) {
             
             inverting = (cur_output == 1);
 
-            float *src = waveform_biphase;
-            int idx = in_sample_index;
+            // The bit started -bit_clock / bit_den samples ago
+            float *src = biphase + (-bit_clock) * filter_size;
+            // Its symbol is played from the next sample on
+            int idx = out_sample_index + 1;
+            if(idx >= sample_buffer_size) idx = 0;
 
-            for(int j=0; j<FILTER_SIZE; j++) {
+            for(int j=0; j<filter_size; j++) {
                 float val = (*src++);
                 if(inverting) val = -val;
                 sample_buffer[idx++] += val;
-                if(idx >= SAMPLE_BUFFER_SIZE) idx = 0;
+                if(idx >= sample_buffer_size) idx = 0;
             }
 
-            in_sample_index += SAMPLES_PER_BIT;
-            if(in_sample_index >= SAMPLE_BUFFER_SIZE) in_sample_index -= SAMPLE_BUFFER_SIZE;
-            
             bit_pos++;
-            sample_count = 0;
+            bit_clock += bit_num;
         }
+        bit_clock -= bit_den;
         
         float sample = sample_buffer[out_sample_index];
         sample_buffer[out_sample_index] = 0;
         out_sample_index++;
-        if(out_sample_index >= SAMPLE_BUFFER_SIZE) out_sample_index = 0;
-        
+        if(out_sample_index >= sample_buffer_size) out_sample_index = 0;
         
         // modulate at 57 kHz
-        // use phase for this
-        switch(phase) {
-            case 0:
-            case 2: sample = 0; break;
-            case 1: break;
-            case 3: sample = -sample; break;
-        }
-        phase++;
-        if(phase >= 4) phase = 0;
-        
-        *buffer++ = sample;
-        sample_count++;
+        *buffer++ = sample * carrier[i];
     }
+    rds_sample_count += count;
 }
 
 void bind_rds_history(char *filename) {
@@ -394,13 +662,43 @@ void clear_rds_rt_tags()
 
 void set_rds_rt_tags()
 {
-    char *dash = strchr(rds_params.rt, '-');
-    int dash_index = (int)(dash - rds_params.rt);
+    // RT is padded with spaces, and has no terminating zero
+    int length = RT_LENGTH;
+    while (length > 0 && rds_params.rt[length-1] == ' ') length--;
 
-    rds_params.rt_title_start = 0;
-    rds_params.rt_title_length = dash_index - 2;
-    rds_params.rt_artist_start = dash_index + 2;
-    rds_params.rt_artist_length = strlen(rds_params.rt) - rds_params.rt_title_length - 3;
+    char *dash = memchr(rds_params.rt, '-', length);
+    int dash_index = dash ? (int)(dash - rds_params.rt) : 0;
+    if (dash_index < 2 || dash_index + 3 > length)
+    {
+        printf("RT+ not set: RT must be formatted as 'Artist - SongName'.\n");
+        clear_rds_rt_tags();
+        return;
+    }
+
+    set_rds_rt_plus_tags(0, dash_index - 1, dash_index + 2, length - dash_index - 2);
+}
+
+/* Tags the artist (content type 4) and the title (content type 1) in the RT,
+   from their positions and lengths in characters.
+ */
+void set_rds_rt_plus_tags(int artist_start, int artist_length, int title_start, int title_length)
+{
+    // The length of the second tag has only 5 bits
+    if (title_length > 32) title_length = 32;
+
+    if (artist_length < 1 || title_length < 1 || artist_start + artist_length > RT_LENGTH ||
+        title_start + title_length > RT_LENGTH)
+    {
+        printf("RT+ not set: tags out of range.\n");
+        clear_rds_rt_tags();
+        return;
+    }
+
+    // Lengths are coded minus one
+    rds_params.rt_title_start = artist_start;
+    rds_params.rt_title_length = artist_length - 1;
+    rds_params.rt_artist_start = title_start;
+    rds_params.rt_artist_length = title_length - 1;
 
     if (rds_params.rt_plus_toggle == 0)
         rds_params.rt_plus_toggle = 1;
@@ -411,11 +709,7 @@ void set_rds_rt_tags()
 }
 
 void set_rds_rt(char *rt) {
-    strncpy(rds_params.rt, rt, 64);
-    for(int i=0; i<64; i++) {
-        if(rds_params.rt[i] == 0) rds_params.rt[i] = 32;
-    }
-    clear_rt = 2; // Sends A/B clear twice, cause some receivers are brokey
+    store_rt(rt);
     if (rds_params.rt_title_length != 0 && rds_params.rt_artist_length != 0)
         printf("Not broadcasting RT+ anymore. Must be toggled back on manually after each RT change.\n");
     clear_rds_rt_tags(); // history write inside clear
@@ -434,6 +728,33 @@ void set_rds_ta(int ta) {
     write_rds_history();
 }
 
+void set_rds_tp(int tp) {
+    traffic_programme = tp;
+}
+
+void set_rds_ct(int ct) {
+    ct_enabled = ct;
+}
+
+/* Returns 1 if the encoder can generate this group type */
+int rds_group_supported(uint8_t group) {
+    return group == RDS_GROUP_0A || group == RDS_GROUP_2A ||
+           group == RDS_GROUP_3A || group == RDS_GROUP_11A;
+}
+
+/* Sets the order in which group types are sent (CT groups are inserted at
+   the start of every minute regardless). Unsupported types are skipped.
+ */
+void set_rds_group_sequence(uint8_t *groups, int count) {
+    int length = 0;
+    for(int i=0; i<count && length<GROUP_SEQUENCE_MAX; i++) {
+        if(rds_group_supported(groups[i])) group_sequence[length++] = groups[i];
+    }
+    if(length == 0) return;
+    group_sequence_length = length;
+    group_state = 0;
+}
+
 void set_rds_pty(uint8_t pty) {
     rds_params.pty = pty;
     write_rds_history();
@@ -589,3 +910,17 @@ void set_history_write(int suppress)
 {
     suppress_write = suppress;
 }
+
+void get_rds_status(struct rds_status *status)
+{
+    status->pi = rds_params.pi;
+    status->pty = rds_params.pty;
+    status->ta = rds_params.ta;
+    status->rt_plus = rds_params.rt_title_length > 0 && rds_params.rt_artist_length > 0;
+    status->af_count = af_count;
+    memcpy(status->af, af_pool, af_count);
+    memcpy(status->ps, rds_params.ps, PS_LENGTH);
+    status->ps[PS_LENGTH] = 0;
+    memcpy(status->rt, rds_params.rt, RT_LENGTH);
+    status->rt[RT_LENGTH] = 0;
+}
@@ -25,16 +25,82 @@
 #include <stdint.h>
 #include "control_pipe.h"
 
-extern void get_rds_samples(float *buffer, int count);
+// Typed commands passed from the control thread to the RDS engine
+#define RDS_CMD_PS          1
+#define RDS_CMD_RT          2
+#define RDS_CMD_RT_PLUS     3
+#define RDS_CMD_TA          4
+#define RDS_CMD_PTY         5
+#define RDS_CMD_AF_ADD      6
+#define RDS_CMD_AF_CLEAR    7
+#define RDS_CMD_PI          8
+#define RDS_CMD_TP          9
+#define RDS_CMD_CT          10
+#define RDS_CMD_GROUP_SEQUENCE 11 // value: number of groups, text: group types
+#define RDS_CMD_RT_PLUS_TAGS 12 // value: RDS_RT_PLUS_TAGS()
+
+// Positions and lengths in the RT of the RT+ artist and title tags
+#define RDS_RT_PLUS_TAGS(artist_start, artist_length, title_start, title_length) \
+    ((artist_start) << 24 | (artist_length) << 16 | (title_start) << 8 | (title_length))
+
+// Value of a PS or RT command whose text is not kept in the history file
+#define RDS_TEXT_TRANSIENT  1
+
+// Group types, coded as (type number << 1) | version like in UECP
+#define RDS_GROUP_0A    0x00
+#define RDS_GROUP_2A    0x04
+#define RDS_GROUP_3A    0x06
+#define RDS_GROUP_11A   0x16
+
+struct rds_command
+{
+    int type;
+    int value;
+    char text[65];
+    int commit; // last command of its transaction (set by queue_rds_commands)
+    uint64_t at; // output sample at which to apply it, 0 for now
+};
+
+#define RDS_TRANSACTION_SIZE 32
+
+struct rds_transaction
+{
+    struct rds_command cmds[RDS_TRANSACTION_SIZE];
+    int count;
+    uint64_t at; // output sample at which to apply it, 0 for now
+};
+
+// Snapshot of the parameters currently being broadcast
+struct rds_status
+{
+    uint16_t pi;
+    uint8_t pty;
+    uint8_t ta;
+    uint8_t rt_plus;
+    uint8_t af_count;
+    uint8_t af[25];
+    char ps[9];
+    char rt[65];
+};
+
+extern uint16_t crc(uint16_t block);
+extern int get_rds_ct_group(uint16_t *blocks);
+extern void get_rds_group(int *buffer);
+extern void get_rds_samples(float *buffer, const float *carrier, int count);
 extern void bind_rds_history(char *filename);
 extern void write_rds_history();
 extern void disable_varying_ps();
 extern void set_rds_pi(uint16_t pi_code);
 extern void clear_rds_rt_tags();
 extern void set_rds_rt_tags();
+extern void set_rds_rt_plus_tags(int artist_start, int artist_length, int title_start, int title_length);
 extern void set_rds_rt(char *rt);
 extern void set_rds_ps(char *ps);
 extern void set_rds_ta(int ta);
+extern void set_rds_tp(int tp);
+extern void set_rds_ct(int ct);
+extern int rds_group_supported(uint8_t group);
+extern void set_rds_group_sequence(uint8_t *groups, int count);
 extern void set_rds_pty(uint8_t pty);
 extern void add_rds_af(uint8_t af);
 extern void clear_rds_af();
@@ -42,5 +108,15 @@ extern uint8_t mhz_to_binary(int freq);
 extern int reuse_rds_history(int dbus_mediainfo);
 extern void manage_rds_startparams(struct rds_data_s *rds_data);
 extern void set_history_write(int suppress);
+extern void get_rds_status(struct rds_status *status);
+extern int queue_rds_commands(struct rds_command *cmds, int count);
+extern uint32_t rds_commands_applied();
+extern void flush_rds_history();
+extern void rds_begin(struct rds_transaction *t);
+extern int rds_set(struct rds_transaction *t, int type, int value, char *text);
+extern int rds_commit(struct rds_transaction *t);
+extern void set_rds_sample_offset(uint64_t offset);
+extern int set_rds_sample_rate(int rate);
+extern int get_rds_sample_rate();
 
 #endif /* RDS_H */
\ No newline at end of file
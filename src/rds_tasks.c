@@ -0,0 +1,219 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Periodic RDS tasks: PS and RT sequences.
+
+   They run on the timer wheel of the control thread, and hand their changes
+   to the encoder through the command queue like any other control command.
+   Every frame of a sequence is scheduled for its exact sample on the output
+   timeline, so that it is on the air for its dwell time, to the nearest
+   group boundary, and the dwell times never drift.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds_tasks.h"
+#include "rds.h"
+#include "control_pipe.h"
+#include "timer_wheel.h"
+
+#define MAX_FRAMES 128
+#define PS_DWELL 2.5        // default dwell time of a PS frame, in seconds
+#define PS_SCROLL_STEP 0.5
+#define RT_DWELL 10.0
+#define VARYING_PS_DWELL 2.56
+
+struct text_frame
+{
+    char text[65];
+    int counter;        // the text is the value of a counter
+    double dwell;       // in seconds
+};
+
+struct text_sequence
+{
+    int type;           // RDS_CMD_PS or RDS_CMD_RT
+    int length;         // maximum length of a frame
+    struct text_frame frames[MAX_FRAMES];
+    int count;
+    int next;
+    struct timer_task task;
+};
+
+static struct text_sequence ps_sequence = { RDS_CMD_PS, 8 };
+static struct text_sequence rt_sequence = { RDS_CMD_RT, 64 };
+static int ps_counter = 0;
+
+
+static uint64_t seconds_to_samples(double seconds) {
+    return (uint64_t)(seconds * get_rds_sample_rate() + 0.5);
+}
+
+static int add_frame(struct text_sequence *seq, char *text, int counter, double dwell) {
+    if(seq->count == MAX_FRAMES) {
+        fprintf(stderr, "Error: too many frames, at most %d.\n", MAX_FRAMES);
+        return -1;
+    }
+    if(dwell <= 0) {
+        fprintf(stderr, "Error: dwell time must be positive.\n");
+        return -1;
+    }
+
+    struct text_frame *frame = &seq->frames[seq->count++];
+    snprintf(frame->text, seq->length + 1, "%s", text);
+    frame->counter = counter;
+    frame->dwell = dwell;
+    return 0;
+}
+
+/*
+ * Splits "text:seconds" in place. Returns the dwell time, or 'dwell' if the
+ * text does not end with a number of seconds.
+ */
+static double split_dwell(char *spec, double dwell) {
+    char *colon = strrchr(spec, ':');
+    if(!colon || colon[1] == 0) return dwell;
+
+    char *end;
+    double seconds = strtod(colon+1, &end);
+    if(*end != 0) return dwell;
+
+    *colon = 0;
+    return seconds;
+}
+
+/*
+ * Parses frames given as "text:seconds|text:seconds|...". Frames without
+ * a dwell time are shown for 'dwell' seconds.
+ */
+static int parse_sequence(struct text_sequence *seq, char *spec, double dwell) {
+    char *copy = strdup(spec);
+    char *save;
+
+    seq->count = 0;
+    for(char *frame = strtok_r(copy, "|", &save); frame; frame = strtok_r(NULL, "|", &save)) {
+        double seconds = split_dwell(frame, dwell);
+        if(add_frame(seq, frame, 0, seconds) < 0) {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+
+    if(seq->count == 0) {
+        fprintf(stderr, "Error: empty sequence.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int set_ps_sequence(char *spec) {
+    return parse_sequence(&ps_sequence, spec, PS_DWELL);
+}
+
+int set_rt_sequence(char *spec) {
+    return parse_sequence(&rt_sequence, spec, RT_DWELL);
+}
+
+/*
+ * Scrolls "text[:seconds]" through the PS, one character per step.
+ */
+int set_ps_scroll(char *spec) {
+    char text[MAX_FRAMES + 8];
+    snprintf(text, sizeof(text) - 8, "%s", spec);
+    double step = split_dwell(text, PS_SCROLL_STEP);
+
+    int length = strlen(text);
+    if(length <= 8) {
+        ps_sequence.count = 0;
+        return add_frame(&ps_sequence, text, 0, step);
+    }
+
+    // The text leaves the display before it comes back
+    strcat(text, "        ");
+    ps_sequence.count = 0;
+    for(int i=0; i<length; i++) {
+        char window[9];
+        snprintf(window, sizeof(window), "%s", text + i);
+        if(add_frame(&ps_sequence, window, 0, step) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * The default PS, when none was given: a counter, then "RPi-Live".
+ */
+void set_varying_ps() {
+    if(ps_sequence.count) return;
+
+    add_frame(&ps_sequence, "", 1, VARYING_PS_DWELL);
+    add_frame(&ps_sequence, "RPi-Live", 0, VARYING_PS_DWELL);
+}
+
+/*
+ * Shows the next frame of a sequence.
+ */
+static uint64_t show_frame(struct timer_task *task) {
+    struct text_sequence *seq = task->ctx;
+    struct text_frame *frame = &seq->frames[seq->next];
+    struct rds_command cmd = { seq->type, RDS_TEXT_TRANSIENT };
+
+    if(frame->counter) snprintf(cmd.text, 9, "%08d", ps_counter++);
+    else strcpy(cmd.text, frame->text);
+    cmd.at = task->due;
+    submit_rds_commands(&cmd, 1);
+
+    seq->next = (seq->next + 1) % seq->count;
+    return seconds_to_samples(frame->dwell);
+}
+
+/*
+ * A text set by a control command ends its sequence.
+ */
+static void stop_sequences(int code) {
+    if(code == CONTROL_PIPE_PS_SET && ps_sequence.task.scheduled) {
+        cancel_timer(&ps_sequence.task);
+        printf("PS sequence stopped.\n");
+    }
+    if(code == CONTROL_PIPE_RT_SET && rt_sequence.task.scheduled) {
+        cancel_timer(&rt_sequence.task);
+        printf("RT sequence stopped.\n");
+    }
+}
+
+/*
+ * Starts the tasks, the first frames being shown at output sample 'start'.
+ * Returns -1 on error.
+ */
+int start_rds_tasks(uint64_t start, int dbus_mediainfo) {
+    if(dbus_mediainfo && rt_sequence.count) {
+        printf("RT is pulled from metadata, the RT sequence is ignored.\n");
+        rt_sequence.count = 0;
+    }
+    if(ps_sequence.count == 0 && rt_sequence.count == 0) return 0;
+
+    if(ps_sequence.count) schedule_timer(&ps_sequence.task, start, show_frame, &ps_sequence);
+    if(rt_sequence.count) schedule_timer(&rt_sequence.task, start, show_frame, &rt_sequence);
+    set_control_event_hook(stop_sequences);
+
+    return start_timer_wheel();
+}
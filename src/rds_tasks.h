@@ -0,0 +1,32 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RDS_TASKS_H
+#define RDS_TASKS_H
+
+#include <stdint.h>
+
+extern int set_ps_sequence(char *spec);
+extern int set_ps_scroll(char *spec);
+extern int set_rt_sequence(char *spec);
+extern void set_varying_ps();
+extern int start_rds_tasks(uint64_t start, int dbus_mediainfo);
+
+#endif /* RDS_TASKS_H */
@@ -4,7 +4,7 @@
     
     See https://github.com/ChristopheJacquet/PiFmRds
     
-    rds_wav.c is a test program that writes a RDS baseband signal to a WAV
+    rds_wav.c renders the multiplex of an audio file, with RDS, to a WAV
     file. It requires libsndfile.
 
     This program is free software: you can redistribute it and/or modify
@@ -21,25 +21,179 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* The multiplex is rendered in batches of one chunk per core. Within a
+   batch, each thread filters and modulates its own chunk of the audio,
+   while the main thread generates the RDS for the whole batch, which has
+   to be done in order. The batch is then mixed and written out, and the
+   next one read in.
+
+   A chunk does not depend on the one before it: the input frame held at
+   each output sample is computed from the sample number, exactly, and the
+   filter is warmed up on the FIR_SIZE-1 samples preceding the chunk. The
+   result is the same whatever the number of threads.
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <sndfile.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "rds.h"
-#include "fm_mpx.h"
+#include "subcarrier.h"
+#include "lowpass.h"
+
+
+#define CHUNK_SECONDS 1
+#define DEFAULT_SECONDS 20
+#define MAX_THREADS 64
+#define MAX_PHASES 65536
+
+struct chunk {
+    uint64_t start;     // first output sample
+    int count;
+    float *out;
+    float *pilot;
+    float *stereo;
+    pthread_t thread;
+    int threaded;       // 0 if rendered on the main thread
+};
+
+static int mpx_rate;
+static int in_rate;
+static int channels = 0;        // 0 without audio
+static float fir[FIR_HALF_SIZE];
+
+// Filter weights per frame, for each position in the frame (see init_weights)
+static float *weights = NULL;
+static int taps;
+static int phases;
+static int phase_step;
+
+// Input frames of the batch, interleaved, from frame 'input_start'
+static float *input = NULL;
+static uint64_t input_start = 0;
+static uint64_t input_end = 0;
+static int input_size;          // in frames
 
+static SNDFILE *inf = NULL;
 
-#define LENGTH 114000
 
+/* Index of the input frame held at output sample 'n' */
+static uint64_t frame_at(uint64_t n) {
+    return n * in_rate / mpx_rate;
+}
+
+/* Makes frames first..last available in 'input', reading the file on and
+   looping it if needed. Returns -1 on error.
+ */
+static int read_input(uint64_t first, uint64_t last) {
+    if(first > input_end) first = input_end;
+    if(first > input_start) {
+        memmove(input, input + (first - input_start) * channels,
+            (input_end - first) * channels * sizeof(float));
+        input_start = first;
+    }
+
+    while(input_end <= last) {
+        int want = input_size - (input_end - input_start);
+        if(want <= 0) return -1;
+        sf_count_t got = sf_readf_float(inf, input + (input_end - input_start) * channels, want);
+        if(got == 0) {
+            if(sf_seek(inf, 0, SEEK_SET) < 0) return -1;
+            got = sf_readf_float(inf, input + (input_end - input_start) * channels, want);
+            if(got == 0) return -1;
+        }
+        input_end += got;
+    }
+    return 0;
+}
+
+/* The input is held (zero-order hold) for several output samples, so the
+   taps of the filter that fall on the same frame can be added up first.
+   Where the taps fall depends only on the position of the output sample
+   within the frame, of which there are mpx_rate / gcd(in_rate, mpx_rate):
+   one set of 'taps' weights is computed for each. Returns -1 if there are
+   too many.
+ */
+static int init_weights() {
+    float h[FIR_SIZE] = {0};
+    for(int fi=0; fi<FIR_HALF_SIZE; fi++) {
+        h[fi] += fir[fi];
+        h[FIR_SIZE-1-fi] += fir[fi];
+    }
+
+    int g = gcd(in_rate, mpx_rate);
+    phase_step = g;
+    phases = mpx_rate / g;
+    if(phases > MAX_PHASES) {
+        fprintf(stderr, "Error: an input at %d Hz does not fit the %d Hz multiplex.\n", in_rate, mpx_rate);
+        return -1;
+    }
+    taps = ((int64_t)(FIR_SIZE - 1) * in_rate + mpx_rate - 1) / mpx_rate + 1;
+    weights = calloc((size_t)phases * taps, sizeof(float));
+    if(weights == NULL) return -1;
+
+    // Tap k of the output sample at 'offset' in its frame falls j frames back
+    for(int p=0; p<phases; p++) {
+        int64_t offset = (int64_t)p * g;
+        for(int k=0; k<FIR_SIZE; k++) {
+            int64_t back = (int64_t)k * in_rate - offset;
+            int j = back > 0 ? (back + mpx_rate - 1) / mpx_rate : 0;
+            weights[p * taps + j] += h[k];
+        }
+    }
+    return 0;
+}
+
+/* Renders the audio part of a chunk: filtered sum, stereo difference and
+   pilot, without RDS.
+ */
+static void *render_chunk(void *arg) {
+    struct chunk *c = arg;
+    int c1 = channels > 1 ? 1 : 0;
+
+    get_subcarriers_at(c->start, c->pilot, c->stereo, NULL, c->count);
+
+    // Frame held at the first sample, and the position in it
+    uint64_t q = c->start * in_rate;
+    uint64_t frame = q / mpx_rate;
+    int offset = q % mpx_rate;
+
+    for(int i=0; i<c->count; i++) {
+        float *w = weights + (offset / phase_step) * taps;
+        float out_mono = 0;
+        float out_stereo = 0;
+
+        // Before the start of the input, there is silence
+        int n = frame + 1 < taps ? frame + 1 : taps;
+        float *x = input + (frame - input_start) * channels;
+        for(int j=0; j<n; j++, x -= channels) {
+            out_mono += w[j] * (x[0] + x[c1]);
+            out_stereo += w[j] * (x[0] - x[c1]);
+        }
+
+        c->out[i] = 4.05 * out_mono;
+        if(channels > 1) {
+            c->out[i] += 4.05 * c->stereo[i] * out_stereo + .9 * c->pilot[i];
+        }
+
+        offset += in_rate;
+        while(offset >= mpx_rate) {
+            offset -= mpx_rate;
+            frame++;
+        }
+    }
+    return NULL;
+}
 
-/* Simple test program */
 int main(int argc, char **argv) {
     if(argc < 4) {
         fprintf(stderr, "Error: missing argument.\n");
-        fprintf(stderr, "Syntax: rds_wav <in_audio.wav> <out_mpx.wav> <text>\n");
+        fprintf(stderr, "Syntax: rds_wav <in_audio.wav> <out_mpx.wav> <text> [seconds]\n");
         return EXIT_FAILURE;
     }
     
@@ -49,20 +203,58 @@ int main(int argc, char **argv) {
     
     char *in_file = argv[1];
     if(strcmp("NONE", argv[1]) == 0) in_file = NULL;
-    
-    if(fm_mpx_open(in_file, LENGTH) != 0) {
-        printf("Could not setup FM mulitplex generator.\n");
-        return EXIT_FAILURE;
+    double seconds = argc > 4 ? atof(argv[4]) : 0;
+
+    mpx_rate = get_rds_sample_rate();
+    if(subcarrier_init(mpx_rate) < 0) return EXIT_FAILURE;
+
+    if(in_file) {
+        SF_INFO sfinfo;
+        memset(&sfinfo, 0, sizeof(sfinfo));
+        if(! (inf = sf_open(in_file, SFM_READ, &sfinfo))) {
+            fprintf(stderr, "Error: could not open input file %s.\n", in_file);
+            return EXIT_FAILURE;
+        }
+        in_rate = sfinfo.samplerate;
+        channels = sfinfo.channels;
+        // By default the input is rendered once
+        if(seconds <= 0) seconds = (double)sfinfo.frames / in_rate;
+        lowpass_init(fir, in_rate, mpx_rate);
+        if(init_weights() < 0) return EXIT_FAILURE;
+    }
+    if(seconds <= 0) seconds = DEFAULT_SECONDS;
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+    int chunk_size = mpx_rate * CHUNK_SECONDS;
+    int batch_size = chunk_size * threads;
+    uint64_t total = (uint64_t)(seconds * mpx_rate);
+
+    float *mpx = malloc(batch_size * sizeof(float));
+    float *rds = malloc(batch_size * sizeof(float));
+    float *rds_carrier = malloc(batch_size * sizeof(float));
+    struct chunk chunks[MAX_THREADS];
+    for(int t=0; t<threads; t++) {
+        chunks[t].out = mpx + t * chunk_size;
+        chunks[t].pilot = malloc(chunk_size * sizeof(float));
+        chunks[t].stereo = malloc(chunk_size * sizeof(float));
+        if(chunks[t].pilot == NULL || chunks[t].stereo == NULL) return EXIT_FAILURE;
+    }
+    if(mpx == NULL || rds == NULL || rds_carrier == NULL) return EXIT_FAILURE;
+    if(channels) {
+        // The frames of a batch, the warm-up ones before and one to spare
+        input_size = frame_at(batch_size) + taps + 2;
+        input = malloc((size_t)input_size * channels * sizeof(float));
+        if(input == NULL) return EXIT_FAILURE;
     }
-    
 
-    
     // Set the format of the output file
     SNDFILE *outf;
     SF_INFO sfinfo;
 
-    sfinfo.frames = LENGTH;
-    sfinfo.samplerate = 228000;
+    sfinfo.frames = total;
+    sfinfo.samplerate = mpx_rate;
     sfinfo.channels = 1;
     sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
     sfinfo.sections = 1;
@@ -75,27 +267,53 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    float mpx_buffer[LENGTH];
+    printf("Rendering %.1f s at %d Hz on %d threads.\n", seconds, mpx_rate, threads);
+
+    for(uint64_t start = 0; start < total; start += batch_size) {
+        int count = total - start < batch_size ? total - start : batch_size;
+        int used = 0;
 
-    for(int j=0; j<40; j++) {
-        if( fm_mpx_get_samples(mpx_buffer) < 0 ) break;
-        
-        // scale samples
-        for(int i=0; i<LENGTH; i++) {
-            mpx_buffer[i] /= 10.;
+        if(channels) {
+            uint64_t first = frame_at(start) >= taps - 1 ? frame_at(start) - (taps - 1) : 0;
+            if(read_input(first, frame_at(start + count - 1)) < 0) {
+                fprintf(stderr, "Error: reading %s.\n", in_file);
+                return EXIT_FAILURE;
+            }
+            for(; used < threads && used * chunk_size < count; used++) {
+                struct chunk *c = &chunks[used];
+                c->start = start + used * chunk_size;
+                c->count = count - used * chunk_size < chunk_size ? count - used * chunk_size : chunk_size;
+                c->threaded = pthread_create(&c->thread, NULL, render_chunk, c) == 0;
+                if(! c->threaded) render_chunk(c);
+            }
+        } else {
+            memset(mpx, 0, count * sizeof(float));
         }
 
-        if(sf_write_float(outf, mpx_buffer, LENGTH) != LENGTH) {
-            fprintf(stderr, "Error: writing to file %s.\n", argv[1]);
+        // RDS, in order, while the chunks are rendered
+        get_subcarriers(NULL, NULL, rds_carrier, count);
+        get_rds_samples(rds, rds_carrier, count);
+
+        for(int t=0; t<used; t++) {
+            if(chunks[t].threaded) pthread_join(chunks[t].thread, NULL);
+        }
+
+        for(int i=0; i<count; i++) {
+            mpx[i] = (mpx[i] + rds[i]) / 10.;
+        }
+
+        if(sf_write_float(outf, mpx, count) != count) {
+            fprintf(stderr, "Error: writing to file %s.\n", out_file);
             return EXIT_FAILURE;
         }
     }
     
     if(sf_close(outf) ) {
-        fprintf(stderr, "Error: closing file %s.\n", argv[1]);
+        fprintf(stderr, "Error: closing file %s.\n", out_file);
     }
-    
-    fm_mpx_close();
+    if(inf) sf_close(inf);
+    free(weights);
+    subcarrier_close();
 
     return EXIT_SUCCESS;
 }
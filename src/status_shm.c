@@ -0,0 +1,155 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    status_shm.c: publishes the transmitter status in a shared memory page
+    that monitoring tools can map and read without any system call.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "status_shm.h"
+#include "rds.h"
+#include "fm_mpx.h"
+#include "telemetry.h"
+#include "ppm_cal.h"
+
+_Static_assert(sizeof(struct pifmrds_status) == 280, "status page layout changed");
+
+static struct pifmrds_status *status = NULL;
+static char *status_name = NULL;
+
+/*
+ * Creates (or reuses) the shared memory segment /dev/shm/<name>. Without a
+ * name, the page is private to the process (for the control socket).
+ */
+int open_status_shm(char *name) {
+    if(status != NULL) return 0;
+
+    if(name == NULL) {
+        status = mmap(NULL, sizeof(struct pifmrds_status), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+        if(fd < 0) return -1;
+
+        if(ftruncate(fd, sizeof(struct pifmrds_status)) < 0) {
+            close(fd);
+            return -1;
+        }
+
+        status = mmap(NULL, sizeof(struct pifmrds_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if(status == MAP_FAILED) {
+        status = NULL;
+        return -1;
+    }
+
+    memset(status, 0, sizeof(struct pifmrds_status));
+    status->magic = STATUS_MAGIC;
+    status->version = STATUS_VERSION;
+    status->size = sizeof(struct pifmrds_status);
+    status_name = name;
+
+    return 0;
+}
+
+/*
+ * Publishes a new status. Called from the producer loop; the update is a
+ * few hundred bytes of copying between two increments of the sequence
+ * counter, readers never block it.
+ */
+void update_status_shm(uint32_t freq, uint64_t samples, uint32_t lead) {
+    if(status == NULL) return;
+
+    struct rds_status rds;
+    struct mpx_audio_status audio;
+    struct tx_telemetry t;
+    struct timespec now;
+
+    get_rds_status(&rds);
+    fm_mpx_get_status(&audio);
+    telemetry_snapshot(&t);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint32_t seq = status->seq;
+    __atomic_store_n(&status->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    status->samples = samples;
+    status->timestamp_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    status->sample_rate = get_rds_sample_rate();
+    status->freq = freq;
+    status->ppm = ppm_cal_estimate();
+    status->lead = lead;
+    status->lead_min = t.lead_min;
+    status->lead_max = t.lead_max;
+    status->underruns = t.underruns;
+    status->mpx_max_us = t.mpx_max_us;
+    status->audio_frames = audio.frames;
+    status->audio_rate = audio.rate;
+    status->audio_channels = audio.channels;
+    status->peak_left = audio.peak[0];
+    status->peak_right = audio.peak[1];
+    status->pi = rds.pi;
+    status->pty = rds.pty;
+    status->ta = rds.ta;
+    status->rt_plus = rds.rt_plus;
+    status->af_count = rds.af_count;
+    memcpy(status->af, rds.af, sizeof(rds.af));
+    memcpy(status->ps, rds.ps, sizeof(rds.ps));
+    memcpy(status->rt, rds.rt, sizeof(rds.rt));
+    memcpy(status->source, audio.source, sizeof(status->source));
+    status->audio_state = audio.state;
+    status->audio_dropouts = audio.dropouts;
+
+    __atomic_store_n(&status->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reads a consistent copy of the status page (from within the process).
+ * Returns -1 if the page has not been opened.
+ */
+int read_status_shm(struct pifmrds_status *out) {
+    if(status == NULL) return -1;
+
+    uint32_t seq1, seq2;
+    do {
+        seq1 = __atomic_load_n(&status->seq, __ATOMIC_ACQUIRE);
+        if(seq1 & 1) continue;
+        memcpy(out, status, sizeof(struct pifmrds_status));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&status->seq, __ATOMIC_RELAXED);
+    } while((seq1 & 1) || seq1 != seq2);
+
+    return 0;
+}
+
+void close_status_shm() {
+    if(status == NULL) return;
+
+    munmap(status, sizeof(struct pifmrds_status));
+    if(status_name) shm_unlink(status_name);
+    status = NULL;
+}
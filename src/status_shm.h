@@ -0,0 +1,77 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATUS_SHM_H
+#define STATUS_SHM_H
+
+#include <stdint.h>
+
+#define STATUS_MAGIC 0x524D4650 // "PFMR"
+#define STATUS_VERSION 2
+
+/* Layout of the shared memory status page. Every field is naturally aligned
+   and there is no implicit padding, so the page can be decoded from any
+   language (Python: struct format "<IIIIQQIIfIIIIIQIIffHBBBBH28s16s68s64sII").
+   Fields are only ever appended, and 'version' is bumped when they are.
+
+   Readers must follow the seqlock protocol: read 'seq', retry while it is
+   odd, copy the page, then read 'seq' again and retry if it has changed.
+ */
+struct pifmrds_status
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // sizeof(struct pifmrds_status)
+    uint32_t seq;
+    uint64_t samples;           // samples played since start
+    uint64_t timestamp_us;      // CLOCK_REALTIME of the last update
+    uint32_t sample_rate;
+    uint32_t freq;              // carrier frequency in Hz
+    float ppm;
+    uint32_t lead;              // writer lead over the DMA engine, in samples
+    uint32_t lead_min;
+    uint32_t lead_max;
+    uint32_t underruns;
+    uint32_t mpx_max_us;
+    uint64_t audio_frames;
+    uint32_t audio_rate;
+    uint32_t audio_channels;
+    float peak_left;
+    float peak_right;
+    uint16_t pi;
+    uint8_t pty;
+    uint8_t ta;
+    uint8_t rt_plus;
+    uint8_t af_count;
+    uint16_t reserved;
+    uint8_t af[28];
+    char ps[16];
+    char rt[68];
+    char source[64];
+    uint32_t audio_state;       // MPX_AUDIO_* (version 2)
+    uint32_t audio_dropouts;
+};
+
+extern int open_status_shm(char *name);
+extern void update_status_shm(uint32_t freq, uint64_t samples, uint32_t lead);
+extern int read_status_shm(struct pifmrds_status *out);
+extern void close_status_shm();
+
+#endif /* STATUS_SHM_H */
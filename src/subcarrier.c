@@ -0,0 +1,140 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    subcarrier.c: generates the 19, 38 and 57 kHz subcarriers of the multiplex.
+*/
+
+/* The stereo carrier (38 kHz) and the RDS carrier (57 kHz) must be locked to
+   the second and third harmonics of the pilot. They are all read from one
+   shared sine table by a single master phase, so they cannot drift apart,
+   whatever the generator does with the audio.
+
+   The master phase counts output samples modulo the period of the pilot on
+   the sample grid: 'period' samples hold exactly 'cycles' cycles of the
+   pilot (12 samples and 1 cycle at 228 kHz, 192 samples and 19 cycles at
+   192 kHz). Over that period, each harmonic is a fixed sequence taken from
+   the sine table, so a block of carriers is a few copies of precomputed
+   periods, with no per-sample phase arithmetic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "subcarrier.h"
+
+// Longest period accepted, in samples
+#define MAX_PERIOD 65536
+
+static float *sine = NULL;          // one cycle, 'period' entries
+static float *harmonic[3] = {NULL, NULL, NULL}; // 19, 38 and 57 kHz over a period
+static int period;
+static int master = 0;              // master phase, in samples of the period
+
+
+/*
+ * Greatest common divisor, for the rate ratios of the multiplex.
+ */
+int gcd(int a, int b) {
+    while(b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * Builds the tables for a multiplex at 'rate' Hz. Returns -1 if the rate
+ * cannot carry the subcarriers.
+ */
+int subcarrier_init(int rate) {
+    if(rate <= 3 * PILOT_FREQ * 2) {
+        fprintf(stderr, "Error: %d Hz is too low a rate for the 57 kHz subcarrier.\n", rate);
+        return -1;
+    }
+
+    int g = gcd(rate, PILOT_FREQ);
+    period = rate / g;
+    int cycles = PILOT_FREQ / g;
+    if(period > MAX_PERIOD) {
+        fprintf(stderr, "Error: the pilot does not fit a %d Hz sample grid.\n", rate);
+        return -1;
+    }
+
+    subcarrier_close();
+    sine = malloc(period * sizeof(float));
+    if(sine == NULL) return -1;
+    for(int i=0; i<period; i++) sine[i] = sin(2 * M_PI * i / period);
+
+    for(int h=0; h<3; h++) {
+        harmonic[h] = malloc(period * sizeof(float));
+        if(harmonic[h] == NULL) return -1;
+        // Harmonic h+1 advances h+1 times as fast through the same cycle
+        long step = (long)(h + 1) * cycles;
+        for(int i=0; i<period; i++) harmonic[h][i] = sine[(i * step) % period];
+    }
+    master = 0;
+    return 0;
+}
+
+static void copy_block(float *dest, float *table, int pos, int count) {
+    while(count > 0) {
+        int n = period - pos;
+        if(n > count) n = count;
+        memcpy(dest, table + pos, n * sizeof(float));
+        dest += n;
+        count -= n;
+        pos = 0;
+    }
+}
+
+/*
+ * Fills the next 'count' samples of the pilot, the stereo carrier and the
+ * RDS carrier (any of them may be NULL), and advances the master phase.
+ */
+void get_subcarriers(float *pilot, float *stereo, float *rds, int count) {
+    if(pilot) copy_block(pilot, harmonic[0], master, count);
+    if(stereo) copy_block(stereo, harmonic[1], master, count);
+    if(rds) copy_block(rds, harmonic[2], master, count);
+    master = (master + count) % period;
+}
+
+/*
+ * Same as get_subcarriers(), from the absolute sample 'position' and without
+ * moving the master phase: threads rendering different parts of a signal
+ * can call it at the same time.
+ */
+void get_subcarriers_at(uint64_t position, float *pilot, float *stereo, float *rds, int count) {
+    int pos = position % period;
+    if(pilot) copy_block(pilot, harmonic[0], pos, count);
+    if(stereo) copy_block(stereo, harmonic[1], pos, count);
+    if(rds) copy_block(rds, harmonic[2], pos, count);
+}
+
+void subcarrier_close() {
+    free(sine);
+    sine = NULL;
+    for(int h=0; h<3; h++) {
+        free(harmonic[h]);
+        harmonic[h] = NULL;
+    }
+}
@@ -0,0 +1,35 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SUBCARRIER_H
+#define SUBCARRIER_H
+
+#include <stdint.h>
+
+// Frequency of the stereo pilot, whose harmonics are the other subcarriers
+#define PILOT_FREQ 19000
+
+extern int gcd(int a, int b);
+extern int subcarrier_init(int rate);
+extern void get_subcarriers(float *pilot, float *stereo, float *rds, int count);
+extern void get_subcarriers_at(uint64_t position, float *pilot, float *stereo, float *rds, int count);
+extern void subcarrier_close();
+
+#endif /* SUBCARRIER_H */
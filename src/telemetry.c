@@ -0,0 +1,141 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    telemetry.c: timing counters of the DMA producer loop.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+/* Only the producer loop writes the counters. Every field is a separate
+   relaxed atomic, so other threads can read them at any time without
+   locking and without ever seeing a torn value; a snapshot may however mix
+   values from two consecutive passes, which is fine for monitoring.
+ */
+#define STORE(field, value) __atomic_store_n(&stats.field, (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+static struct tx_telemetry stats;
+static int ring_size;
+static int rate;
+static uint64_t last_wakeup = 0;
+
+void telemetry_init(int ring_samples, int sample_rate) {
+    memset(&stats, 0, sizeof(stats));
+    stats.lead_min = UINT32_MAX;
+    ring_size = ring_samples;
+    rate = sample_rate;
+    last_wakeup = 0;
+}
+
+/* Monotonic time in µs */
+uint64_t telemetry_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Called when the producer wakes up, with the number of ring slots the DMA
+   engine has played since the previous refill. The writer always refills
+   the ring up to the DMA position, so the remaining lead is the rest of the
+   ring. If more time has passed than the ring lasts, the DMA engine has gone
+   round it and replayed stale samples: free_slots then only shows what is
+   left after the last full turn.
+ */
+void telemetry_wakeup(int free_slots, uint64_t now) {
+    uint32_t lead = ring_size - free_slots;
+
+    if(last_wakeup != 0) {
+        uint64_t expected = (now - last_wakeup) * rate / 1000000;
+        if(expected > free_slots + ring_size / 2) {
+            STORE(underruns, stats.underruns + 1);
+            STORE(underrun_samples, stats.underrun_samples + expected - free_slots);
+            lead = 0;
+        }
+    }
+    last_wakeup = now;
+
+    STORE(passes, stats.passes + 1);
+    if(lead < stats.lead_min) STORE(lead_min, lead);
+    if(lead > stats.lead_max) STORE(lead_max, lead);
+    STORE(lead_sum, stats.lead_sum + lead);
+
+    int bin = (uint64_t)lead * TELEMETRY_LEAD_BINS / ring_size;
+    if(bin >= TELEMETRY_LEAD_BINS) bin = TELEMETRY_LEAD_BINS - 1;
+    STORE(lead_hist[bin], stats.lead_hist[bin] + 1);
+}
+
+void telemetry_sleep(uint64_t requested_us, uint64_t start, uint64_t end) {
+    uint64_t slept = end - start;
+    uint32_t jitter = slept > requested_us ? slept - requested_us : 0;
+
+    if(jitter > stats.jitter_max_us) STORE(jitter_max_us, jitter);
+    STORE(jitter_sum_us, stats.jitter_sum_us + jitter);
+}
+
+void telemetry_mpx(uint64_t start, uint64_t end) {
+    uint32_t elapsed = end - start;
+
+    STORE(mpx_calls, stats.mpx_calls + 1);
+    if(elapsed > stats.mpx_max_us) STORE(mpx_max_us, elapsed);
+    STORE(mpx_sum_us, stats.mpx_sum_us + elapsed);
+}
+
+void telemetry_snapshot(struct tx_telemetry *out) {
+    out->passes = LOAD(passes);
+    out->lead_min = LOAD(lead_min);
+    out->lead_max = LOAD(lead_max);
+    out->lead_sum = LOAD(lead_sum);
+    for(int i=0; i<TELEMETRY_LEAD_BINS; i++) {
+        out->lead_hist[i] = LOAD(lead_hist[i]);
+    }
+    out->underruns = LOAD(underruns);
+    out->underrun_samples = LOAD(underrun_samples);
+    out->jitter_max_us = LOAD(jitter_max_us);
+    out->jitter_sum_us = LOAD(jitter_sum_us);
+    out->mpx_calls = LOAD(mpx_calls);
+    out->mpx_max_us = LOAD(mpx_max_us);
+    out->mpx_sum_us = LOAD(mpx_sum_us);
+}
+
+void telemetry_print(FILE *f) {
+    struct tx_telemetry t;
+    telemetry_snapshot(&t);
+
+    if(t.passes == 0) return;
+
+    float ms = 1000. / rate;
+    fprintf(f, "DMA lead: min %.1f ms, avg %.1f ms, max %.1f ms over %u passes\n",
+        t.lead_min * ms, (float)t.lead_sum / t.passes * ms, t.lead_max * ms, t.passes);
+    fprintf(f, "Lead histogram (%.1f ms bins):", ring_size * ms / TELEMETRY_LEAD_BINS);
+    for(int i=0; i<TELEMETRY_LEAD_BINS; i++) {
+        fprintf(f, " %u", t.lead_hist[i]);
+    }
+    fprintf(f, "\n");
+    fprintf(f, "Underruns: %u (%llu samples replayed)\n", t.underruns,
+        (unsigned long long)t.underrun_samples);
+    fprintf(f, "Loop oversleep: avg %llu us, max %u us\n",
+        (unsigned long long)(t.jitter_sum_us / t.passes), t.jitter_max_us);
+    if(t.mpx_calls > 0) {
+        fprintf(f, "fm_mpx_get_samples: avg %llu us, max %u us over %u calls\n",
+            (unsigned long long)(t.mpx_sum_us / t.mpx_calls), t.mpx_max_us, t.mpx_calls);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+    
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TELEMETRY_LEAD_BINS 16
+
+struct tx_telemetry
+{
+    // Producer loop passes
+    uint32_t passes;
+    // Writer lead over the DMA read position when the producer wakes up,
+    // in samples
+    uint32_t lead_min;
+    uint32_t lead_max;
+    uint64_t lead_sum;
+    uint32_t lead_hist[TELEMETRY_LEAD_BINS];
+    // Times the DMA engine went round the whole ring and replayed old
+    // samples, and an estimate of how many it replayed
+    uint32_t underruns;
+    uint64_t underrun_samples;
+    // Oversleep of the producer loop (actual minus requested), in µs
+    uint32_t jitter_max_us;
+    uint64_t jitter_sum_us;
+    // Time spent in fm_mpx_get_samples, in µs
+    uint32_t mpx_calls;
+    uint32_t mpx_max_us;
+    uint64_t mpx_sum_us;
+};
+
+extern void telemetry_init(int ring_samples, int sample_rate);
+extern uint64_t telemetry_now();
+extern void telemetry_wakeup(int free_slots, uint64_t now);
+extern void telemetry_sleep(uint64_t requested_us, uint64_t start, uint64_t end);
+extern void telemetry_mpx(uint64_t start, uint64_t end);
+extern void telemetry_snapshot(struct tx_telemetry *out);
+extern void telemetry_print(FILE *f);
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,159 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Timer wheel for the periodic tasks of the control thread.
+
+   Tasks are due at a sample of the output timeline rather than at a wall
+   clock time, so that they follow what is actually on the air. They run
+   RUN_AHEAD samples before the encoder gets to their due sample: a change
+   they queue for that sample is then applied at the group boundary nearest
+   to it, whatever the length of the DMA ring. The wheel
+   is a ring of slots, one per TICK_SAMPLES; a task waits in the slot of its
+   due tick, tasks more than a turn ahead simply stay in their slot until
+   their turn comes. The next run of a periodic task is counted from the
+   previous due sample, not from the time the task really ran, so that the
+   periods add up exactly.
+
+   Tasks must be scheduled and cancelled on the control thread, or before
+   start_timer_wheel() is called.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer_wheel.h"
+#include "control_pipe.h"
+#include "rds.h"
+
+#define WHEEL_SLOTS 256
+#define TICK_MS 10
+#define RUN_AHEAD_MS 200 // two RDS groups, and a buffer of baseband
+#define TICK_SAMPLES (get_rds_sample_rate() * TICK_MS / 1000)
+#define RUN_AHEAD ((uint64_t)get_rds_sample_rate() * RUN_AHEAD_MS / 1000)
+
+static struct timer_task *wheel[WHEEL_SLOTS];
+static uint64_t next_tick = 0;
+static int timer_fd = -1;
+
+
+static void insert_task(struct timer_task *task) {
+    uint64_t tick = task->due / TICK_SAMPLES;
+    // A task already due goes to the next slot visited
+    if(tick < next_tick) tick = next_tick;
+
+    task->slot = tick % WHEEL_SLOTS;
+    task->next = wheel[task->slot];
+    wheel[task->slot] = task;
+    task->scheduled = 1;
+}
+
+void schedule_timer(struct timer_task *task, uint64_t due, timer_handler run, void *ctx) {
+    if(task->scheduled) cancel_timer(task);
+
+    task->due = due;
+    task->run = run;
+    task->ctx = ctx;
+    insert_task(task);
+}
+
+void cancel_timer(struct timer_task *task) {
+    if(!task->scheduled) return;
+
+    struct timer_task **p = &wheel[task->slot];
+    while(*p && *p != task) p = &(*p)->next;
+    if(*p) *p = task->next;
+    task->scheduled = 0;
+}
+
+/*
+ * Runs the tasks whose due sample is about to be generated.
+ */
+static void run_timers(int fd, uint32_t events, void *ctx) {
+    uint64_t expirations;
+    read(fd, &expirations, sizeof(expirations));
+
+    uint64_t now = get_written_position();
+    if(now == 0) return;
+    now += RUN_AHEAD;
+    uint64_t tick = now / TICK_SAMPLES;
+
+    // Slots whose time has come since the last run. The first run, or one
+    // after a stall of a whole turn, visits them all
+    uint64_t slots = WHEEL_SLOTS;
+    if(next_tick != 0 && tick + 1 - next_tick < WHEEL_SLOTS) slots = tick + 1 - next_tick;
+
+    struct timer_task *expired = NULL;
+    for(uint64_t i=0; i<slots; i++) {
+        struct timer_task **p = &wheel[(tick - i) % WHEEL_SLOTS];
+        while(*p) {
+            struct timer_task *task = *p;
+            if(task->due <= now) {
+                *p = task->next;
+                task->scheduled = 0;
+                task->next = expired;
+                expired = task;
+            } else {
+                p = &task->next;
+            }
+        }
+    }
+    next_tick = tick + 1;
+
+    while(expired) {
+        struct timer_task *task = expired;
+        expired = task->next;
+
+        uint64_t interval = task->run(task);
+        if(interval == 0 || task->scheduled) continue;
+
+        // Periods add up from the due sample. After a stall, the missed
+        // runs are dropped instead of being caught up with
+        task->due += interval;
+        if(task->due <= now) task->due = now + interval;
+        insert_task(task);
+    }
+}
+
+/*
+ * Starts running the tasks from the control thread. Returns -1 on error.
+ */
+int start_timer_wheel() {
+    if(timer_fd >= 0) return 0;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec interval = {
+        { 0, TICK_MS * 1000000 }, { 0, TICK_MS * 1000000 }
+    };
+    if(timer_fd < 0 || timerfd_settime(timer_fd, 0, &interval, NULL) < 0) return -1;
+
+    if(start_control_thread() < 0) return -1;
+    if(control_watch_fd(timer_fd, run_timers, NULL) < 0) return -1;
+
+    return 0;
+}
+
+/*
+ * To be called once the control thread has been stopped.
+ */
+void close_timer_wheel() {
+    if(timer_fd >= 0) close(timer_fd);
+    timer_fd = -1;
+}
@@ -0,0 +1,46 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+struct timer_task;
+
+// Runs a task, returns the number of samples until its next run, 0 to stop
+typedef uint64_t (*timer_handler)(struct timer_task *task);
+
+struct timer_task
+{
+    uint64_t due;       // output sample at which the task runs
+    timer_handler run;
+    void *ctx;
+    struct timer_task *next;
+    int slot;
+    int scheduled;
+};
+
+extern int start_timer_wheel();
+extern void close_timer_wheel();
+extern void schedule_timer(struct timer_task *task, uint64_t due, timer_handler run, void *ctx);
+extern void cancel_timer(struct timer_task *task);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,441 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    uecp.c: server for the EBU Universal Encoder Communication Protocol
+    (SPB 490), the protocol used by playout systems to drive RDS encoders.
+    It listens on a TCP port, a Unix domain socket or a pseudo-terminal, and
+    is served by the control thread.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "uecp.h"
+#include "control_pipe.h"
+#include "rds.h"
+
+#define MAX_CONNECTIONS 8
+#define MAX_FRAME 263 // address (2), SQC, MFL, message field (255), CRC (2)
+#define MAX_COMMANDS 64
+#define STA 0xFE
+#define STP 0xFF
+#define ESC 0xFD
+
+struct uecp_conn
+{
+    int fd;
+    int is_socket;
+    int in_frame;
+    int escape;
+    uint8_t frame[MAX_FRAME];
+    int len;
+};
+
+// Commands of one frame, queued together
+struct uecp_batch
+{
+    struct rds_command cmds[MAX_COMMANDS];
+    int count;
+    int ps_set;
+    int rt_set;
+};
+
+static struct uecp_conn conns[MAX_CONNECTIONS];
+static int listen_fd = -1;
+static int pty_slave_fd = -1;
+static char *unix_path = NULL;
+static int rt_from_dbus = 0;
+static int server_open = 0;
+
+
+/* CRC-CCITT, as computed in annex of SPB 490: initial value 0xFFFF,
+   inverted result. Covers the frame from the address to the message field,
+   before byte stuffing.
+ */
+uint16_t uecp_crc(uint8_t *data, int len) {
+    uint16_t crc = 0xFFFF;
+
+    for(int i=0; i<len; i++) {
+        crc = (uint8_t)(crc >> 8) | (crc << 8);
+        crc ^= data[i];
+        crc ^= (uint8_t)(crc & 0xFF) >> 4;
+        crc ^= (crc << 8) << 4;
+        crc ^= ((crc & 0xFF) << 4) << 1;
+    }
+
+    return crc ^ 0xFFFF;
+}
+
+static void drop_conn(struct uecp_conn *c) {
+    control_unwatch_fd(c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/*
+ * Sends an acknowledgement message (MEC 0x18) for the frame with sequence
+ * counter 'sqc', from the address the frame was sent to.
+ */
+static void send_ack(struct uecp_conn *c, uint8_t *addr, uint8_t code, uint8_t sqc) {
+    uint8_t raw[9] = { addr[0], addr[1], 0, 3, UECP_MEC_ACK, code, sqc };
+    uint8_t out[2 + 2 * sizeof(raw)];
+    int len = 0;
+
+    uint16_t crc = uecp_crc(raw, 7);
+    raw[7] = crc >> 8;
+    raw[8] = crc & 0xFF;
+
+    out[len++] = STA;
+    for(int i=0; i<sizeof(raw); i++) {
+        if(raw[i] >= ESC) {
+            out[len++] = ESC;
+            out[len++] = raw[i] - ESC;
+        } else {
+            out[len++] = raw[i];
+        }
+    }
+    out[len++] = STP;
+
+    ssize_t sent;
+    if(c->is_socket) sent = send(c->fd, out, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    else sent = write(c->fd, out, len);
+    if(sent != len && c->is_socket) drop_conn(c);
+}
+
+static struct rds_command *add_command(struct uecp_batch *b, int type, int value) {
+    if(b->count == MAX_COMMANDS) return NULL;
+
+    struct rds_command *cmd = &b->cmds[b->count++];
+    memset(cmd, 0, sizeof(struct rds_command));
+    cmd->type = type;
+    cmd->value = value;
+    return cmd;
+}
+
+static int check_dsn(uint8_t dsn) {
+    // Only one data set: the current one (0 or 1), or all of them
+    return dsn == 0 || dsn == 1 || dsn == 0xFF;
+}
+
+/*
+ * Decodes the message at *pp, and adds the corresponding commands to the
+ * batch. Returns an acknowledgement code, UECP_ACK_OK on success.
+ */
+static int decode_message(uint8_t **pp, uint8_t *end, struct uecp_batch *b) {
+    uint8_t *p = *pp;
+    uint8_t mec = *p++;
+    int len;
+    struct rds_command *cmd;
+
+    // Length of the data following the MEC
+    switch(mec) {
+        case UECP_MEC_PI: len = 4; break;
+        case UECP_MEC_PS: len = 10; break;
+        case UECP_MEC_TA_TP: len = 3; break;
+        case UECP_MEC_PTY: len = 3; break;
+        case UECP_MEC_CT: len = 1; break;
+        case UECP_MEC_RT:
+        case UECP_MEC_AF:
+            if(end - p < 3) return UECP_ACK_MEL_ERROR;
+            len = 3 + p[2];
+            break;
+        case UECP_MEC_GROUP_SEQUENCE:
+            if(end - p < 2) return UECP_ACK_MEL_ERROR;
+            len = 2 + p[1];
+            break;
+        default:
+            return UECP_ACK_UNKNOWN_MEC;
+    }
+    if(end - p < len) return UECP_ACK_MEL_ERROR;
+    if(mec != UECP_MEC_CT && !check_dsn(p[0])) return UECP_ACK_DSN_ERROR;
+    *pp = p + len;
+
+    switch(mec) {
+        case UECP_MEC_PI:
+            if(!add_command(b, RDS_CMD_PI, p[2] << 8 | p[3])) return UECP_ACK_OUT_OF_RANGE;
+            break;
+        case UECP_MEC_PS:
+            if(!(cmd = add_command(b, RDS_CMD_PS, 0))) return UECP_ACK_OUT_OF_RANGE;
+            memcpy(cmd->text, p + 2, 8);
+            b->ps_set = 1;
+            break;
+        case UECP_MEC_TA_TP:
+            if(!add_command(b, RDS_CMD_TA, p[2] & 1)) return UECP_ACK_OUT_OF_RANGE;
+            if(!add_command(b, RDS_CMD_TP, (p[2] >> 1) & 1)) return UECP_ACK_OUT_OF_RANGE;
+            break;
+        case UECP_MEC_PTY:
+            if(p[2] > 31) return UECP_ACK_OUT_OF_RANGE;
+            if(!add_command(b, RDS_CMD_PTY, p[2])) return UECP_ACK_OUT_OF_RANGE;
+            break;
+        case UECP_MEC_CT:
+            if(!add_command(b, RDS_CMD_CT, p[0] != 0)) return UECP_ACK_OUT_OF_RANGE;
+            break;
+        case UECP_MEC_RT: {
+            // MEL 0 clears the text, otherwise a configuration byte precedes it
+            int text_len = p[2] ? p[2] - 1 : 0;
+            if(text_len > 64) return UECP_ACK_OUT_OF_RANGE;
+            if(rt_from_dbus) {
+                printf("RT was not set. Pulling from metadata.\n");
+                break;
+            }
+            if(!(cmd = add_command(b, RDS_CMD_RT, 0))) return UECP_ACK_OUT_OF_RANGE;
+            memcpy(cmd->text, p + 4, text_len);
+            b->rt_set = 1;
+            break;
+        }
+        case UECP_MEC_AF:
+            // The list replaces the current one. Method A codes: 224-249 give
+            // the number of AFs, 205 is a filler, 250 announces a LF/MF
+            // frequency in the next byte, which we cannot send
+            if(!add_command(b, RDS_CMD_AF_CLEAR, 0)) return UECP_ACK_OUT_OF_RANGE;
+            for(int i=0; i<p[2]; i++) {
+                uint8_t code = p[3+i];
+                if(code == 250) i++;
+                else if(code >= 1 && code <= 204) {
+                    if(!add_command(b, RDS_CMD_AF_ADD, code)) return UECP_ACK_OUT_OF_RANGE;
+                }
+            }
+            break;
+        case UECP_MEC_GROUP_SEQUENCE:
+            if(p[1] == 0 || p[1] > 32) return UECP_ACK_OUT_OF_RANGE;
+            for(int i=0; i<p[1]; i++) {
+                if(!rds_group_supported(p[2+i])) return UECP_ACK_OUT_OF_RANGE;
+            }
+            if(!(cmd = add_command(b, RDS_CMD_GROUP_SEQUENCE, p[1]))) return UECP_ACK_OUT_OF_RANGE;
+            memcpy(cmd->text, p + 2, p[1]);
+            break;
+    }
+
+    return UECP_ACK_OK;
+}
+
+/*
+ * Checks a complete (unstuffed) frame, and applies all its messages at the
+ * same group boundary. If any message is invalid, none is applied. Frames
+ * with a sequence counter are acknowledged, the others only get a negative
+ * acknowledgement when something goes wrong.
+ */
+static void process_frame(struct uecp_conn *c) {
+    uint8_t *f = c->frame;
+    int len = c->len;
+    struct uecp_batch batch;
+
+    if(len < 6) return;
+
+    uint8_t sqc = f[2];
+    uint8_t mfl = f[3];
+    int code = UECP_ACK_OK;
+
+    if(uecp_crc(f, len - 2) != (f[len-2] << 8 | f[len-1])) code = UECP_ACK_CRC_ERROR;
+    else if(mfl != len - 6) code = UECP_ACK_MFL_ERROR;
+
+    batch.count = 0;
+    batch.ps_set = 0;
+    batch.rt_set = 0;
+    uint8_t *p = f + 4;
+    while(code == UECP_ACK_OK && p < f + 4 + mfl) {
+        code = decode_message(&p, f + 4 + mfl, &batch);
+    }
+
+    if(code == UECP_ACK_OK) {
+        submit_rds_commands(batch.cmds, batch.count);
+        if(batch.ps_set) raise_control_event(CONTROL_PIPE_PS_SET);
+        if(batch.rt_set) raise_control_event(CONTROL_PIPE_RT_SET);
+    } else {
+        fprintf(stderr, "Error: UECP frame rejected (code %d).\n", code);
+    }
+
+    if(sqc != 0 || code != UECP_ACK_OK) send_ack(c, f, code, sqc);
+}
+
+static void read_conn(int fd, uint32_t events, void *ctx) {
+    struct uecp_conn *c = ctx;
+    uint8_t buf[1024];
+    ssize_t len;
+
+    while((len = read(fd, buf, sizeof(buf))) > 0) {
+        for(int i=0; i<len; i++) {
+            uint8_t byte = buf[i];
+
+            if(byte == STA) {
+                // A start byte always starts a new frame
+                c->in_frame = 1;
+                c->escape = 0;
+                c->len = 0;
+                continue;
+            }
+            if(!c->in_frame) continue;
+            if(byte == STP) {
+                c->in_frame = 0;
+                process_frame(c);
+                if(c->fd < 0) return;
+                continue;
+            }
+            if(c->escape) {
+                c->escape = 0;
+                if(byte > 2) {
+                    c->in_frame = 0;
+                    continue;
+                }
+                byte += ESC;
+            } else if(byte == ESC) {
+                c->escape = 1;
+                continue;
+            }
+            if(c->len == MAX_FRAME) {
+                c->in_frame = 0;
+                continue;
+            }
+            c->frame[c->len++] = byte;
+        }
+    }
+    if(c->is_socket && (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))) drop_conn(c);
+}
+
+static struct uecp_conn *new_conn(int fd, int is_socket) {
+    for(int i=0; i<MAX_CONNECTIONS; i++) {
+        if(conns[i].fd >= 0) continue;
+
+        conns[i].fd = fd;
+        conns[i].is_socket = is_socket;
+        conns[i].in_frame = 0;
+        conns[i].escape = 0;
+        conns[i].len = 0;
+        if(control_watch_fd(fd, read_conn, &conns[i]) < 0) {
+            conns[i].fd = -1;
+            return NULL;
+        }
+        return &conns[i];
+    }
+    return NULL;
+}
+
+static void accept_conn(int fd, uint32_t events, void *ctx) {
+    int conn_fd;
+
+    while((conn_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if(new_conn(conn_fd, 1) == NULL) {
+            fprintf(stderr, "Error: too many UECP connections, connection refused.\n");
+            close(conn_fd);
+        }
+    }
+}
+
+static int open_pty() {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) return -1;
+
+    // Raw 8-bit line, and keep the slave side open so that the master does
+    // not hang up whenever the encoder software closes it
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+    pty_slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+
+    if(new_conn(fd, 0) == NULL) return -1;
+    printf("UECP encoder on %s.\n", ptsname(fd));
+
+    return 0;
+}
+
+/*
+ * Starts the UECP server. 'spec' is "pty", the path of a Unix domain socket,
+ * or a TCP port, optionally preceded by the address to listen on
+ * ("0.0.0.0:4001"; the default is the loopback interface).
+ */
+int open_uecp_server(char *spec, int dbus_mediainfo) {
+    for(int i=0; i<MAX_CONNECTIONS; i++) conns[i].fd = -1;
+    rt_from_dbus = dbus_mediainfo;
+    server_open = 1;
+
+    if(start_control_thread() < 0) return -1;
+
+    if(strcmp(spec, "pty") == 0) return open_pty();
+
+    if(strchr(spec, '/')) {
+        struct sockaddr_un addr;
+        if(strlen(spec) >= sizeof(addr.sun_path)) return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, spec);
+        unlink(spec);
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+        chmod(spec, 0666);
+        unix_path = spec;
+    } else {
+        struct sockaddr_in addr;
+        char host[64] = "127.0.0.1";
+        char *port = strrchr(spec, ':');
+        if(port) {
+            snprintf(host, sizeof(host), "%.*s", (int)(port - spec), spec);
+            port++;
+        } else {
+            port = spec;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(port));
+        if(inet_pton(AF_INET, host, &addr.sin_addr) != 1) return -1;
+
+        int one = 1;
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listen_fd < 0) return -1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+    }
+
+    if(listen(listen_fd, 4) < 0) return -1;
+    if(control_watch_fd(listen_fd, accept_conn, NULL) < 0) return -1;
+
+    return 0;
+}
+
+/*
+ * Closes the server and all the connections. The control thread must have
+ * been stopped (close_control_pipe) first.
+ */
+void close_uecp_server() {
+    if(!server_open) return;
+
+    for(int i=0; i<MAX_CONNECTIONS; i++) {
+        if(conns[i].fd >= 0) close(conns[i].fd);
+        conns[i].fd = -1;
+    }
+    if(pty_slave_fd >= 0) close(pty_slave_fd);
+    if(listen_fd >= 0) close(listen_fd);
+    if(unix_path) unlink(unix_path);
+    pty_slave_fd = listen_fd = -1;
+    unix_path = NULL;
+    server_open = 0;
+}
@@ -0,0 +1,50 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2021 Jan Němec
+
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef UECP_H
+#define UECP_H
+
+#include <stdint.h>
+
+// Message element codes (EBU SPB 490)
+#define UECP_MEC_PI             0x01
+#define UECP_MEC_PS             0x02
+#define UECP_MEC_TA_TP          0x03
+#define UECP_MEC_PTY            0x07
+#define UECP_MEC_RT             0x0A
+#define UECP_MEC_AF             0x13
+#define UECP_MEC_GROUP_SEQUENCE 0x16
+#define UECP_MEC_ACK            0x18
+#define UECP_MEC_CT             0x19
+
+// Response codes of the acknowledgement message
+#define UECP_ACK_OK             0
+#define UECP_ACK_CRC_ERROR      1
+#define UECP_ACK_UNKNOWN_MEC    3
+#define UECP_ACK_DSN_ERROR      4
+#define UECP_ACK_OUT_OF_RANGE   6
+#define UECP_ACK_MEL_ERROR      7
+#define UECP_ACK_MFL_ERROR      8
+
+extern uint16_t uecp_crc(uint8_t *data, int len);
+extern int open_uecp_server(char *spec, int dbus_mediainfo);
+extern void close_uecp_server();
+
+#endif /* UECP_H */
@@ -1,8 +1,75 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2014 Christophe Jacquet, F8FTK
+    Copyright (C) 2021 Jan Němec
 
-/* This file was automatically generated by "generate_waveforms.py".
-   (C) 2014 Christophe Jacquet.
-   Released under the GNU GPL v3 license.
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    
+    waveforms.c: computes the shaped biphase symbol of RDS.
 */
 
-float waveform_biphase[] = {0.00253265133022, 0.00255504491037, 0.00256667102126, 0.0025672385497, 0.00255649674667, 0.00253423716573, 0.00250029547253, 0.00245455311551, 0.00239693884806, 0.00232743009314, 0.00224605414143, 0.00215288917468, 0.00204806510656, 0.00193176423352, 0.00180422168917, 0.00166572569587, 0.00151661760823, 0.00135729174364, 0.00118819499588, 0.00100982622839, 0.000822735444702, 0.000627522734284, 0.000424836992883, 0.000215374417197, -1.23225298158e-07, -0.000220870549765, -0.000446040728168, -0.000674767880774, -0.000906149680707, -0.00113925016637, -0.00137310275567, -0.00160671345499, -0.00183906425517, -0.00206911670572, -0.00229581565752, -0.00251809316382, -0.00273487252813, -0.00294507248686, -0.0031476115141, -0.00334141223473, -0.0035254059317, -0.00369853713255, -0.00385976825946, -0.00400808432674, -0.00414249766903, -0.00426205268297, -0.00436583056466, -0.00445295402495, -0.00452259196407, -0.00457396408696, -0.00460634544047, -0.00461907085337, -0.00461153926002, -0.00458321788861, -0.00453364629481, -0.00446244022186, -0.0043692952683, -0.00425399034471, -0.0041163909013, -0.00395645190841, -0.00377422057251, -0.0035698387709, -0.00334354518872, -0.00309567714275, -0.00282667207705, -0.00253706871632, -0.00222750786389, -0.00189873283191, -0.00155158949247, -0.0011870259394, -0.000806091751623, -0.000409936849938, 1.90059383236e-07, 0.00042294345989, 0.000856883423268, 0.00130047843362, 0.00175210863919, 0.00221006953169, 0.00267257605183, 0.00313776711824, 0.0036037105756, 0.00406840855594, 0.00452980324611, 0.00498578305229, 0.00543418915128, 0.00587282241677, 0.00629945070701, 0.00671181649912, 0.00710764485348, 0.00748465169059, 0.00784055236082, 0.00817307048659, 0.00847994705483, 0.00875894973632, 0.00900788240743, 0.00922459484812, 0.00940699258958, 0.00955304688301, 0.00966080476069, 0.00972839915915, 0.00975405907344, 0.00973611971083, 0.00967303261139, 0.00956337570235, 0.00940586325271, 0.00919935569384, 0.00894286927184, 0.00863558549687, 0.00827686035476, 0.00786623324593, 0.00740343561706, 0.00688839925073, 0.00632126417893, 0.00570238618641, 0.00503234387065, 0.0043119452256, 0.00354223371723, 0.00272449381977, 0.0018602559824, 0.000951300997274, -3.36259008787e-07, -0.000992363737284, -0.0020222298062, -0.00308712154498, -0.00418396376074, -0.00530941875093, -0.0064598868296, -0.00763150763453, -0.00882016223, -0.0100214760183, -0.011230822471, -0.0124433276877, -0.0136538757908, -0.0148571151577, -0.0160474654948, -0.0172191257514, -0.0183660828705, -0.0194821213717, -0.0205608337587, -0.0215956317392, -0.0225797582461, -0.0235063002445, -0.0243682023052, -0.0251582809259, -0.0258692395759, -0.0264936844398, -0.0270241408326, -0.0274530702548, -0.0277728880563, -0.0279759816737, -0.0280547294041, -0.0280015196764, -0.0278087707783, -0.0274689509968, -0.026974599126, -0.0263183452962, -0.0254929320749, -0.02449123579, -0.0233062880235, -0.0219312972225, -0.0203596703733, -0.0185850346832, -0.0166012592143, -0.0144024764108, -0.0119831034641, -0.00933786345535, -0.00646180621834, -0.0033503288631, 8.04098443393e-07, 0.00359544108347, 0.0074370242845, 0.0115285710889, 0.0158726561293, 0.0204713940206, 0.0253264228417, 0.0304388884133, 0.0358094294279, 0.041438163483, 0.0473246740673, 0.0534679985499, 0.0598666172177, 0.0665184434076, 0.0734208147742, 0.0805704857345, 0.0879636211267, 0.0955957911196, 0.103461967402, 0.111556520688, 0.119873219553, 0.128405230643, 0.137145120254, 0.146084857323, 0.155215817824, 0.164528790593, 0.174013984585, 0.18366103756, 0.193459026213, 0.203396477728, 0.213461382761, 0.223641209834, 0.233922921126, 0.244292989649, 0.254737417779, 0.265241757122, 0.275791129685, 0.286370250309, 0.296963450356, 0.307554702567, 0.318127647097, 0.328665618632, 0.339151674584, 0.349568624272, 0.359899059063, 0.37012538339, 0.380229846614, 0.39019457563, 0.400001608191, 0.40963292682, 0.419070493361, 0.428296283903, 0.437292324199, 0.446040725381, 0.45452371993, 0.462723697829, 0.470623242797, 0.478205168549, 0.485452554966, 0.492348784132, 0.498877576118, 0.505023024448, 0.510769631171, 0.516102341434, 0.521006577488, 0.525468272051, 0.529473900929, 0.533010514831, 0.536065770289, 0.538627959622, 0.540686039841, 0.542229660459, 0.543249190098, 0.543735741853, 0.543681197332, 0.543078229311, 0.541920322948, 0.540201795495, 0.537917814453, 0.535064414122, 0.5316385105, 0.527637914479, 0.523061343309, 0.51790843029, 0.512179732652, 0.505876737611, 0.499001866561, 0.491558477398, 0.483550864942, 0.474984259467, 0.46586482332, 0.456199645625, 0.445996735085, 0.43526501088, 0.424014291681, 0.412255282783, 0.399999561397, 0.387259560081, 0.374048548451, 0.360380613021, 0.346270635398, 0.331734268754, 0.316787912671, 0.301448686393, 0.28573440054, 0.269663527349, 0.253255169494, 0.236529027553, 0.219505366195, 0.202204979147, 0.184649153022, 0.166859630089, 0.148858570049, 0.13066851092, 0.112312329091, 0.0938131986527, 0.0751945500785, 0.0564800283494, 0.0376934506144, 0.018858763477, 0.0, -0.018858763477, -0.0376934506144, -0.0564800283494, -0.0751945500785, -0.0938131986527, -0.112312329091, -0.13066851092, -0.148858570049, -0.166859630089, -0.184649153022, -0.202204979147, -0.219505366195, -0.236529027553, -0.253255169494, -0.269663527349, -0.28573440054, -0.301448686393, -0.316787912671, -0.331734268754, -0.346270635398, -0.360380613021, -0.374048548451, -0.387259560081, -0.399999561397, -0.412255282783, -0.424014291681, -0.43526501088, -0.445996735085, -0.456199645625, -0.46586482332, -0.474984259467, -0.483550864942, -0.491558477398, -0.499001866561, -0.505876737611, -0.512179732652, -0.51790843029, -0.523061343309, -0.527637914479, -0.5316385105, -0.535064414122, -0.537917814453, -0.540201795495, -0.541920322948, -0.543078229311, -0.543681197332, -0.543735741853, -0.543249190098, -0.542229660459, -0.540686039841, -0.538627959622, -0.536065770289, -0.533010514831, -0.529473900929, -0.525468272051, -0.521006577488, -0.516102341434, -0.510769631171, -0.505023024448, -0.498877576118, -0.492348784132, -0.485452554966, -0.478205168549, -0.470623242797, -0.462723697829, -0.45452371993, -0.446040725381, -0.437292324199, -0.428296283903, -0.419070493361, -0.40963292682, -0.400001608191, -0.39019457563, -0.380229846614, -0.37012538339, -0.359899059063, -0.349568624272, -0.339151674584, -0.328665618632, -0.318127647097, -0.307554702567, -0.296963450356, -0.286370250309, -0.275791129685, -0.265241757122, -0.254737417779, -0.244292989649, -0.233922921126, -0.223641209834, -0.213461382761, -0.203396477728, -0.193459026213, -0.18366103756, -0.174013984585, -0.164528790593, -0.155215817824, -0.146084857323, -0.137145120254, -0.128405230643, -0.119873219553, -0.111556520688, -0.103461967402, -0.0955957911196, -0.0879636211267, -0.0805704857345, -0.0734208147742, -0.0665184434076, -0.0598666172177, -0.0534679985499, -0.0473246740673, -0.041438163483, -0.0358094294279, -0.0304388884133, -0.0253264228417, -0.0204713940206, -0.0158726561293, -0.0115285710889, -0.0074370242845, -0.00359544108347, -8.04098443393e-07, 0.0033503288631, 0.00646180621834, 0.00933786345535, 0.0119831034641, 0.0144024764108, 0.0166012592143, 0.0185850346832, 0.0203596703733, 0.0219312972225, 0.0233062880235, 0.02449123579, 0.0254929320749, 0.0263183452962, 0.026974599126, 0.0274689509968, 0.0278087707783, 0.0280015196764, 0.0280547294041, 0.0279759816737, 0.0277728880563, 0.0274530702548, 0.0270241408326, 0.0264936844398, 0.0258692395759, 0.0251582809259, 0.0243682023052, 0.0235063002445, 0.0225797582461, 0.0215956317392, 0.0205608337587, 0.0194821213717, 0.0183660828705, 0.0172191257514, 0.0160474654948, 0.0148571151577, 0.0136538757908, 0.0124433276877, 0.011230822471, 0.0100214760183, 0.00882016223, 0.00763150763453, 0.0064598868296, 0.00530941875093, 0.00418396376074, 0.00308712154498, 0.0020222298062, 0.000992363737284, 3.36259008787e-07, -0.000951300997274, -0.0018602559824, -0.00272449381977, -0.00354223371723, -0.0043119452256, -0.00503234387065, -0.00570238618641, -0.00632126417893, -0.00688839925073, -0.00740343561706, -0.00786623324593, -0.00827686035476, -0.00863558549687, -0.00894286927184, -0.00919935569384, -0.00940586325271, -0.00956337570235, -0.00967303261139, -0.00973611971083, -0.00975405907344, -0.00972839915915, -0.00966080476069, -0.00955304688301, -0.00940699258958, -0.00922459484812, -0.00900788240743, -0.00875894973632, -0.00847994705483, -0.00817307048659, -0.00784055236082, -0.00748465169059, -0.00710764485348, -0.00671181649912, -0.00629945070701, -0.00587282241677, -0.00543418915128, -0.00498578305229, -0.00452980324611, -0.00406840855594, -0.0036037105756, -0.00313776711824, -0.00267257605183, -0.00221006953169, -0.00175210863919, -0.00130047843362, -0.000856883423268, -0.00042294345989, -1.90059383236e-07, 0.000409936849938, 0.000806091751623, 0.0011870259394, 0.00155158949247, 0.00189873283191, 0.00222750786389, 0.00253706871632, 0.00282667207705, 0.00309567714275, 0.00334354518872, 0.0035698387709, 0.00377422057251, 0.00395645190841, 0.0041163909013, 0.00425399034471, 0.0043692952683, 0.00446244022186, 0.00453364629481, 0.00458321788861, 0.00461153926002, 0.00461907085337, 0.00460634544047, 0.00457396408696, 0.00452259196407, 0.00445295402495, 0.00436583056466, 0.00426205268297, 0.00414249766903, 0.00400808432674, 0.00385976825946, 0.00369853713255, 0.0035254059317, 0.00334141223473, 0.0031476115141, 0.00294507248686, 0.00273487252813, 0.00251809316382, 0.00229581565752, 0.00206911670572, 0.00183906425517, 0.00160671345499, 0.00137310275567, 0.00113925016637, 0.000906149680707, 0.000674767880774, 0.000446040728168, 0.000220870549765, 1.23225298158e-07, -0.000215374417197, -0.000424836992883, -0.000627522734284, -0.000822735444702, -0.00100982622839, -0.00118819499588, -0.00135729174364, -0.00151661760823, -0.00166572569587, -0.00180422168917, -0.00193176423352, -0.00204806510656, -0.00215288917468, -0.00224605414143, -0.00232743009314, -0.00239693884806, -0.00245455311551, -0.00250029547253, -0.00253423716573, -0.00255649674667, -0.0025672385497, -0.00256667102126, -0.00255504491037};
+/* A biphase symbol is a pair of opposite impulses, half a bit apart, passed
+   through the data-shaping filter of the RDS standard:
+   H(f) = cos(pi f td / 4) for f < 2 / td, where td is the bit length. Its
+   impulse response has a closed form, so the symbol is sampled at whatever
+   rate the multiplex runs at, instead of being resampled from a table made
+   offline for 228 kHz (which is what generate_waveforms.py used to do,
+   with the same scaling).
+
+   When a bit is not a whole number of samples long, bits start between two
+   samples: the symbol is then tabulated for each possible fraction of a
+   sample, the 'phases', and every bit uses the one matching its start.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "waveforms.h"
+
+
+/*
+ * Impulse response of the data-shaping filter, 'x' in bits from its
+ * center. It is scaled so that the symbols of three overlapping bits never
+ * saturate the RDS level.
+ */
+static double shaped_impulse(double x) {
+    double d = 1 - 64 * x * x;
+    // Removable singularity at x = +-1/8
+    if(fabs(d) < 1e-9) return 2. / 5.;
+    return 8 * cos(4 * M_PI * x) / (5 * M_PI * d);
+}
+
+/*
+ * Returns 'phases' versions of the biphase symbol, one after the other,
+ * for bits of 'samples_per_bit' samples starting 0, 1/phases, 2/phases...
+ * of a sample before the first sample of the table. Each one covers three
+ * bits, centered on its own, and is '*size' samples long. Returns NULL if
+ * out of memory.
+ */
+float *biphase_waveform(double samples_per_bit, int phases, int *size) {
+    int n = (int)ceil(3 * samples_per_bit);
+    float *waveform = malloc((size_t)phases * n * sizeof(float));
+    if(waveform == NULL) return NULL;
 
+    for(int p=0; p<phases; p++) {
+        for(int j=0; j<n; j++) {
+            double x = (j + (double)p / phases) / samples_per_bit - 1.5;
+            waveform[p * n + j] = shaped_impulse(x + .25) - shaped_impulse(x - .25);
+        }
+    }
+    *size = n;
+    return waveform;
+}
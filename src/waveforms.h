@@ -1,7 +1,27 @@
+/*
+    PiFmRds - FM/RDS transmitter for the Raspberry Pi
+    Copyright (C) 2014 Christophe Jacquet, F8FTK
+    Copyright (C) 2021 Jan Němec
 
-/* This file was automatically generated by "generate_waveforms.py".
-   (C) 2014 Christophe Jacquet.
-   Released under the GNU GPL v3 license.
+    See https://github.com/ChristopheJacquet/PiFmRds
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-extern float waveform_biphase[576];
+#ifndef WAVEFORMS_H
+#define WAVEFORMS_H
+
+extern float *biphase_waveform(double samples_per_bit, int phases, int *size);
+
+#endif /* WAVEFORMS_H */